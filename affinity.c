@@ -0,0 +1,19 @@
+/*
+ * affinity.c - CPU placement helpers
+ */
+#define _GNU_SOURCE
+#include "affinity.h"
+#include <pthread.h>
+#include <sched.h>
+
+int affinity_current_cpu(void) { return sched_getcpu(); }
+
+/* $begin affinity_pin */
+int affinity_pin(int cpu) {
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+/* $end affinity_pin */
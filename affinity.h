@@ -0,0 +1,18 @@
+/*
+ * affinity.h - CPU placement helpers
+ *
+ * Kept in their own file because they need _GNU_SOURCE, which clashes with
+ * csapp.h's gai_error() once <netdb.h> declares the GNU one.
+ */
+/* $begin affinity.h */
+#ifndef __AFFINITY_H__
+#define __AFFINITY_H__
+
+/* CPU the calling thread is running on, or -1 */
+int affinity_current_cpu(void);
+
+/* Pin the calling thread to one CPU; returns 0 or an error number */
+int affinity_pin(int cpu);
+
+#endif /* __AFFINITY_H__ */
+/* $end affinity.h */
@@ -0,0 +1,150 @@
+/*
+ * arena.c - Per-transaction bump allocator
+ */
+#include "arena.h"
+#include "affinity.h"
+#include "stats.h"
+#include <time.h>
+
+#define ARENA_ALIGN 16
+
+struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t size; // Payload bytes (ARENA_CHUNK, or more for a large block).
+    char data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+typedef struct FreeList {
+    pthread_mutex_t lock;
+    ArenaChunk *head;
+    int count;
+} __attribute__((aligned(64))) FreeList; // One cache line each, so neighbouring CPUs do not share one.
+
+static FreeList lists[ARENA_SHARDS];
+static pthread_once_t lists_once = PTHREAD_ONCE_INIT;
+
+static unsigned long transactions, allocs, chunks_reused, chunks_malloced, chunks_freed, large_allocs, total_ns;
+
+static void init_lists(void) {
+    int i;
+
+    for (i = 0; i < ARENA_SHARDS; i++)
+        pthread_mutex_init(&lists[i].lock, NULL);
+}
+
+static FreeList *my_list(void) {
+    int cpu = affinity_current_cpu();
+
+    pthread_once(&lists_once, init_lists);
+    return &lists[(cpu < 0 ? 0 : cpu) % ARENA_SHARDS];
+}
+
+static long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+void arena_init(Arena *a) { memset(a, 0, sizeof(*a)); }
+
+/* A chunk from this CPU's free list, or a new one */
+static ArenaChunk *take_chunk(void) {
+    FreeList *l = my_list();
+    ArenaChunk *c;
+
+    pthread_mutex_lock(&l->lock);
+    if ((c = l->head)) {
+        l->head = c->next;
+        l->count--;
+    }
+    pthread_mutex_unlock(&l->lock);
+    if (c) {
+        STAT_INC(chunks_reused);
+        return c;
+    }
+    if ((c = malloc(sizeof(ArenaChunk) + ARENA_CHUNK))) {
+        c->size = ARENA_CHUNK;
+        STAT_INC(chunks_malloced);
+    }
+    return c;
+}
+
+/* $begin arena_alloc */
+void *arena_alloc(Arena *a, size_t n) {
+    long start = now_ns();
+    ArenaChunk *c;
+    void *p = NULL;
+
+    STAT_INC(allocs);
+    n = (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (n > ARENA_CHUNK) {
+        if ((c = malloc(sizeof(ArenaChunk) + n))) {
+            c->size = n;
+            c->next = a->large;
+            a->large = c;
+            p = c->data;
+            STAT_INC(large_allocs);
+        }
+    } else if (a->head && a->used + n <= ARENA_CHUNK) {
+        p = a->head->data + a->used;
+        a->used += n;
+    } else if ((c = take_chunk())) {
+        c->next = a->head; // The rest of the old head is given up; chunks are big next to what is asked of them.
+        a->head = c;
+        if (!a->tail)
+            a->tail = c;
+        a->nchunks++;
+        a->used = n;
+        p = c->data;
+    }
+    a->ns += now_ns() - start;
+    return p;
+}
+/* $end arena_alloc */
+
+/* $begin arena_reset */
+void arena_reset(Arena *a) {
+    long start = now_ns();
+    FreeList *l;
+    ArenaChunk *c;
+
+    while ((c = a->large)) {
+        a->large = c->next;
+        free(c);
+    }
+    if (a->head) {
+        l = my_list();
+        pthread_mutex_lock(&l->lock);
+        if (l->count + a->nchunks <= ARENA_KEEP) {
+            a->tail->next = l->head; // The whole list at once.
+            l->head = a->head;
+            l->count += a->nchunks;
+            a->head = NULL;
+        }
+        pthread_mutex_unlock(&l->lock);
+        while ((c = a->head)) { // The free list is full.
+            a->head = c->next;
+            free(c);
+            STAT_INC(chunks_freed);
+        }
+    }
+    STAT_INC(transactions);
+    STAT_ADD(total_ns, a->ns + now_ns() - start);
+    arena_init(a);
+}
+/* $end arena_reset */
+
+/* $begin arena_stats */
+int arena_stats(char *buf, size_t size) {
+    unsigned long n = STAT_GET(transactions);
+    int len = 0;
+
+    len += snprintf(buf + len, size - len, "arena.transactions %lu\narena.allocs %lu\narena.large_allocs %lu\n", n, STAT_GET(allocs),
+                    STAT_GET(large_allocs));
+    len += snprintf(buf + len, size - len, "arena.chunks_malloced %lu\narena.chunks_reused %lu\narena.chunks_freed %lu\n",
+                    STAT_GET(chunks_malloced), STAT_GET(chunks_reused), STAT_GET(chunks_freed));
+    len += snprintf(buf + len, size - len, "arena.alloc_ns_total %lu\narena.alloc_ns_per_transaction %lu\n", STAT_GET(total_ns),
+                    n ? STAT_GET(total_ns) / n : 0);
+    return len < size ? len : size - 1;
+}
+/* $end arena_stats */
@@ -0,0 +1,53 @@
+/*
+ * arena.h - Per-transaction bump allocator
+ *
+ * A cache miss used to malloc a MAX_OBJECT_SIZE capture buffer, realloc it
+ * down to the response size, and malloc (and grow with realloc) a relay
+ * buffer besides. With many threads those calls contend inside glibc
+ * malloc. Buffers that live only as long as one transaction are carved
+ * from an Arena instead: a bump pointer over fixed-size chunks, all given
+ * back at once when the transaction ends.
+ *
+ * Chunks are recycled through free lists rather than returned to malloc.
+ * The proxy runs a thread per connection, so per-thread lists would die
+ * with their thread before anything was reused; the lists are per CPU
+ * instead (the CPU the thread is on when it takes or returns chunks), each
+ * under its own lock, so threads on different CPUs do not meet.
+ *
+ * A reset splices the arena's whole chunk list onto a free list in O(1).
+ * Only a request larger than a chunk gets a malloc of its own, freed at
+ * reset. Time spent in the arena is reported per transaction.
+ */
+/* $begin arena.h */
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include "csapp.h"
+
+#define ARENA_CHUNK (192 * 1024) /* Bytes per chunk: a miss's capture and relay buffers fit in one */
+#define ARENA_SHARDS 64          /* Free lists, by CPU number modulo this */
+#define ARENA_KEEP 16            /* Chunks a free list holds at most; more go back to malloc */
+
+typedef struct ArenaChunk ArenaChunk;
+
+typedef struct Arena {
+    ArenaChunk *head, *tail; // Chunks in use, newest first.
+    int nchunks;
+    size_t used;             // Bytes handed out from head.
+    ArenaChunk *large;       // Requests larger than a chunk, one malloc each.
+    long ns;                 // Time spent allocating and resetting.
+} Arena;
+
+void arena_init(Arena *a);
+
+/* n bytes, 16-byte aligned, valid until arena_reset; NULL if out of memory */
+void *arena_alloc(Arena *a, size_t n);
+
+/* Give everything back; the arena can be used again */
+void arena_reset(Arena *a);
+
+/* Write a plain-text report of chunk reuse and allocator time into buf */
+int arena_stats(char *buf, size_t size);
+
+#endif /* __ARENA_H__ */
+/* $end arena.h */
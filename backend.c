@@ -0,0 +1,207 @@
+/*
+ * backend.c - Reverse-proxy (accelerator) mode over a pool of backends
+ */
+#include "backend.h"
+#include "netio.h"
+#include "stats.h"
+#include "upstream.h"
+#include <stdint.h>
+
+typedef struct RingPoint {
+    uint64_t hash;
+    int backend; // Index into backends.
+} RingPoint;
+
+static Backend backends[MAX_BACKENDS];
+static int nbackends = 0;
+static RingPoint ring[MAX_BACKENDS * BACKEND_VNODES];
+static int nring = 0;
+
+static unsigned long picks, no_healthy, rerouted;
+
+/* FNV-1a with a final mix: similar keys ("host:port#1", "#2") must spread over the ring */
+static uint64_t hash_key(char *s, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        h = (h ^ (unsigned char)s[i]) * 1099511628211ULL;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/* $begin backend_add_pool */
+int backend_add_pool(char *list) {
+    char copy[MAXLINE], *tok, *save, *colon;
+
+    snprintf(copy, sizeof(copy), "%s", list);
+    for (tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        if (nbackends == MAX_BACKENDS) {
+            fprintf(stderr, "backend: at most %d backends\n", MAX_BACKENDS);
+            return -1;
+        }
+        if (!(colon = strrchr(tok, ':')) || colon == tok || !colon[1]) {
+            fprintf(stderr, "backend: bad backend %s (expected host:port)\n", tok);
+            return -1;
+        }
+        *colon = '\0';
+        Backend *b = &backends[nbackends++];
+        memset(b, 0, sizeof(Backend));
+        snprintf(b->host, sizeof(b->host), "%s", tok);
+        snprintf(b->port, sizeof(b->port), "%s", colon + 1);
+        b->healthy = 1; // Until the first checks say otherwise.
+    }
+    return 0;
+}
+/* $end backend_add_pool */
+
+int backend_enabled(void) { return nbackends > 0; }
+
+static int ring_cmp(const void *a, const void *b) {
+    uint64_t x = ((RingPoint *)a)->hash, y = ((RingPoint *)b)->hash;
+    return x < y ? -1 : x > y;
+}
+
+/* Record one health result; flips the backend after BACKEND_FALL / BACKEND_RISE in a row */
+static void note_result(Backend *b, int ok) {
+    if (ok) {
+        __atomic_store_n(&b->fails, 0, __ATOMIC_RELAXED);
+        if (__atomic_add_fetch(&b->passes, 1, __ATOMIC_RELAXED) >= BACKEND_RISE && !__atomic_exchange_n(&b->healthy, 1, __ATOMIC_RELAXED)) {
+            STAT_INC(b->transitions);
+            fprintf(stderr, "backend: %s:%s is healthy again\n", b->host, b->port);
+        }
+    } else {
+        STAT_INC(b->failures);
+        __atomic_store_n(&b->passes, 0, __ATOMIC_RELAXED);
+        if (__atomic_add_fetch(&b->fails, 1, __ATOMIC_RELAXED) >= BACKEND_FALL && __atomic_exchange_n(&b->healthy, 0, __ATOMIC_RELAXED)) {
+            STAT_INC(b->transitions);
+            fprintf(stderr, "backend: %s:%s is unhealthy, draining (%lu in flight)\n", b->host, b->port, STAT_GET(b->inflight));
+        }
+    }
+}
+
+/*
+ * check - One active check: GET BACKEND_HEALTH_PATH and expect a status
+ *     below 500. The whole response is read before closing: closing with
+ *     unread data resets the connection, and a reset kills tiny with
+ *     SIGPIPE halfway through its write.
+ */
+static int check(Backend *b) {
+    char request[MAXLINE], buf[MAXBUF];
+    int fd, code = 0;
+    ssize_t n;
+
+    if ((fd = upstream_connect(b->host, b->port)) < 0)
+        return 0;
+    snprintf(request, sizeof(request), "GET %s HTTP/1.0\r\nHost: %s:%s\r\nConnection: close\r\n\r\n", BACKEND_HEALTH_PATH, b->host,
+             b->port);
+    if (netio_writen(fd, request, strlen(request)) == strlen(request) && upstream_wait_response(fd, BACKEND_CHECK_TIMEOUT_MS) == 1 &&
+        (n = recv(fd, buf, sizeof(buf) - 1, 0)) > 0) {
+        buf[n] = '\0';
+        if (sscanf(buf, "HTTP/%*d.%*d %d", &code) != 1)
+            code = 0;
+        while (upstream_wait_response(fd, BACKEND_CHECK_TIMEOUT_MS) == 1 && recv(fd, buf, sizeof(buf), 0) > 0)
+            ;
+    }
+    upstream_close(fd);
+    return code >= 100 && code < 500;
+}
+
+/* One thread per backend, so a backend that hangs cannot delay the others' checks */
+static void *check_thread(void *arg) {
+    Backend *b = arg;
+
+    pthread_detach(pthread_self());
+    while (1) {
+        note_result(b, check(b));
+        usleep(BACKEND_CHECK_MS * 1000);
+    }
+    return NULL;
+}
+
+/* $begin backend_init */
+void backend_init(void) {
+    char key[MAXLINE];
+    int i, v;
+    pthread_t tid;
+
+    if (!backend_enabled())
+        return;
+
+    for (i = 0; i < nbackends; i++) {
+        for (v = 0; v < BACKEND_VNODES; v++) {
+            snprintf(key, sizeof(key), "%s:%s#%d", backends[i].host, backends[i].port, v);
+            ring[nring].hash = hash_key(key, strlen(key));
+            ring[nring].backend = i;
+            nring++;
+        }
+        Pthread_create(&tid, NULL, check_thread, &backends[i]);
+    }
+    qsort(ring, nring, sizeof(RingPoint), ring_cmp);
+    printf("Reverse-proxy mode: %d backends, %d ring points\n", nbackends, nring);
+}
+/* $end backend_init */
+
+/*
+ * backend_pick - Hash the path (without its query string), find the first
+ *     ring point at or after it, and walk on to the first healthy backend.
+ */
+/* $begin backend_pick */
+Backend *backend_pick(char *path) {
+    size_t len = strcspn(path, "?");
+    uint64_t h = hash_key(path, len);
+    int lo = 0, hi = nring, i;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (ring[mid].hash < h)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    STAT_INC(picks);
+    for (i = 0; i < nring; i++) {
+        Backend *b = &backends[ring[(lo + i) % nring].backend];
+        if (__atomic_load_n(&b->healthy, __ATOMIC_RELAXED)) {
+            if (b != &backends[ring[lo % nring].backend])
+                STAT_INC(rerouted);
+            STAT_INC(b->requests);
+            STAT_INC(b->inflight);
+            return b;
+        }
+    }
+    STAT_INC(no_healthy);
+    return NULL;
+}
+/* $end backend_pick */
+
+/* $begin backend_release */
+void backend_release(Backend *b, int ok) {
+    STAT_SUB(b->inflight, 1);
+    if (!ok)
+        note_result(b, 0); // Passive check: failed requests count like failed checks.
+}
+/* $end backend_release */
+
+/* $begin backend_stats */
+int backend_stats(char *buf, size_t size) {
+    int i, len = 0;
+
+    len += snprintf(buf + len, size - len, "backend.count %d\n", nbackends);
+    if (!backend_enabled())
+        return len;
+
+    len += snprintf(buf + len, size - len, "backend.picks %lu\nbackend.rerouted %lu\nbackend.no_healthy %lu\n", STAT_GET(picks),
+                    STAT_GET(rerouted), STAT_GET(no_healthy));
+    for (i = 0; i < nbackends && len < size; i++) {
+        Backend *b = &backends[i];
+        len += snprintf(buf + len, size - len, "backend.pool %s:%s %s requests %lu inflight %lu failures %lu transitions %lu\n", b->host,
+                        b->port, STAT_GET(b->healthy) ? "up" : "down", STAT_GET(b->requests), STAT_GET(b->inflight),
+                        STAT_GET(b->failures), STAT_GET(b->transitions));
+    }
+    return len < size ? len : size - 1;
+}
+/* $end backend_stats */
@@ -0,0 +1,61 @@
+/*
+ * backend.h - Reverse-proxy (accelerator) mode over a pool of backends
+ *
+ * With a backend pool configured, the proxy also accepts origin-form
+ * requests ("GET /path HTTP/1.0") and forwards them to one of the pool's
+ * backends, e.g. a farm of tiny instances. The backend is picked by
+ * consistent hashing on the path, so each path keeps going to the same
+ * backend (whose page cache stays warm) and adding or losing a backend
+ * only moves the paths that hashed to it.
+ *
+ * Each backend is placed on the ring BACKEND_VNODES times. A lookup walks
+ * clockwise from the path's hash to the first healthy backend, so an
+ * unhealthy backend's paths spread over the others. Health comes from an
+ * active check (GET BACKEND_HEALTH_PATH every BACKEND_CHECK_MS) and from
+ * failed requests: BACKEND_FALL consecutive failures take a backend out,
+ * BACKEND_RISE consecutive good checks bring it back. A backend that goes
+ * down is drained: requests already on it finish, new ones go elsewhere.
+ */
+/* $begin backend.h */
+#ifndef __BACKEND_H__
+#define __BACKEND_H__
+
+#include "csapp.h"
+
+#define MAX_BACKENDS 64
+#define BACKEND_VNODES 100          /* Ring points per backend */
+#define BACKEND_CHECK_MS 1000       /* Interval between health checks */
+#define BACKEND_CHECK_TIMEOUT_MS 1000 /* Time allowed for a health check response */
+#define BACKEND_FALL 2              /* Consecutive failures before a backend is taken out */
+#define BACKEND_RISE 2              /* Consecutive good checks before it is put back */
+#define BACKEND_HEALTH_PATH "/"
+
+typedef struct Backend {
+    char host[NI_MAXHOST];
+    char port[NI_MAXSERV];
+    int healthy;                 // 1 if the backend gets new requests.
+    int fails, passes;           // Consecutive failed / good results.
+    unsigned long requests;      // Requests sent to this backend.
+    unsigned long failures;      // Requests and checks that failed.
+    unsigned long inflight;      // Requests currently on this backend.
+    unsigned long transitions;   // Times the backend went down or came back.
+} Backend;
+
+/* Parse "host:port,host:port,..." into the pool; turns reverse-proxy mode on */
+int backend_add_pool(char *list);
+int backend_enabled(void);
+
+/* Build the hash ring and start health checks; call once after option parsing */
+void backend_init(void);
+
+/* Pick the backend for an origin-form path, or NULL if none is healthy */
+Backend *backend_pick(char *path);
+
+/* Done with a backend from backend_pick(); ok = 0 if the request failed */
+void backend_release(Backend *b, int ok);
+
+/* Write a plain-text report of backend health and load into buf */
+int backend_stats(char *buf, size_t size);
+
+#endif /* __BACKEND_H__ */
+/* $end backend.h */
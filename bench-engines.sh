@@ -0,0 +1,110 @@
+#!/bin/bash
+#
+# bench-engines.sh - Run one workload against every engine (-e) and cache
+#     (-k) the proxy can be started with. A small origin answers every
+#     path with the same body; clients request URIs drawn from a skewed
+#     set (80% to a hot tenth) so the run mixes hits, misses and
+#     evictions. Each combination gets a fresh proxy:
+#
+#       thread / pool:N  x  list / lru
+#
+#     usage: ./bench-engines.sh [requests] [clients] [uris] [body bytes] [pool threads]
+#
+
+REQUESTS=${1:-4000}
+CLIENTS=${2:-16}
+URIS=${3:-200}
+BODY=${4:-16384}
+POOL=${5:-16}
+FREE_PORT='import socket; s = socket.socket(); s.bind(("localhost", 0)); print(s.getsockname()[1])'
+ORIGIN_PORT=`python3 -c "$FREE_PORT"`
+PROXY_PORT=`python3 -c "$FREE_PORT"`
+
+cleanup() {
+    kill $ORIGIN_PID $PROXY_PID 2> /dev/null
+}
+trap cleanup EXIT
+
+python3 - $ORIGIN_PORT $BODY <<'EOF' &
+import socketserver, sys
+
+port, size = int(sys.argv[1]), int(sys.argv[2])
+response = b"HTTP/1.0 200 OK\r\nContent-length: %d\r\n\r\n" % size + b"x" * size
+
+class Handler(socketserver.StreamRequestHandler):
+    def handle(self):
+        while self.rfile.readline() not in (b"\r\n", b"\n", b""):
+            pass
+        self.wfile.write(response)
+
+class TCP(socketserver.ThreadingTCPServer):
+    allow_reuse_address = True
+    daemon_threads = True
+    request_queue_size = 1024
+
+TCP(("localhost", port), Handler).serve_forever()
+EOF
+ORIGIN_PID=$!
+sleep 1
+
+# run <engine> <cache>
+run() {
+    ./proxy -e $1 -k $2 $PROXY_PORT > /dev/null 2>&1 &
+    PROXY_PID=$!
+    sleep 0.5
+    python3 - $1 $2 $PROXY_PORT $ORIGIN_PORT $REQUESTS $CLIENTS $URIS <<'EOF'
+import random, socket, sys, threading, time
+
+engine, cache, proxy, origin = sys.argv[1], sys.argv[2], int(sys.argv[3]), sys.argv[4]
+n, clients, uris = int(sys.argv[5]), int(sys.argv[6]), int(sys.argv[7])
+latencies, failures = [], []
+
+def client(k):
+    rng = random.Random(k) # Same URI sequence for every engine and cache
+    for i in range(k, n, clients):
+        uri = rng.randrange(max(uris // 10, 1)) if rng.random() < 0.8 else rng.randrange(uris) # 80% to the hottest tenth
+        start = time.time()
+        s = socket.create_connection(("localhost", proxy))
+        s.sendall(b"GET http://localhost:%s/bench/%d HTTP/1.0\r\nHost: localhost\r\n\r\n" % (origin.encode(), uri))
+        reply = b""
+        while True:
+            chunk = s.recv(65536)
+            if not chunk:
+                break
+            reply += chunk
+        s.close()
+        if not reply.startswith(b"HTTP/1.0 200"):
+            failures.append(i)
+        latencies.append(time.time() - start)
+
+start = time.time()
+threads = [threading.Thread(target=client, args=(k,)) for k in range(clients)]
+for t in threads:
+    t.start()
+for t in threads:
+    t.join()
+elapsed = time.time() - start
+stats = socket.create_connection(("localhost", proxy))
+stats.sendall(b"GET /proxy-stats HTTP/1.0\r\n\r\n")
+report = b""
+while True:
+    chunk = stats.recv(65536)
+    if not chunk:
+        break
+    report += chunk
+values = dict(line.split(" ", 1) for line in report.decode().split("\r\n\r\n", 1)[1].splitlines() if " " in line)
+latencies.sort()
+print("%-9s %-5s %8.1f req/s  p50 %6.2f ms  p99 %6.2f ms  hits %6s  start %7s us  failed %d" % (
+    engine, cache, n / elapsed, latencies[len(latencies) // 2] * 1e3, latencies[len(latencies) * 99 // 100] * 1e3,
+    values.get("cache.hits", "?"), values.get("engine.start_us_avg", "?"), len(failures)))
+EOF
+    kill $PROXY_PID
+    wait $PROXY_PID 2> /dev/null
+    return 0
+}
+
+for engine in thread pool:$POOL; do
+    for cache in list lru; do
+        run $engine $cache
+    done
+done
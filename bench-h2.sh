@@ -0,0 +1,93 @@
+#!/bin/bash
+#
+# bench-h2.sh - Compare HTTP/1.0 (a connection per request) with h2c
+#     (every request a stream on one connection) through the proxy, for a
+#     cached object served by tiny. The h2 client encodes its headers with
+#     the hpack module, which is installed for the user if it is missing
+#     (from PyPI, or from the wheel HPACK_WHEEL names when offline):
+#
+#       http/1.0  client -> proxy -> tiny, a connection each
+#       h2c       client =streams=> proxy -2 -> tiny, [streams] at a time
+#
+#     usage: ./bench-h2.sh [requests] [streams]
+#
+
+REQUESTS=${1:-2000}
+STREAMS=${2:-16}
+FREE_PORT='import socket; s = socket.socket(); s.bind(("localhost", 0)); print(s.getsockname()[1])'
+ORIGIN_PORT=`python3 -c "$FREE_PORT"`
+PROXY_PORT=`python3 -c "$FREE_PORT"`
+
+cleanup() {
+    kill $ORIGIN_PID $PROXY_PID 2> /dev/null
+}
+trap cleanup EXIT
+
+python3 -c "import hpack" 2> /dev/null || pip3 install --user --quiet ${HPACK_WHEEL:-hpack} || exit 1
+
+(cd tiny && exec ./tiny $ORIGIN_PORT > /dev/null 2>&1) &
+ORIGIN_PID=$!
+./proxy -2 $PROXY_PORT > /dev/null 2>&1 &
+PROXY_PID=$!
+sleep 0.5
+
+python3 - $PROXY_PORT $ORIGIN_PORT $REQUESTS $STREAMS <<'EOF'
+import socket, struct, sys, time
+import hpack
+
+proxy, origin, n, streams = int(sys.argv[1]), sys.argv[2], int(sys.argv[3]), int(sys.argv[4])
+
+def http10():
+    failures = 0
+    for i in range(n):
+        s = socket.create_connection(("localhost", proxy))
+        s.sendall(b"GET http://localhost:%s/home.html HTTP/1.0\r\nHost: localhost\r\n\r\n" % origin.encode())
+        reply = b""
+        while True:
+            chunk = s.recv(65536)
+            if not chunk:
+                break
+            reply += chunk
+        s.close()
+        failures += not reply.startswith(b"HTTP/1.0 200")
+    return failures
+
+def frame(kind, flags, stream, payload):
+    return struct.pack(">I", len(payload))[1:] + bytes([kind, flags]) + struct.pack(">I", stream) + payload
+
+def h2c():
+    s = socket.create_connection(("localhost", proxy))
+    s.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1) # Window updates are small writes
+    encoder, failures, buf, sent, done = hpack.Encoder(), 0, b"", 0, 0
+    s.sendall(b"PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n" + frame(4, 0, 0, b""))
+    while done < n:
+        batch = b""
+        while sent < n and sent - done < streams:
+            block = encoder.encode([(":method", "GET"), (":scheme", "http"), (":authority", "localhost:" + origin), (":path", "/home.html")])
+            batch += frame(1, 5, 2 * sent + 1, block) # HEADERS, END_HEADERS | END_STREAM
+            sent += 1
+        s.sendall(batch)
+        chunk = s.recv(65536)
+        if not chunk:
+            return failures + n - done
+        buf += chunk
+        while len(buf) >= 9 and len(buf) >= 9 + int.from_bytes(buf[:3], "big"):
+            length, kind, flags = int.from_bytes(buf[:3], "big"), buf[3], buf[4]
+            buf = buf[9 + length:]
+            if kind == 0 and length: # DATA: give the connection window back
+                s.sendall(frame(8, 0, 0, struct.pack(">I", length)))
+            if kind == 4 and not flags & 1: # SETTINGS: acknowledge
+                s.sendall(frame(4, 1, 0, b""))
+            if kind == 3: # RST_STREAM
+                failures, done = failures + 1, done + 1
+            elif kind in (0, 1) and flags & 1: # END_STREAM
+                done += 1
+    s.close()
+    return failures
+
+for name, run in (("http/1.0", http10), ("h2c", h2c)):
+    start = time.time()
+    failures = run()
+    elapsed = time.time() - start
+    print("%-9s %8.1f req/s  failed %d" % (name, n / elapsed, failures))
+EOF
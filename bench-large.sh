@@ -0,0 +1,72 @@
+#!/bin/bash
+#
+# bench-large.sh - Time a large download that the cache will never hold,
+#     so it takes the zero-copy relay (splice) or, with -B, the spool.
+#     The payload, tiny/big.bin, is generated on first use rather than kept
+#     in the tree. Each route fetches it the given number of times:
+#
+#       direct    client -> tiny
+#       splice    client -> proxy -> tiny
+#       spool     client -> proxy -B 1m -> tiny
+#
+#     usage: ./bench-large.sh [requests] [megabytes]
+#
+
+REQUESTS=${1:-20}
+MB=${2:-8}
+FREE_PORT='import socket; s = socket.socket(); s.bind(("localhost", 0)); print(s.getsockname()[1])'
+ORIGIN_PORT=`python3 -c "$FREE_PORT"`
+PROXY_PORT=`python3 -c "$FREE_PORT"`
+
+cleanup() {
+    kill $ORIGIN_PID $PROXY_PID 2> /dev/null
+}
+trap cleanup EXIT
+
+if [ ! -f tiny/big.bin ] || [ `stat -c %s tiny/big.bin` -ne $((MB * 1000000)) ]; then
+    head -c $((MB * 1000000)) /dev/urandom > tiny/big.bin
+fi
+(cd tiny && exec ./tiny $ORIGIN_PORT > /dev/null 2>&1) &
+ORIGIN_PID=$!
+sleep 0.5
+
+# fetch <route> <port or empty for direct>
+fetch() {
+    python3 - $1 $ORIGIN_PORT "$2" $REQUESTS $MB <<'EOF'
+import socket, sys, time
+
+route, origin, proxy, n, mb = sys.argv[1], sys.argv[2], sys.argv[3], int(sys.argv[4]), int(sys.argv[5])
+start, failures = time.time(), 0
+for i in range(n):
+    s = socket.create_connection(("localhost", int(proxy or origin)))
+    target = b"http://localhost:%s/big.bin" % origin.encode() if proxy else b"/big.bin"
+    s.sendall(b"GET %s HTTP/1.0\r\nHost: localhost\r\n\r\n" % target)
+    got = 0
+    while True:
+        chunk = s.recv(1 << 20)
+        if not chunk:
+            break
+        got += len(chunk)
+    s.close()
+    if got < mb * 1000000:
+        failures += 1
+elapsed = time.time() - start
+print("%-7s %8.1f MB/s  %6.1f ms/request  failed %d" % (route, n * mb / elapsed, elapsed / n * 1e3, failures))
+EOF
+}
+
+# run <route> <proxy options...>
+run() {
+    local route=$1
+    shift
+    ./proxy "$@" $PROXY_PORT > /dev/null 2>&1 &
+    PROXY_PID=$!
+    sleep 0.5
+    fetch $route $PROXY_PORT
+    kill $PROXY_PID
+    wait $PROXY_PID 2> /dev/null
+}
+
+fetch direct ""
+run splice
+run spool -B 1m
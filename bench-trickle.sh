@@ -0,0 +1,95 @@
+#!/bin/bash
+#
+# bench-trickle.sh - Measure the latency the proxy adds to a slow-drip
+#     response. A small origin answers every path with a head and then
+#     one chunk at a time, pausing between chunks; each chunk starts with
+#     the time it was sent. The client reads the response directly and
+#     through the proxy (each request a cache miss) and reports the time
+#     to the first body byte and how long after being sent each chunk
+#     arrived:
+#
+#       direct    client -> origin
+#       proxy     client -> proxy -> origin
+#
+#     usage: ./bench-trickle.sh [requests] [chunks] [chunk bytes] [interval ms]
+#
+
+REQUESTS=${1:-5}
+CHUNKS=${2:-20}
+CHUNK=${3:-512}
+INTERVAL=${4:-50}
+FREE_PORT='import socket; s = socket.socket(); s.bind(("localhost", 0)); print(s.getsockname()[1])'
+ORIGIN_PORT=`python3 -c "$FREE_PORT"`
+PROXY_PORT=`python3 -c "$FREE_PORT"`
+
+cleanup() {
+    kill $ORIGIN_PID $PROXY_PID 2> /dev/null
+}
+trap cleanup EXIT
+
+python3 - $ORIGIN_PORT $CHUNKS $CHUNK $INTERVAL <<'EOF' &
+import socketserver, sys, time
+
+port, chunks, size, interval = int(sys.argv[1]), int(sys.argv[2]), int(sys.argv[3]), int(sys.argv[4]) / 1000
+
+class Handler(socketserver.StreamRequestHandler):
+    def handle(self):
+        while self.rfile.readline() not in (b"\r\n", b"\n", b""):
+            pass
+        self.wfile.write(b"HTTP/1.0 200 OK\r\nContent-length: %d\r\n\r\n" % (chunks * size))
+        for i in range(chunks):
+            time.sleep(interval)
+            self.wfile.write(b"%-*.6f" % (size, time.time()))
+            self.wfile.flush()
+
+class TCP(socketserver.ThreadingTCPServer):
+    allow_reuse_address = True
+    daemon_threads = True
+
+TCP(("localhost", port), Handler).serve_forever()
+EOF
+ORIGIN_PID=$!
+
+./proxy $PROXY_PORT > /dev/null 2>&1 &
+PROXY_PID=$!
+sleep 1
+
+# run <label> <port>
+run() {
+    python3 - "$@" $ORIGIN_PORT $REQUESTS $CHUNK <<'EOF'
+import socket, sys, time
+
+label, port, origin_port, n, size = sys.argv[1], int(sys.argv[2]), sys.argv[3], int(sys.argv[4]), int(sys.argv[5])
+first, lags = [], []
+for i in range(n):
+    start = time.time()
+    s = socket.create_connection(("localhost", port))
+    s.sendall(b"GET http://localhost:%s/trickle/%d/%f HTTP/1.0\r\nHost: localhost\r\n\r\n" % (origin_port.encode(), i, start))
+    reply, body, seen = b"", -1, 0
+    while True:
+        data = s.recv(65536)
+        if not data:
+            break
+        now = time.time()
+        reply += data
+        if body < 0 and b"\r\n\r\n" in reply:
+            body = reply.index(b"\r\n\r\n") + 4
+        if body < 0 or len(reply) == body:
+            continue
+        if len(first) == i:
+            first.append(now - start)
+        # Every chunk this read completed arrived now
+        while body + (seen + 1) * size <= len(reply):
+            lags.append(now - float(reply[body + seen * size:body + (seen + 1) * size]))
+            seen += 1
+    s.close()
+    if not reply.startswith(b"HTTP/1.0 200"):
+        sys.exit("%s: request %d failed: %r" % (label, i, reply[:60]))
+lags.sort()
+print("%-8s %4d requests  first byte %7.1f ms  chunk delay: median %7.1f ms  max %7.1f ms" %
+      (label, n, 1000 * sum(first) / n, 1000 * lags[len(lags) // 2], 1000 * lags[-1]))
+EOF
+}
+
+run direct $ORIGIN_PORT
+run proxy $PROXY_PORT
@@ -0,0 +1,89 @@
+#!/bin/bash
+#
+# bench-unix.sh - Compare loopback TCP with Unix-domain sockets on both
+#     sides of the proxy. A small origin listens on a TCP port and on a
+#     Unix-domain path at once and answers every path with the same body,
+#     so each request below is a cache miss. Three routes are timed:
+#
+#       tcp->tcp    client -TCP-> proxy -TCP->  origin
+#       tcp->unix   client -TCP-> proxy -Unix-> origin   (-U)
+#       unix->unix  client -Unix-> proxy -Unix-> origin  (-u and -U)
+#
+#     usage: ./bench-unix.sh [requests] [body bytes]
+#
+
+REQUESTS=${1:-2000}
+BODY=${2:-1024}
+DIR=`mktemp -d /tmp/bench-unix.XXXXXX`
+ORIGIN_SOCK=$DIR/origin.sock
+PROXY_SOCK=$DIR/proxy.sock
+FREE_PORT='import socket; s = socket.socket(); s.bind(("localhost", 0)); print(s.getsockname()[1])'
+ORIGIN_PORT=`python3 -c "$FREE_PORT"`
+PROXY_PORT=`python3 -c "$FREE_PORT"`
+MAPPED_PORT=$((ORIGIN_PORT + 1)) # Name only: mapped to the Unix socket
+
+cleanup() {
+    kill $ORIGIN_PID $PROXY_PID 2> /dev/null
+    rm -rf $DIR
+}
+trap cleanup EXIT
+
+python3 - $ORIGIN_PORT $ORIGIN_SOCK $BODY <<'EOF' &
+import os, socket, socketserver, sys, threading
+
+port, path, size = int(sys.argv[1]), sys.argv[2], int(sys.argv[3])
+response = b"HTTP/1.0 200 OK\r\nContent-length: %d\r\n\r\n" % size + b"x" * size
+
+class Handler(socketserver.StreamRequestHandler):
+    def handle(self):
+        while self.rfile.readline() not in (b"\r\n", b"\n", b""):
+            pass
+        self.wfile.write(response)
+
+class TCP(socketserver.ThreadingTCPServer):
+    allow_reuse_address = True
+    daemon_threads = True
+
+class Unix(socketserver.ThreadingUnixStreamServer):
+    daemon_threads = True
+
+threading.Thread(target=TCP(("localhost", port), Handler).serve_forever, daemon=True).start()
+Unix(path, Handler).serve_forever()
+EOF
+ORIGIN_PID=$!
+
+./proxy -u $PROXY_SOCK -U localhost:$MAPPED_PORT=$ORIGIN_SOCK $PROXY_PORT > /dev/null 2>&1 &
+PROXY_PID=$!
+sleep 1
+
+# run <label> <proxy address> <origin port>
+run() {
+    python3 - "$@" $REQUESTS <<'EOF'
+import socket, sys, time
+
+label, proxy, origin_port, n = sys.argv[1], sys.argv[2], sys.argv[3], int(sys.argv[4])
+start = time.time()
+for i in range(n):
+    if proxy.startswith("/"):
+        s = socket.socket(socket.AF_UNIX)
+        s.connect(proxy)
+    else:
+        s = socket.create_connection(("localhost", int(proxy)))
+    s.sendall(b"GET http://localhost:%s/bench/%d/%f HTTP/1.0\r\nHost: localhost\r\n\r\n" % (origin_port.encode(), i, start))
+    reply = b""
+    while True:
+        chunk = s.recv(65536)
+        if not chunk:
+            break
+        reply += chunk
+    s.close()
+    if not reply.startswith(b"HTTP/1.0 200"):
+        sys.exit("%s: request %d failed: %r" % (label, i, reply[:60]))
+elapsed = time.time() - start
+print("%-10s %6d requests  %7.3f s  %8.1f req/s  %7.1f us/req" % (label, n, elapsed, n / elapsed, elapsed * 1e6 / n))
+EOF
+}
+
+run tcp-\>tcp $PROXY_PORT $ORIGIN_PORT
+run tcp-\>unix $PROXY_PORT $MAPPED_PORT
+run unix-\>unix $PROXY_SOCK $MAPPED_PORT
@@ -0,0 +1,38 @@
+/*
+ * budget.c - Ratio token buckets for extra upstream work
+ */
+#include "budget.h"
+
+/* Budgets start full, so the first failures after startup can be absorbed */
+void budget_init(Budget *b, double ratio, double burst) {
+    b->tokens = burst;
+    b->ratio = ratio;
+    b->burst = burst;
+    pthread_mutex_init(&b->lock, NULL);
+}
+
+void budget_earn(Budget *b) {
+    pthread_mutex_lock(&b->lock);
+    b->tokens += b->ratio;
+    if (b->tokens > b->burst)
+        b->tokens = b->burst;
+    pthread_mutex_unlock(&b->lock);
+}
+
+/* Take one token if there is one; returns 1 if the extra request may go ahead */
+int budget_spend(Budget *b) {
+    int ok;
+
+    pthread_mutex_lock(&b->lock);
+    if ((ok = b->tokens >= 1.0))
+        b->tokens -= 1.0;
+    pthread_mutex_unlock(&b->lock);
+    return ok;
+}
+
+double budget_level(Budget *b) {
+    pthread_mutex_lock(&b->lock);
+    double tokens = b->tokens;
+    pthread_mutex_unlock(&b->lock);
+    return tokens;
+}
@@ -0,0 +1,29 @@
+/*
+ * budget.h - Ratio token buckets for extra upstream work
+ *
+ * Hedges and retries are extra requests to origins that are already slow
+ * or failing. Each kind draws on a budget that earns `ratio` tokens per
+ * ordinary request, up to `burst`, and spends one token per extra request,
+ * so the extra load stays a fixed fraction of real traffic even during an
+ * outage.
+ */
+/* $begin budget.h */
+#ifndef __BUDGET_H__
+#define __BUDGET_H__
+
+#include "csapp.h"
+
+typedef struct Budget {
+    double tokens;        // Extra requests currently affordable.
+    double ratio;         // Tokens earned per ordinary request.
+    double burst;         // Most tokens that can pile up.
+    pthread_mutex_t lock; // Mutex for this budget.
+} Budget;
+
+void budget_init(Budget *b, double ratio, double burst);
+void budget_earn(Budget *b);
+int budget_spend(Budget *b);
+double budget_level(Budget *b);
+
+#endif /* __BUDGET_H__ */
+/* $end budget.h */
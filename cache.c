@@ -0,0 +1,276 @@
+/*
+ * cache.c - List (FIFO) and hashed LRU object caches
+ */
+#include "cache.h"
+#include "stats.h"
+
+typedef struct CachedItem {
+    char *uri;                  // The URI of the requested object.
+    IoChain *response;          // The HTTP response; the cache holds a reference, and so does each hit being sent.
+    int size;                   // Size of the response.
+    unsigned hash;              // Of uri, for the lru buckets.
+    struct CachedItem *prev;    // Order list: newest (list) or most recently used (lru) first.
+    struct CachedItem *next;
+    struct CachedItem *bucket;  // Next item in the same hash bucket (lru only).
+} CachedItem;
+
+typedef struct CacheImpl {
+    char *name;
+    CachedItem *(*find)(char *uri);
+    void (*index)(CachedItem *item);   // A new item was put at the front of the order list.
+    void (*unindex)(CachedItem *item); // An item is about to leave the order list.
+    void (*touch)(CachedItem *item);   // An item was hit.
+} CacheImpl;
+
+static struct {
+    CachedItem *head, *tail;               // Order list; eviction takes the tail.
+    CachedItem *buckets[CACHE_BUCKETS];
+    int total_size;                        // Total size of objects in cache.
+    int objects;
+    pthread_mutex_t lock;                  // Protects all of the above.
+} cache = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static unsigned long hits, misses, stores, evictions, finds, probes;
+
+/* Order list primitives; called with the lock held */
+static void push_front(CachedItem *item) {
+    item->prev = NULL;
+    item->next = cache.head;
+    if (cache.head)
+        cache.head->prev = item;
+    else
+        cache.tail = item;
+    cache.head = item;
+}
+
+static void unlink_item(CachedItem *item) {
+    if (item->prev)
+        item->prev->next = item->next;
+    else
+        cache.head = item->next;
+    if (item->next)
+        item->next->prev = item->prev;
+    else
+        cache.tail = item->prev;
+}
+
+/* $begin list cache */
+static CachedItem *list_find(char *uri) {
+    CachedItem *current;
+
+    for (current = cache.head; current; current = current->next) {
+        STAT_INC(probes);
+        if (strcmp(uri, current->uri) == 0)
+            return current;
+    }
+    return NULL;
+}
+
+static void list_nothing(CachedItem *item) {}
+/* $end list cache */
+
+/* $begin lru cache */
+static unsigned hash_uri(char *uri) {
+    unsigned h = 2166136261u; // FNV-1a
+
+    while (*uri)
+        h = (h ^ (unsigned char)*uri++) * 16777619u;
+    return h;
+}
+
+static CachedItem *lru_find(char *uri) {
+    unsigned h = hash_uri(uri);
+    CachedItem *current;
+
+    for (current = cache.buckets[h % CACHE_BUCKETS]; current; current = current->bucket) {
+        STAT_INC(probes);
+        if (current->hash == h && strcmp(uri, current->uri) == 0)
+            return current;
+    }
+    return NULL;
+}
+
+static void lru_index(CachedItem *item) {
+    CachedItem **bucket = &cache.buckets[(item->hash = hash_uri(item->uri)) % CACHE_BUCKETS];
+
+    item->bucket = *bucket;
+    *bucket = item;
+}
+
+static void lru_unindex(CachedItem *item) {
+    CachedItem **link = &cache.buckets[item->hash % CACHE_BUCKETS];
+
+    while (*link != item)
+        link = &(*link)->bucket;
+    *link = item->bucket;
+}
+
+static void lru_touch(CachedItem *item) {
+    if (item != cache.head) {
+        unlink_item(item);
+        push_front(item);
+    }
+}
+/* $end lru cache */
+
+static CacheImpl impls[] = {
+    {"list", list_find, list_nothing, list_nothing, list_nothing},
+    {"lru", lru_find, lru_index, lru_unindex, lru_touch},
+};
+static CacheImpl *impl = &impls[0];
+
+/* $begin cache_configure */
+int cache_configure(char *kind) {
+    int i;
+
+    for (i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+        if (!strcmp(kind, impls[i].name)) {
+            impl = &impls[i];
+            return 0;
+        }
+    }
+    fprintf(stderr, "cache: unknown cache %s (expected list or lru)\n", kind);
+    return -1;
+}
+/* $end cache_configure */
+
+/* Looks uri up with the selected implementation; called with the lock held */
+static CachedItem *find(char *uri) {
+    STAT_INC(finds);
+    return impl->find(uri);
+}
+
+/* Unlinks an item and drops the cache's reference to its response; called with the lock held */
+static void remove_item(CachedItem *item) {
+    impl->unindex(item);
+    unlink_item(item);
+    cache.total_size -= item->size;
+    cache.objects--;
+    iochain_release(item->response);
+    free(item->uri);
+    free(item);
+}
+
+/* $begin cache_lookup */
+IoChain *cache_lookup(char *uri) {
+    CachedItem *item;
+    IoChain *hit = NULL;
+
+    pthread_mutex_lock(&cache.lock);
+    if ((item = find(uri))) {
+        impl->touch(item);
+        hit = item->response;
+        iochain_hold(hit);
+    }
+    pthread_mutex_unlock(&cache.lock);
+    if (hit)
+        STAT_INC(hits);
+    else
+        STAT_INC(misses);
+    return hit;
+}
+/* $end cache_lookup */
+
+/* $begin cache_contains */
+int cache_contains(char *uri) {
+    pthread_mutex_lock(&cache.lock);
+    int found = find(uri) != NULL;
+    pthread_mutex_unlock(&cache.lock);
+    return found;
+}
+/* $end cache_contains */
+
+/* $begin cache_copy */
+int cache_copy(char *uri, char **response, int *size) {
+    pthread_mutex_lock(&cache.lock);
+    CachedItem *item = find(uri);
+    if (item && (*response = iochain_linearize(item->response)))
+        *size = item->size;
+    pthread_mutex_unlock(&cache.lock);
+    return item != NULL && *response != NULL;
+}
+/* $end cache_copy */
+
+/* $begin cache_store */
+void cache_store(char *uri, IoChain *response) {
+    int size = response->len;
+    CachedItem *old;
+
+    // If object is too big for the cache, ignore it.
+    if (size > MAX_CACHE_SIZE)
+        return;
+
+    CachedItem *new_item = malloc(sizeof(CachedItem));
+    if (!new_item || !(new_item->uri = strdup(uri))) {
+        free(new_item);
+        return;
+    }
+    new_item->response = response; // Adopted as is: no copy.
+    iochain_hold(response);
+    new_item->size = size;
+
+    pthread_mutex_lock(&cache.lock);
+    // A newer copy replaces the old one rather than shadowing it.
+    if ((old = find(uri)))
+        remove_item(old);
+    // Evict from the tail until we have enough space.
+    while (cache.total_size + size > MAX_CACHE_SIZE) {
+        remove_item(cache.tail);
+        STAT_INC(evictions);
+    }
+    push_front(new_item);
+    impl->index(new_item);
+    cache.total_size += size;
+    cache.objects++;
+    pthread_mutex_unlock(&cache.lock);
+    STAT_INC(stores);
+}
+/* $end cache_store */
+
+/* $begin cache_store_copy */
+void cache_store_copy(char *uri, char *response, int size) {
+    IoChain *chain = iochain_new();
+
+    if (!chain)
+        return;
+    if (iochain_append(chain, response, size) == 0)
+        cache_store(uri, chain);
+    iochain_release(chain);
+}
+/* $end cache_store_copy */
+
+/* $begin cache_purge */
+int cache_purge(char *uri, int prefix) {
+    CachedItem *item, *next;
+    size_t len = strlen(uri);
+    int removed = 0;
+
+    pthread_mutex_lock(&cache.lock);
+    for (item = cache.head; item; item = next) {
+        next = item->next;
+        if (prefix ? !strncmp(item->uri, uri, len) : !strcmp(item->uri, uri)) {
+            remove_item(item);
+            removed++;
+        }
+    }
+    pthread_mutex_unlock(&cache.lock);
+    return removed;
+}
+/* $end cache_purge */
+
+/* $begin cache_stats */
+int cache_stats(char *buf, size_t size) {
+    int len = 0, objects, bytes;
+    unsigned long n = STAT_GET(finds);
+
+    pthread_mutex_lock(&cache.lock);
+    objects = cache.objects;
+    bytes = cache.total_size;
+    pthread_mutex_unlock(&cache.lock);
+    len += snprintf(buf + len, size - len, "cache.kind %s\ncache.objects %d\ncache.bytes %d\n", impl->name, objects, bytes);
+    len += snprintf(buf + len, size - len, "cache.hits %lu\ncache.misses %lu\ncache.stores %lu\ncache.evictions %lu\n", STAT_GET(hits),
+                    STAT_GET(misses), STAT_GET(stores), STAT_GET(evictions));
+    len += snprintf(buf + len, size - len, "cache.probes_per_find %.2f\n", n ? (double)STAT_GET(probes) / n : 0.0);
+    return len < size ? len : size - 1;
+}
+/* $end cache_stats */
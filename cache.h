@@ -0,0 +1,55 @@
+/*
+ * cache.h - The proxy's object cache, with selectable implementations
+ *
+ * Responses are cached whole, as the buffer chains they were read into,
+ * up to MAX_CACHE_SIZE bytes in all. The cache holds one reference to each
+ * chain and a hit takes another while it sends, so eviction and purges
+ * never free an object in use.
+ *
+ * The lookup and replacement policy is chosen at startup with -k, so the
+ * same workload can be run against each:
+ *
+ *   list  one list in insertion order, searched front to back; eviction
+ *         drops the oldest insertion (FIFO). This is the original cache.
+ *   lru   a hash table over the same list, which a hit moves to the
+ *         front; eviction drops the least recently used object.
+ *
+ * Both sit under one lock. cache.* in /proxy-stats counts hits, misses,
+ * evictions and the entries examined per search.
+ */
+/* $begin cache.h */
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include "csapp.h"
+#include "iobuf.h"
+
+#define MAX_CACHE_SIZE 1049000 /* Recommended max cache size */
+#define CACHE_BUCKETS 1024     /* Hash buckets of the lru cache */
+
+/* Select the implementation: "list" (the default) or "lru" */
+int cache_configure(char *kind);
+
+/* The cached response for uri with a reference held for the caller (iochain_release it), or NULL */
+IoChain *cache_lookup(char *uri);
+
+/* Reports whether uri is cached, without counting a hit or touching recency */
+int cache_contains(char *uri);
+
+/* Copies a cached object out (malloc'd); 0 if uri is not cached */
+int cache_copy(char *uri, char **response, int *size);
+
+/* Caches response under uri; the cache takes its own reference */
+void cache_store(char *uri, IoChain *response);
+
+/* Caches a copy of a contiguous response (as a cluster peer hands it over) */
+void cache_store_copy(char *uri, char *response, int size);
+
+/* Removes uri, or with prefix every uri starting with it; returns how many objects went */
+int cache_purge(char *uri, int prefix);
+
+/* Write a plain-text report of cache occupancy and lookups into buf */
+int cache_stats(char *buf, size_t size);
+
+#endif /* __CACHE_H__ */
+/* $end cache.h */
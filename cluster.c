@@ -0,0 +1,403 @@
+/*
+ * cluster.c - URI-sharded caching across several proxy nodes
+ */
+#include "cluster.h"
+#include "netio.h"
+#include "stats.h"
+#include "upstream.h"
+#include <netinet/tcp.h>
+#include <stdint.h>
+
+typedef struct Member {
+    char host[NI_MAXHOST];
+    char port[NI_MAXSERV];
+    uint64_t seed;                 // FNV-1a state after "host:port", the start of every URI hash.
+    struct in6_addr addrs[CLUSTER_MEMBER_ADDRS]; // What host resolves to (IPv4 mapped), to recognize inbound peers.
+    int naddrs;
+    int idle[CLUSTER_IDLE_CONNS];  // Idle persistent connections to this member.
+    int nidle;
+    pthread_mutex_t lock;          // Protects idle/nidle.
+} Member;
+
+static Member members[MAX_MEMBERS];
+static int nmembers = 0;
+static int self = -1;
+static char self_spec[MAXLINE];
+static cluster_lookup_t lookup_fn;
+static cluster_store_t store_fn;
+
+static unsigned long owned_here, gets, hits, misses, downs, put_sent, put_failures;
+static unsigned long conns_opened, conns_reused, served_gets, served_hits, served_puts, peers_refused;
+
+static uint64_t fnv(uint64_t h, char *s) {
+    for (; *s; s++)
+        h = (h ^ (unsigned char)*s) * 1099511628211ULL;
+    return h;
+}
+
+/* $begin cluster_set_members */
+int cluster_set_members(char *list) {
+    char copy[MAXLINE], *tok, *save, *colon;
+
+    snprintf(copy, sizeof(copy), "%s", list);
+    for (tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        if (nmembers == MAX_MEMBERS) {
+            fprintf(stderr, "cluster: at most %d members\n", MAX_MEMBERS);
+            return -1;
+        }
+        if (!(colon = strrchr(tok, ':')) || colon == tok || !colon[1]) {
+            fprintf(stderr, "cluster: bad member %s (expected host:port)\n", tok);
+            return -1;
+        }
+        Member *m = &members[nmembers++];
+        m->seed = fnv(14695981039346656037ULL, tok);
+        *colon = '\0';
+        snprintf(m->host, sizeof(m->host), "%s", tok);
+        snprintf(m->port, sizeof(m->port), "%s", colon + 1);
+        m->nidle = 0;
+        pthread_mutex_init(&m->lock, NULL);
+    }
+    return 0;
+}
+/* $end cluster_set_members */
+
+int cluster_set_self(char *member) {
+    snprintf(self_spec, sizeof(self_spec), "%s", member);
+    return 0;
+}
+
+/* Rendezvous hashing: the member with the highest hash of (member, uri) owns uri */
+static int owner(char *uri) {
+    uint64_t h, best = 0;
+    int i, who = 0;
+
+    for (i = 0; i < nmembers; i++) {
+        h = fnv(members[i].seed, uri);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        if (i == 0 || h > best) {
+            best = h;
+            who = i;
+        }
+    }
+    return who;
+}
+
+/* Send a frame type byte followed by one or two length-prefixed fields; the second is gathered from n2 buffers (data2 may be NULL) */
+static int send_frame(int fd, char type, char *data1, uint32_t len1, struct iovec *data2, int n2) {
+    uint32_t nlen1 = htonl(len1), nlen2, len2 = 0;
+    struct iovec iov[4 + CLUSTER_MAX_IOV] = {{&type, 1}, {&nlen1, 4}, {data1, len1}, {&nlen2, 4}};
+    int i;
+
+    if (n2 > CLUSTER_MAX_IOV)
+        return -1;
+    for (i = 0; i < n2; i++) {
+        iov[4 + i] = data2[i];
+        len2 += data2[i].iov_len;
+    }
+    nlen2 = htonl(len2);
+    return netio_writev(fd, iov, data2 ? 4 + n2 : 3) < 0 ? -1 : 0; // One write, so a small frame is one segment.
+}
+
+/* Read a length-prefixed field of at most max bytes into a malloc'd, NUL-terminated buffer */
+static char *read_bytes(int fd, uint32_t max, uint32_t *len) {
+    uint32_t nlen;
+    char *data;
+
+    if (rio_readn(fd, &nlen, 4) != 4 || (*len = ntohl(nlen)) > max || !(data = malloc(*len + 1)))
+        return NULL;
+    if (rio_readn(fd, data, *len) != *len) {
+        free(data);
+        return NULL;
+    }
+    data[*len] = '\0';
+    return data;
+}
+
+/* An idle connection to m, or a new one; *reused tells the caller whether it may be stale */
+static int take_conn(Member *m, int *reused) {
+    struct timeval tv = {.tv_sec = CLUSTER_TIMEOUT_MS / 1000, .tv_usec = CLUSTER_TIMEOUT_MS % 1000 * 1000};
+    int fd = -1, one = 1;
+
+    pthread_mutex_lock(&m->lock);
+    if (m->nidle > 0)
+        fd = m->idle[--m->nidle];
+    pthread_mutex_unlock(&m->lock);
+    if ((*reused = fd >= 0)) {
+        STAT_INC(conns_reused);
+        return fd;
+    }
+
+    if ((fd = upstream_connect_timed(m->host, m->port, CLUSTER_TIMEOUT_MS)) < 0)
+        return -1;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // Frames are small request/response pairs.
+    STAT_INC(conns_opened);
+    return fd;
+}
+
+static void give_conn(Member *m, int fd) {
+    pthread_mutex_lock(&m->lock);
+    if (m->nidle < CLUSTER_IDLE_CONNS) {
+        m->idle[m->nidle++] = fd;
+        fd = -1;
+    }
+    pthread_mutex_unlock(&m->lock);
+    if (fd >= 0)
+        close(fd);
+}
+
+/*
+ * cluster_get - Ask the owner of uri for it. A pooled connection may have
+ *     been closed by the peer since it was last used, so a failure on a
+ *     reused connection is retried once on a fresh one.
+ */
+/* $begin cluster_get */
+int cluster_get(char *uri, char **response, int *size) {
+    Member *m;
+    int fd, who, reused;
+    uint32_t len;
+    char status;
+
+    if (nmembers == 0 || (who = owner(uri)) == self) {
+        if (nmembers)
+            STAT_INC(owned_here);
+        return CLUSTER_LOCAL;
+    }
+
+    m = &members[who];
+    STAT_INC(gets);
+    do {
+        if ((fd = take_conn(m, &reused)) < 0)
+            break;
+        if (send_frame(fd, 'G', uri, strlen(uri), NULL, 0) == 0 && rio_readn(fd, &status, 1) == 1) {
+            if (status == 'M') {
+                give_conn(m, fd);
+                STAT_INC(misses);
+                return CLUSTER_MISS;
+            }
+            if (status == 'H' && (*response = read_bytes(fd, CLUSTER_MAX_OBJECT, &len))) {
+                give_conn(m, fd);
+                *size = len;
+                STAT_INC(hits);
+                return CLUSTER_HIT;
+            }
+        }
+        close(fd);
+    } while (reused);
+
+    STAT_INC(downs);
+    return CLUSTER_DOWN;
+}
+/* $end cluster_get */
+
+/* $begin cluster_put */
+int cluster_put(char *uri, struct iovec *response, int iovcnt) {
+    Member *m;
+    int fd, who, reused;
+    char status;
+
+    if (nmembers == 0 || (who = owner(uri)) == self)
+        return 0;
+
+    m = &members[who];
+    STAT_INC(put_sent);
+    do {
+        if ((fd = take_conn(m, &reused)) < 0)
+            break;
+        if (send_frame(fd, 'P', uri, strlen(uri), response, iovcnt) == 0 && rio_readn(fd, &status, 1) == 1 && status == 'K') {
+            give_conn(m, fd);
+            return 1;
+        }
+        close(fd);
+    } while (reused);
+
+    STAT_INC(put_failures);
+    return 0;
+}
+/* $end cluster_put */
+
+/* serve_peer - One thread per inbound peer connection, answering frames until the peer closes it or goes quiet */
+static void *serve_peer(void *arg) {
+    int fd = *((int *)arg);
+    char type, *uri, *body, *response;
+    uint32_t len;
+    int size, rc = 0;
+
+    free(arg);
+    pthread_detach(pthread_self());
+    while (rc == 0 && rio_readn(fd, &type, 1) == 1 && (uri = read_bytes(fd, MAXLINE, &len))) {
+        if (type == 'G') {
+            STAT_INC(served_gets);
+            if (lookup_fn(uri, &response, &size)) {
+                STAT_INC(served_hits);
+                rc = send_frame(fd, 'H', response, size, NULL, 0);
+                free(response);
+            } else {
+                rc = netio_writen(fd, "M", 1);
+            }
+        } else if (type == 'P' && (body = read_bytes(fd, CLUSTER_MAX_OBJECT, &len))) {
+            STAT_INC(served_puts);
+            store_fn(uri, body, len);
+            free(body);
+            rc = netio_writen(fd, "K", 1);
+        } else {
+            rc = -1;
+        }
+        free(uri);
+    }
+    close(fd);
+    return NULL;
+}
+
+/* An IP address as IPv6, IPv4 ones mapped, so addresses of either family compare */
+static void host_of(struct sockaddr *addr, struct in6_addr *host) {
+    if (addr->sa_family == AF_INET6) {
+        *host = ((struct sockaddr_in6 *)addr)->sin6_addr;
+        return;
+    }
+    memset(host, 0, sizeof(*host));
+    host->s6_addr[10] = host->s6_addr[11] = 0xff;
+    memcpy(&host->s6_addr[12], &((struct sockaddr_in *)addr)->sin_addr, 4);
+}
+
+/* Record the addresses a member's host resolves to */
+static void resolve_member(Member *m) {
+    struct addrinfo hints, *res, *p;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV;
+    if (getaddrinfo(m->host, m->port, &hints, &res) != 0) {
+        fprintf(stderr, "cluster: cannot resolve member %s\n", m->host);
+        return;
+    }
+    for (p = res; p && m->naddrs < CLUSTER_MEMBER_ADDRS; p = p->ai_next)
+        if (p->ai_family == AF_INET || p->ai_family == AF_INET6)
+            host_of(p->ai_addr, &m->addrs[m->naddrs++]);
+    freeaddrinfo(res);
+}
+
+/* Whether an inbound connection comes from a member's address (any port: peers connect from ephemeral ones) */
+static int from_member(struct sockaddr_storage *addr) {
+    struct in6_addr from;
+    int i, j;
+
+    if (addr->ss_family != AF_INET && addr->ss_family != AF_INET6)
+        return 0;
+    host_of((SA *)addr, &from);
+    for (i = 0; i < nmembers; i++)
+        for (j = 0; j < members[i].naddrs; j++)
+            if (!memcmp(&from, &members[i].addrs[j], sizeof(from)))
+                return 1;
+    return 0;
+}
+
+/* A listener on the member's own host:port rather than on every interface */
+static int open_member_listenfd(Member *m) {
+    struct addrinfo hints, *res, *p;
+    int fd = -1, one = 1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV | AI_ADDRCONFIG;
+    if (getaddrinfo(m->host, m->port, &hints, &res) != 0)
+        return -1;
+    for (p = res; p; p = p->ai_next) {
+        if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+            continue;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, p->ai_addr, p->ai_addrlen) == 0 && listen(fd, LISTENQ) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+static void *peer_listener(void *arg) {
+    struct timeval tv = {.tv_sec = CLUSTER_TIMEOUT_MS / 1000, .tv_usec = CLUSTER_TIMEOUT_MS % 1000 * 1000};
+    int listenfd = *((int *)arg);
+    int one = 1;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+
+    free(arg);
+    while (1) {
+        int *fd_ptr = malloc(sizeof(int));
+        addrlen = sizeof(addr);
+        if ((*fd_ptr = accept(listenfd, (SA *)&addr, &addrlen)) < 0) {
+            free(fd_ptr);
+            continue;
+        }
+        if (!from_member(&addr)) { // Anyone else could store any object under any URI.
+            STAT_INC(peers_refused);
+            close(*fd_ptr);
+            free(fd_ptr);
+            continue;
+        }
+        setsockopt(*fd_ptr, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)); // A stuck or vanished peer must not keep the thread.
+        setsockopt(*fd_ptr, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        setsockopt(*fd_ptr, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, serve_peer, fd_ptr) != 0) {
+            close(*fd_ptr);
+            free(fd_ptr);
+        }
+    }
+    return NULL;
+}
+
+/* $begin cluster_init */
+void cluster_init(cluster_lookup_t lookup, cluster_store_t store) {
+    char name[MAXLINE];
+    int i;
+    pthread_t tid;
+
+    if (nmembers == 0)
+        return;
+    for (i = 0; i < nmembers; i++) {
+        snprintf(name, sizeof(name), "%s:%s", members[i].host, members[i].port);
+        if (!strcmp(name, self_spec))
+            self = i;
+    }
+    if (self < 0) {
+        fprintf(stderr, "cluster: this node (-I %s) is not in the member list\n", self_spec[0] ? self_spec : "missing");
+        exit(1);
+    }
+
+    lookup_fn = lookup;
+    store_fn = store;
+    for (i = 0; i < nmembers; i++)
+        resolve_member(&members[i]);
+    int *listenfd = malloc(sizeof(int));
+    if ((*listenfd = open_member_listenfd(&members[self])) < 0) {
+        fprintf(stderr, "cluster: cannot listen on %s\n", self_spec);
+        exit(1);
+    }
+    Pthread_create(&tid, NULL, peer_listener, listenfd);
+    printf("Cluster mode: member %d of %d, peers on %s\n", self, nmembers, self_spec);
+}
+/* $end cluster_init */
+
+/* $begin cluster_stats */
+int cluster_stats(char *buf, size_t size) {
+    int len = 0;
+
+    len += snprintf(buf + len, size - len, "cluster.members %d\ncluster.self %d\n", nmembers, self);
+    if (nmembers == 0)
+        return len;
+
+    len += snprintf(buf + len, size - len, "cluster.owned_here %lu\ncluster.gets %lu\ncluster.hits %lu\ncluster.misses %lu\ncluster.down %lu\n",
+                    STAT_GET(owned_here), STAT_GET(gets), STAT_GET(hits), STAT_GET(misses), STAT_GET(downs));
+    len += snprintf(buf + len, size - len, "cluster.puts %lu\ncluster.put_failures %lu\n", STAT_GET(put_sent), STAT_GET(put_failures));
+    len += snprintf(buf + len, size - len, "cluster.served_gets %lu\ncluster.served_hits %lu\ncluster.served_puts %lu\n", STAT_GET(served_gets),
+                    STAT_GET(served_hits), STAT_GET(served_puts));
+    len += snprintf(buf + len, size - len, "cluster.conns_opened %lu\ncluster.conns_reused %lu\ncluster.peers_refused %lu\n", STAT_GET(conns_opened),
+                    STAT_GET(conns_reused), STAT_GET(peers_refused));
+    return len < size ? len : size - 1;
+}
+/* $end cluster_stats */
@@ -0,0 +1,71 @@
+/*
+ * cluster.h - URI-sharded caching across several proxy nodes
+ *
+ * Behind a load balancer every node would otherwise cache the same hot
+ * objects, so the cluster could hold no more than one MAX_CACHE_SIZE.
+ * In cluster mode all nodes share a static member list, and each URI has
+ * one owner, chosen by rendezvous hashing (the member with the highest
+ * hash of member + URI), so losing a member only moves the URIs it owned.
+ *
+ * Only the owner caches a URI. On a local miss for a URI owned by a peer,
+ * a node asks the owner over a persistent inter-node connection; if the
+ * owner misses too, the node fetches from the origin itself and hands the
+ * object to the owner to cache. If the owner is unreachable the node
+ * caches the object locally instead, so a partition degrades to
+ * independent caches rather than no cache.
+ *
+ * Nodes talk over their member address with length-prefixed frames:
+ *   'G' len uri            ->  'H' len bytes   or  'M'
+ *   'P' len uri len bytes  ->  'K'
+ * All lengths are 32-bit, network byte order.
+ *
+ * A 'P' frame stores whatever it carries, so the inter-node listener binds
+ * only this node's member address and drops connections from any address
+ * that is not a member's. Connections to peers give up after
+ * CLUSTER_TIMEOUT_MS, so a dead owner costs a miss no more than that; a
+ * connection from a peer that sends nothing for as long is closed, and a
+ * pooled one the peer finds closed is retried on a fresh connection.
+ */
+/* $begin cluster.h */
+#ifndef __CLUSTER_H__
+#define __CLUSTER_H__
+
+#include "csapp.h"
+
+#define MAX_MEMBERS 32
+#define CLUSTER_IDLE_CONNS 8       /* Idle connections kept per peer */
+#define CLUSTER_TIMEOUT_MS 2000    /* A peer that does not answer within this is treated as down */
+#define CLUSTER_MAX_OBJECT 1048576 /* Largest object accepted in a frame */
+#define CLUSTER_MAX_IOV 128        /* Most buffers an object given to cluster_put may be in */
+#define CLUSTER_MEMBER_ADDRS 4     /* Addresses remembered per member host */
+
+/* Results of cluster_get() */
+#define CLUSTER_LOCAL 0 /* This node owns the URI (or cluster mode is off) */
+#define CLUSTER_HIT 1   /* The owner had it; *response is malloc'd */
+#define CLUSTER_MISS 2  /* The owner does not have it */
+#define CLUSTER_DOWN 3  /* The owner could not be reached */
+
+/* Copy a cached object out (malloc'd); 0 if not cached */
+typedef int (*cluster_lookup_t)(char *uri, char **response, int *size);
+
+/* Cache an object on this node */
+typedef void (*cluster_store_t)(char *uri, char *response, int size);
+
+/* Member list "host:port,host:port,..." and which of them this node is */
+int cluster_set_members(char *list);
+int cluster_set_self(char *member);
+
+/* Start serving peers on our member address; call once after option parsing */
+void cluster_init(cluster_lookup_t lookup, cluster_store_t store);
+
+/* Ask the URI's owner for it (see CLUSTER_* above) */
+int cluster_get(char *uri, char **response, int *size);
+
+/* Give a fetched object (gathered from iovcnt buffers) to its owner; 1 if the owner took it, 0 if it should be cached here */
+int cluster_put(char *uri, struct iovec *response, int iovcnt);
+
+/* Write a plain-text report of cluster counters into buf */
+int cluster_stats(char *buf, size_t size);
+
+#endif /* __CLUSTER_H__ */
+/* $end cluster.h */
@@ -703,6 +703,43 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n) {
 }
 /* $end rio_writen */
 
+/*
+ * rio_writev - Robustly write iovcnt buffers (unbuffered), gathered into
+ *     as few writev calls as the kernel allows. A partial write resumes
+ *     mid-buffer: iov is updated as it goes out, so the caller's array
+ *     is consumed. Returns the total written, or -1.
+ */
+/* $begin rio_writev */
+ssize_t rio_writev(int fd, struct iovec *iov, int iovcnt) {
+    size_t total = 0;
+    ssize_t nwritten;
+
+    while (iovcnt > 0 && iov->iov_len == 0) {
+        iov++;
+        iovcnt--;
+    }
+    while (iovcnt > 0) {
+        if ((nwritten = writev(fd, iov, iovcnt > IOV_MAX ? IOV_MAX : iovcnt)) <= 0) {
+            if (errno == EINTR) /* Interrupted by sig handler return */
+                continue;       /* and call writev() again */
+            else
+                return -1; /* errno set by writev() */
+        }
+        total += nwritten;
+        while (iovcnt > 0 && (size_t)nwritten >= iov->iov_len) { /* Skip what went out (and empty buffers) */
+            nwritten -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + nwritten;
+            iov->iov_len -= nwritten;
+        }
+    }
+    return total;
+}
+/* $end rio_writev */
+
 /*
  * rio_read - This is a wrapper for the Unix read() function that
  *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
@@ -797,6 +834,124 @@ ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) {
 }
 /* $end rio_readlineb */
 
+/*
+ * The rionb functions are the buffered Rio functions for non-blocking
+ * descriptors. Where rio_readlineb and friends would fail with EAGAIN
+ * (losing what they had read), they return RIO_WOULDBLOCK and keep their
+ * progress in rp->rio_pos; the caller waits for rionb_wait(rp) (epoll or
+ * poll) and calls again with the same buffer and size, and the call
+ * picks up where it stopped. Only one line, record or write may be in
+ * progress at a time.
+ */
+
+/* Finish the call in progress: return its byte count and reset the progress */
+static ssize_t rionb_done(rionb_t *rp) {
+    ssize_t n = rp->rio_pos;
+
+    rp->rio_pos = 0;
+    rp->rio_wait = 0;
+    return n;
+}
+
+/* An I/O call failed: RIO_WOULDBLOCK (waiting for events) if it would have blocked, else -1 */
+static ssize_t rionb_blocked(rionb_t *rp, int events) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+        return -1; /* errno set by read() or write() */
+    rp->rio_wait = events;
+    return RIO_WOULDBLOCK;
+}
+
+/*
+ * rionb_init - Associate a (non-blocking) descriptor with a read buffer
+ */
+/* $begin rionb_init */
+void rionb_init(rionb_t *rp, int fd) {
+    rio_readinitb(&rp->rio, fd);
+    rp->rio_pos = 0;
+    rp->rio_wait = 0;
+}
+/* $end rionb_init */
+
+/*
+ * rionb_readnb - Read n bytes (buffered, resumable). Returns n, a short
+ *    count at EOF, RIO_WOULDBLOCK, or -1 on error.
+ */
+/* $begin rionb_readnb */
+ssize_t rionb_readnb(rionb_t *rp, void *usrbuf, size_t n) {
+    ssize_t nread;
+
+    while (rp->rio_pos < n) {
+        if ((nread = rio_read(&rp->rio, (char *)usrbuf + rp->rio_pos, n - rp->rio_pos)) < 0)
+            return rionb_blocked(rp, POLLIN);
+        else if (nread == 0)
+            break; /* EOF */
+        rp->rio_pos += nread;
+    }
+    return rionb_done(rp);
+}
+/* $end rionb_readnb */
+
+/*
+ * rionb_readlineb - Read a text line (buffered, resumable). Returns the
+ *    line length as rio_readlineb does, RIO_WOULDBLOCK, or -1 on error.
+ */
+/* $begin rionb_readlineb */
+ssize_t rionb_readlineb(rionb_t *rp, void *usrbuf, size_t maxlen) {
+    int rc;
+    char c, *bufp = (char *)usrbuf + rp->rio_pos;
+
+    while (rp->rio_pos + 1 < maxlen) {
+        if ((rc = rio_read(&rp->rio, &c, 1)) == 1) {
+            *bufp++ = c;
+            rp->rio_pos++;
+            if (c == '\n')
+                break;
+        } else if (rc == 0) {
+            break; /* EOF, with or without data read */
+        } else
+            return rionb_blocked(rp, POLLIN);
+    }
+    *bufp = 0;
+    return rionb_done(rp);
+}
+/* $end rionb_readlineb */
+
+/*
+ * rionb_writen - Write n bytes (unbuffered, resumable). Returns n,
+ *    RIO_WOULDBLOCK, or -1 on error.
+ */
+/* $begin rionb_writen */
+ssize_t rionb_writen(rionb_t *rp, void *usrbuf, size_t n) {
+    ssize_t nwritten;
+
+    while (rp->rio_pos < n) {
+        if ((nwritten = write(rp->rio.rio_fd, (char *)usrbuf + rp->rio_pos, n - rp->rio_pos)) < 0) {
+            if (errno == EINTR) /* Interrupted by sig handler return */
+                continue;
+            return rionb_blocked(rp, POLLOUT);
+        }
+        rp->rio_pos += nwritten;
+    }
+    return rionb_done(rp);
+}
+/* $end rionb_writen */
+
+/*
+ * rionb_wait - Events (POLLIN, POLLOUT) to wait for before calling again
+ *    after RIO_WOULDBLOCK; 0 if buffered input lets a read go on now
+ */
+/* $begin rionb_wait */
+int rionb_wait(rionb_t *rp) { return rp->rio.rio_cnt > 0 ? 0 : rp->rio_wait; }
+/* $end rionb_wait */
+
+/*
+ * rionb_buffered - Bytes read from the descriptor but not yet returned;
+ *    they are at rp->rio.rio_bufptr
+ */
+/* $begin rionb_buffered */
+size_t rionb_buffered(rionb_t *rp) { return rp->rio.rio_cnt > 0 ? rp->rio.rio_cnt : 0; }
+/* $end rionb_buffered */
+
 /**********************************
  * Wrappers for robust I/O routines
  **********************************/
@@ -813,6 +968,11 @@ void Rio_writen(int fd, void *usrbuf, size_t n) {
         unix_error("Rio_writen error");
 }
 
+void Rio_writev(int fd, struct iovec *iov, int iovcnt) {
+    if (rio_writev(fd, iov, iovcnt) < 0)
+        unix_error("Rio_writev error");
+}
+
 void Rio_readinitb(rio_t *rp, int fd) { rio_readinitb(rp, fd); }
 
 ssize_t Rio_readnb(rio_t *rp, void *usrbuf, size_t n) {
@@ -882,9 +1042,73 @@ int open_clientfd(char *hostname, char *port) {
 }
 /* $end open_clientfd */
 
+/*
+ * open_unix_clientfd - Open connection to a server listening on the
+ *     Unix-domain socket at path.
+ *
+ *     On error, returns -1 with errno set.
+ */
+/* $begin open_unix_clientfd */
+int open_unix_clientfd(char *path) {
+    struct sockaddr_un addr;
+    int clientfd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if ((clientfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return -1;
+    if (connect(clientfd, (SA *)&addr, sizeof(addr)) < 0) {
+        close(clientfd);
+        return -1;
+    }
+    return clientfd;
+}
+/* $end open_unix_clientfd */
+
+/*
+ * open_unix_listenfd - Open and return a listening socket bound to the
+ *     Unix-domain path. A socket file left behind by an earlier run is
+ *     removed first; any other kind of file at path is an error.
+ *
+ *     On error, returns -1 with errno set.
+ */
+/* $begin open_unix_listenfd */
+int open_unix_listenfd(char *path) {
+    struct sockaddr_un addr;
+    struct stat sb;
+    int listenfd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if (lstat(path, &sb) == 0 && S_ISSOCK(sb.st_mode))
+        unlink(path);
+
+    if ((listenfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return -1;
+    if (bind(listenfd, (SA *)&addr, sizeof(addr)) < 0 || listen(listenfd, LISTENQ) < 0) {
+        close(listenfd);
+        return -1;
+    }
+    return listenfd;
+}
+/* $end open_unix_listenfd */
+
 /*
  * open_listenfd - Open and return a listening socket on port. This
- *     function is reentrant and protocol-independent.
+ *     function is reentrant and protocol-independent. A port that
+ *     contains a '/' is taken as a Unix-domain socket path.
  *
  *     On error, returns:
  *       -2 for getaddrinfo error
@@ -895,6 +1119,9 @@ int open_listenfd(char *port) {
     struct addrinfo hints, *listp, *p;
     int listenfd, rc, optval = 1;
 
+    if (strchr(port, '/'))
+        return open_unix_listenfd(port);
+
     /* Get a list of potential server addresses */
     memset(&hints, 0, sizeof(struct addrinfo));
     hints.ai_socktype = SOCK_STREAM;             /* Accept connections */
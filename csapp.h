@@ -13,6 +13,7 @@
 #include <math.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <pthread.h>
 #include <semaphore.h>
 #include <setjmp.h>
@@ -26,6 +27,8 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
@@ -43,6 +46,9 @@ typedef struct sockaddr SA;
 /* Persistent state for the robust I/O (Rio) package */
 /* $begin rio_t */
 #define RIO_BUFSIZE 8192
+#ifndef IOV_MAX
+#define IOV_MAX 1024 /* Most buffers one writev takes (Linux UIO_MAXIOV; limits.h hides it without _XOPEN_SOURCE) */
+#endif
 typedef struct {
     int rio_fd;                /* Descriptor for this internal buf */
     int rio_cnt;               /* Unread bytes in internal buf */
@@ -51,6 +57,16 @@ typedef struct {
 } rio_t;
 /* $end rio_t */
 
+/* Persistent state for the non-blocking Rio variant */
+/* $begin rionb_t */
+#define RIO_WOULDBLOCK -2 /* Call again with the same buffer once rionb_wait() is ready */
+typedef struct {
+    rio_t rio;      /* Read buffer, shared with the blocking functions */
+    size_t rio_pos; /* Bytes of the unfinished line, record or write done so far */
+    int rio_wait;   /* Readiness (POLLIN or POLLOUT) the last RIO_WOULDBLOCK waits for */
+} rionb_t;
+/* $end rionb_t */
+
 /* External variables */
 extern int h_errno;    /* Defined by BIND for DNS errors */
 extern char **environ; /* Defined by libc */
@@ -171,13 +187,23 @@ void V(sem_t *sem);
 /* Rio (Robust I/O) package */
 ssize_t rio_readn(int fd, void *usrbuf, size_t n);
 ssize_t rio_writen(int fd, void *usrbuf, size_t n);
+ssize_t rio_writev(int fd, struct iovec *iov, int iovcnt);
 void rio_readinitb(rio_t *rp, int fd);
 ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
 
+/* Non-blocking Rio: resumable after RIO_WOULDBLOCK, with the partial progress kept in rionb_t */
+void rionb_init(rionb_t *rp, int fd);
+ssize_t rionb_readnb(rionb_t *rp, void *usrbuf, size_t n);
+ssize_t rionb_readlineb(rionb_t *rp, void *usrbuf, size_t maxlen);
+ssize_t rionb_writen(rionb_t *rp, void *usrbuf, size_t n);
+int rionb_wait(rionb_t *rp);
+size_t rionb_buffered(rionb_t *rp);
+
 /* Wrappers for Rio package */
 ssize_t Rio_readn(int fd, void *usrbuf, size_t n);
 void Rio_writen(int fd, void *usrbuf, size_t n);
+void Rio_writev(int fd, struct iovec *iov, int iovcnt);
 void Rio_readinitb(rio_t *rp, int fd);
 ssize_t Rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
@@ -185,6 +211,8 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
 /* Reentrant protocol-independent client/server helpers */
 int open_clientfd(char *hostname, char *port);
 int open_listenfd(char *port);
+int open_unix_clientfd(char *path);
+int open_unix_listenfd(char *path);
 
 /* Wrappers for reentrant protocol-independent client/server helpers */
 int Open_clientfd(char *hostname, char *port);
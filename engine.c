@@ -0,0 +1,191 @@
+/*
+ * engine.c - Thread-per-connection and worker-pool engines
+ */
+#include "engine.h"
+#include "stats.h"
+#include <time.h>
+
+typedef struct Job {
+    void *arg;
+    long submitted; // now_ns() at hand-off.
+} Job;
+
+typedef struct Engine {
+    char *name;
+    int sized; // Takes a thread count ("pool:n").
+    int pinned; // Handlers run on the submitting thread's CPUs (threads it creates inherit them).
+    void (*start)(void);
+    int (*submit)(Job *job);
+} Engine;
+
+static engine_handler_t handler;
+static int pool_threads = ENGINE_POOL_THREADS;
+
+/* Pool queue: a ring of jobs waiting for a worker */
+static Job queue[ENGINE_QUEUE_MAX];
+static int queue_head, queue_len;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t nonempty = PTHREAD_COND_INITIALIZER;
+
+static unsigned long workers, submitted, rejected, started, start_ns, queue_high;
+
+static long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* Runs the handler for a job taken off the queue or passed to a new thread */
+static void run(Job *job) {
+    STAT_INC(started);
+    STAT_ADD(start_ns, now_ns() - job->submitted);
+    handler(job->arg);
+}
+
+/* $begin thread engine */
+static void *connection_thread(void *arg) {
+    Job job = *(Job *)arg;
+
+    free(arg);
+    pthread_detach(pthread_self()); // Reclaimed when the connection is done.
+    run(&job);
+    return NULL;
+}
+
+static void thread_start(void) {}
+
+static int thread_submit(Job *job) {
+    pthread_t tid;
+    Job *copy = malloc(sizeof(Job));
+
+    if (!copy)
+        return -1;
+    *copy = *job;
+    if (pthread_create(&tid, NULL, connection_thread, copy) != 0) {
+        free(copy);
+        return -1;
+    }
+    STAT_INC(workers);
+    return 0;
+}
+/* $end thread engine */
+
+/* $begin pool engine */
+static void *pool_worker(void *arg) {
+    Job job;
+
+    while (1) {
+        pthread_mutex_lock(&lock);
+        while (queue_len == 0)
+            pthread_cond_wait(&nonempty, &lock);
+        job = queue[queue_head];
+        queue_head = (queue_head + 1) % ENGINE_QUEUE_MAX;
+        queue_len--;
+        pthread_mutex_unlock(&lock);
+        run(&job);
+    }
+    return NULL;
+}
+
+static void pool_start(void) {
+    pthread_t tid;
+    int i;
+
+    for (i = 0; i < pool_threads; i++) {
+        if (pthread_create(&tid, NULL, pool_worker, NULL) != 0) {
+            fprintf(stderr, "engine: started only %d of %d pool threads\n", i, pool_threads);
+            if (i == 0)
+                exit(1);
+            break;
+        }
+        pthread_detach(tid);
+        STAT_INC(workers);
+    }
+}
+
+static int pool_submit(Job *job) {
+    pthread_mutex_lock(&lock);
+    if (queue_len == ENGINE_QUEUE_MAX) {
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    queue[(queue_head + queue_len) % ENGINE_QUEUE_MAX] = *job;
+    if (++queue_len > queue_high)
+        queue_high = queue_len;
+    pthread_cond_signal(&nonempty);
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+/* $end pool engine */
+
+static Engine engines[] = {
+    {"thread", 0, 1, thread_start, thread_submit},
+    {"pool", 1, 0, pool_start, pool_submit},
+};
+static Engine *engine = &engines[0];
+
+/* $begin engine_configure */
+int engine_configure(char *spec) {
+    size_t len = strcspn(spec, ":");
+    char *end;
+    int i;
+
+    for (i = 0; i < sizeof(engines) / sizeof(engines[0]); i++)
+        if (strlen(engines[i].name) == len && !strncmp(spec, engines[i].name, len))
+            break;
+    if (i == sizeof(engines) / sizeof(engines[0]) || (spec[len] && !engines[i].sized)) {
+        fprintf(stderr, "engine: unknown engine %s (expected thread or pool[:threads])\n", spec);
+        return -1;
+    }
+    if (spec[len]) {
+        long n = strtol(spec + len + 1, &end, 10);
+        if (*end != '\0' || n < 1 || n > ENGINE_POOL_MAX) {
+            fprintf(stderr, "engine: bad pool size %s (expected 1-%d)\n", spec + len + 1, ENGINE_POOL_MAX);
+            return -1;
+        }
+        pool_threads = n;
+    }
+    engine = &engines[i];
+    return 0;
+}
+/* $end engine_configure */
+
+/* $begin engine_pinned */
+int engine_pinned(void) { return engine->pinned; }
+/* $end engine_pinned */
+
+/* $begin engine_init */
+void engine_init(engine_handler_t h) {
+    handler = h;
+    engine->start();
+}
+/* $end engine_init */
+
+/* $begin engine_submit */
+int engine_submit(void *arg) {
+    Job job = {arg, now_ns()};
+
+    if (engine->submit(&job) < 0) {
+        STAT_INC(rejected);
+        return -1;
+    }
+    STAT_INC(submitted);
+    return 0;
+}
+/* $end engine_submit */
+
+/* $begin engine_stats */
+int engine_stats(char *buf, size_t size) {
+    int len = 0, queued;
+    unsigned long n = STAT_GET(started);
+
+    pthread_mutex_lock(&lock);
+    queued = queue_len;
+    pthread_mutex_unlock(&lock);
+    len += snprintf(buf + len, size - len, "engine.kind %s\nengine.threads_started %lu\nengine.submitted %lu\nengine.rejected %lu\n", engine->name,
+                    STAT_GET(workers), STAT_GET(submitted), STAT_GET(rejected));
+    len += snprintf(buf + len, size - len, "engine.queued %d\nengine.queue_high %lu\nengine.start_us_avg %.1f\n", queued, STAT_GET(queue_high),
+                    n ? STAT_GET(start_ns) / 1000.0 / n : 0.0);
+    return len < size ? len : size - 1;
+}
+/* $end engine_stats */
@@ -0,0 +1,56 @@
+/*
+ * engine.h - How connections with a complete request head are served
+ *
+ * The proxy used to come in two copies: proxy.c and an older proxy-2.c
+ * whose parse_uri and doit had drifted apart, so comparing two ways of
+ * running the same handler meant keeping both trees building. There is
+ * now one handler (doit, with the shared parse and cache code) and the
+ * engine that runs it is picked at startup with -e:
+ *
+ *   thread    a detached thread per connection (the default)
+ *   pool[:n]  n long-lived worker threads fed from a bounded queue; a
+ *             connection arriving to a full queue is dropped
+ *
+ * Either engine sits behind the accept loops and, unless -T 0, behind the
+ * front stage's epoll loop that reads request heads without a thread (see
+ * front.h). There is no event-loop engine: the handler blocks, so it always
+ * runs on a thread of one of the two above.
+ *
+ * Only the thread engine keeps -C's per-CPU handling: a connection thread
+ * inherits its acceptor's pinning, while pool workers are shared by all
+ * acceptors. -C with -e pool is refused at startup.
+ *
+ * engine.* in /proxy-stats reports the time from hand-off to the start of
+ * the handler, which is what the engines differ in, so runs of the same
+ * workload under each can be compared directly.
+ */
+/* $begin engine.h */
+#ifndef __ENGINE_H__
+#define __ENGINE_H__
+
+#include "csapp.h"
+
+#define ENGINE_POOL_THREADS 64 /* Default pool size */
+#define ENGINE_POOL_MAX 4096   /* Largest pool -e pool:n accepts */
+#define ENGINE_QUEUE_MAX 1024  /* Connections waiting for a pool worker */
+
+/* Serve one connection; the engine calls it on a worker thread */
+typedef void (*engine_handler_t)(void *arg);
+
+/* Select the engine: "thread" or "pool[:threads]" */
+int engine_configure(char *spec);
+
+/* Whether handlers run on the CPUs of the thread that submits to them (-C needs it) */
+int engine_pinned(void);
+
+/* Start the selected engine's workers; call once before the first engine_submit */
+void engine_init(engine_handler_t handler);
+
+/* Hand arg to a worker; -1 if no worker could take it (the caller still owns arg) */
+int engine_submit(void *arg);
+
+/* Write a plain-text report of the engine and its hand-off latency into buf */
+int engine_stats(char *buf, size_t size);
+
+#endif /* __ENGINE_H__ */
+/* $end engine.h */
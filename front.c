@@ -0,0 +1,281 @@
+/*
+ * front.c - Buffering request heads before a worker is spent on them
+ */
+#include "front.h"
+#include "stats.h"
+#include <sys/epoll.h>
+#include <time.h>
+
+typedef struct Pending {
+    int fd;
+    void *arg;                  // Passed back to dispatch/drop.
+    int64_t deadline_ms;        // When the head must be complete.
+    size_t len;                 // Bytes of complete lines in buf.
+    struct Pending *prev, *next; // Arrival (= expiry) order.
+    rionb_t rio;                // Non-blocking reader; holds a partial line between wakeups.
+    char buf[FRONT_HEAD_MAX];
+} Pending;
+
+struct Front {
+    int epfd;
+    front_dispatch_t dispatch;
+    front_drop_t drop;
+    Pending *head, *tail;  // Connections still reading their head.
+    pthread_mutex_t lock;  // Protects the list; the buffers belong to whoever holds the Pending.
+};
+
+enum { HEAD_PENDING, HEAD_READY, HEAD_DROP };
+
+static int deadline_ms = FRONT_DEADLINE_MS;
+
+static unsigned long submitted, ready_at_accept, dispatched, pending_now;
+static unsigned long timeouts, too_large, client_closed, wait_ms;
+
+static int64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* $begin front_set_deadline */
+int front_set_deadline(char *ms) {
+    char *end;
+    long value = strtol(ms, &end, 10);
+
+    if (*end != '\0' || value < 0) {
+        fprintf(stderr, "front: bad head deadline %s (expected milliseconds, 0 = off)\n", ms);
+        return -1;
+    }
+    deadline_ms = (int)value;
+    return 0;
+}
+/* $end front_set_deadline */
+
+/* Answer a client we are giving up on; best effort, the socket is non-blocking */
+static void refuse(int fd, char *status) {
+    char buf[MAXLINE];
+
+    snprintf(buf, sizeof(buf), "HTTP/1.0 %s\r\nContent-type: text/plain\r\nContent-length: %d\r\n\r\n%s\n", status,
+             (int)strlen(status) + 1, status);
+    send(fd, buf, strlen(buf), MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+/*
+ * fill - Read the head a line at a time, as far as the client has sent it.
+ *     Returns HEAD_READY after the blank line, HEAD_DROP if the client
+ *     closed, failed or overflowed the buffer (answered with 431), and
+ *     HEAD_PENDING otherwise.
+ */
+static int fill(Pending *p) {
+    ssize_t n;
+    size_t extra;
+    char *line;
+
+    do {
+        line = p->buf + p->len;
+        if ((n = rionb_readlineb(&p->rio, line, FRONT_HEAD_MAX - p->len)) == RIO_WOULDBLOCK)
+            return HEAD_PENDING;
+        if (n > 0 && p->len + n + 1 == FRONT_HEAD_MAX && line[n - 1] != '\n')
+            goto too_large;
+        if (n <= 0 || line[n - 1] != '\n') {
+            STAT_INC(client_closed);
+            return HEAD_DROP;
+        }
+        p->len += n;
+    } while (strcmp(line, "\r\n"));
+
+    /* Whatever came after the head (a body, the rest of an HTTP/2 preface) goes to the worker too */
+    if (p->len + (extra = rionb_buffered(&p->rio)) > FRONT_HEAD_MAX)
+        goto too_large;
+    memcpy(p->buf + p->len, p->rio.rio.rio_bufptr, extra);
+    p->len += extra;
+    return HEAD_READY;
+
+too_large:
+    STAT_INC(too_large);
+    refuse(p->fd, "431 Request Header Fields Too Large");
+    return HEAD_DROP;
+}
+
+/* Hand a finished Pending to its worker (or drop it) and free it */
+static void finish(Front *f, Pending *p, int status, int64_t started_ms) {
+    int flags = fcntl(p->fd, F_GETFL);
+
+    STAT_ADD(wait_ms, now_ms() - started_ms);
+    if (status == HEAD_READY) {
+        fcntl(p->fd, F_SETFL, flags & ~O_NONBLOCK); // Workers use blocking Rio.
+        STAT_INC(dispatched);
+        f->dispatch(p->fd, p->arg, p->buf, p->len);
+    } else {
+        f->drop(p->fd, p->arg);
+    }
+    free(p);
+}
+
+static void unlink_pending(Front *f, Pending *p) {
+    if (p->prev)
+        p->prev->next = p->next;
+    else
+        f->head = p->next;
+    if (p->next)
+        p->next->prev = p->prev;
+    else
+        f->tail = p->prev;
+    STAT_SUB(pending_now, 1);
+}
+
+/*
+ * front_thread - Wait for pending heads to make progress, and expire the
+ *     oldest ones. With nothing pending, a new connection cannot expire
+ *     sooner than one full deadline from now, so that is the longest wait.
+ */
+static void *front_thread(void *arg) {
+    Front *f = arg;
+    struct epoll_event events[FRONT_MAX_EVENTS];
+    Pending *p, *expired;
+    int i, n, status, timeout;
+    int64_t now;
+
+    pthread_detach(pthread_self());
+    while (1) {
+        pthread_mutex_lock(&f->lock);
+        timeout = f->head ? (int)(f->head->deadline_ms - now_ms()) : deadline_ms;
+        pthread_mutex_unlock(&f->lock);
+
+        if ((n = epoll_wait(f->epfd, events, FRONT_MAX_EVENTS, timeout < 0 ? 0 : timeout)) < 0) {
+            if (errno == EINTR)
+                continue;
+            unix_error("front: epoll_wait error");
+        }
+
+        for (i = 0; i < n; i++) {
+            p = events[i].data.ptr;
+            if ((status = fill(p)) == HEAD_PENDING)
+                continue;
+            pthread_mutex_lock(&f->lock);
+            unlink_pending(f, p);
+            pthread_mutex_unlock(&f->lock);
+            epoll_ctl(f->epfd, EPOLL_CTL_DEL, p->fd, NULL);
+            finish(f, p, status, p->deadline_ms - deadline_ms);
+        }
+
+        /* Expire from the head of the list: it is in deadline order */
+        now = now_ms();
+        expired = NULL;
+        pthread_mutex_lock(&f->lock);
+        while ((p = f->head) && p->deadline_ms <= now) {
+            unlink_pending(f, p);
+            p->next = expired;
+            expired = p;
+        }
+        pthread_mutex_unlock(&f->lock);
+        while ((p = expired)) {
+            expired = p->next;
+            epoll_ctl(f->epfd, EPOLL_CTL_DEL, p->fd, NULL);
+            STAT_INC(timeouts);
+            refuse(p->fd, "408 Request Timeout");
+            finish(f, p, HEAD_DROP, p->deadline_ms - deadline_ms);
+        }
+    }
+    return NULL;
+}
+
+/* $begin front_create */
+Front *front_create(front_dispatch_t dispatch, front_drop_t drop) {
+    Front *f;
+    pthread_t tid;
+
+    if (deadline_ms == 0)
+        return NULL;
+
+    f = calloc(1, sizeof(Front));
+    if ((f->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        unix_error("front: epoll_create1 error");
+    f->dispatch = dispatch;
+    f->drop = drop;
+    pthread_mutex_init(&f->lock, NULL);
+    Pthread_create(&tid, NULL, front_thread, f);
+    return f;
+}
+/* $end front_create */
+
+/*
+ * front_submit - Most clients send their whole head with the connection,
+ *     so try one read before involving the front thread: a head that is
+ *     already complete is dispatched straight from the accept loop.
+ */
+/* $begin front_submit */
+void front_submit(Front *f, int fd, void *arg) {
+    struct epoll_event ev;
+    Pending *p;
+    int status;
+    int64_t now = now_ms();
+
+    if (!(p = malloc(sizeof(Pending)))) {
+        refuse(fd, "503 Service Unavailable");
+        f->drop(fd, arg);
+        return;
+    }
+    p->fd = fd;
+    p->arg = arg;
+    p->len = 0;
+    rionb_init(&p->rio, fd);
+    p->deadline_ms = now + deadline_ms;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    STAT_INC(submitted);
+    if ((status = fill(p)) != HEAD_PENDING) {
+        if (status == HEAD_READY)
+            STAT_INC(ready_at_accept);
+        finish(f, p, status, now);
+        return;
+    }
+
+    /* Register under the lock so the thread cannot expire p before epoll knows it */
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = p;
+    pthread_mutex_lock(&f->lock);
+    p->prev = f->tail;
+    p->next = NULL;
+    if (f->tail)
+        f->tail->next = p;
+    else
+        f->head = p;
+    f->tail = p;
+    STAT_INC(pending_now);
+    if (epoll_ctl(f->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        unlink_pending(f, p);
+        pthread_mutex_unlock(&f->lock);
+        refuse(fd, "503 Service Unavailable");
+        finish(f, p, HEAD_DROP, now);
+        return;
+    }
+    pthread_mutex_unlock(&f->lock);
+}
+/* $end front_submit */
+
+/* $begin front_rio_init */
+void front_rio_init(rio_t *rp, int fd, char *head, size_t len) {
+    rio_readinitb(rp, fd);
+    if (len > RIO_BUFSIZE)
+        len = RIO_BUFSIZE;
+    memcpy(rp->rio_buf, head, len);
+    rp->rio_cnt = len;
+}
+/* $end front_rio_init */
+
+/* $begin front_stats */
+int front_stats(char *buf, size_t size) {
+    int len = 0;
+
+    len += snprintf(buf + len, size - len, "front.deadline_ms %d\n", deadline_ms);
+    if (deadline_ms == 0)
+        return len;
+
+    len += snprintf(buf + len, size - len, "front.submitted %lu\nfront.ready_at_accept %lu\nfront.dispatched %lu\nfront.pending %lu\n",
+                    STAT_GET(submitted), STAT_GET(ready_at_accept), STAT_GET(dispatched), STAT_GET(pending_now));
+    len += snprintf(buf + len, size - len, "front.timeouts %lu\nfront.too_large %lu\nfront.client_closed %lu\nfront.wait_ms %lu\n",
+                    STAT_GET(timeouts), STAT_GET(too_large), STAT_GET(client_closed), STAT_GET(wait_ms));
+    return len < size ? len : size - 1;
+}
+/* $end front_stats */
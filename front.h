@@ -0,0 +1,51 @@
+/*
+ * front.h - Buffering request heads before a worker is spent on them
+ *
+ * doit() reads the request with blocking Rio_readlineb(), so a client that
+ * trickles its headers a byte at a time holds a whole thread for as long
+ * as it likes. Each accept loop instead hands new connections to a front
+ * stage: one epoll thread that reads with non-blocking I/O until the head
+ * ends with a blank line, a line at a time with the resumable rionb
+ * functions (a partial line survives until the next epoll wakeup). Only
+ * complete heads are dispatched to a worker, along with the bytes already
+ * read; heads that do not complete within the deadline get a 408, and
+ * heads larger than FRONT_HEAD_MAX get a 431.
+ *
+ * Pending connections are kept in arrival order, which with one fixed
+ * deadline is also expiry order, so timeouts are found at the list head.
+ */
+/* $begin front.h */
+#ifndef __FRONT_H__
+#define __FRONT_H__
+
+#include "csapp.h"
+
+#define FRONT_HEAD_MAX RIO_BUFSIZE   /* A head must fit one Rio buffer so the worker can start from it */
+#define FRONT_DEADLINE_MS 10000      /* Default time allowed for a complete head */
+#define FRONT_MAX_EVENTS 64          /* epoll_wait batch size */
+
+typedef struct Front Front;
+
+/* A complete head was read from fd: hand fd, arg and the bytes read to a worker */
+typedef void (*front_dispatch_t)(int fd, void *arg, char *head, size_t len);
+
+/* The connection failed or was refused (the client has been answered): release fd and arg */
+typedef void (*front_drop_t)(int fd, void *arg);
+
+/* Set the head deadline in ms; 0 turns the front stage off */
+int front_set_deadline(char *ms);
+
+/* Start a front stage thread; NULL if the front stage is off */
+Front *front_create(front_dispatch_t dispatch, front_drop_t drop);
+
+/* Hand a newly accepted connection to the front stage */
+void front_submit(Front *f, int fd, void *arg);
+
+/* Initialize a Rio buffer for fd that starts with len bytes already read */
+void front_rio_init(rio_t *rp, int fd, char *head, size_t len);
+
+/* Write a plain-text report of front-stage counters into buf */
+int front_stats(char *buf, size_t size);
+
+#endif /* __FRONT_H__ */
+/* $end front.h */
@@ -0,0 +1,714 @@
+/*
+ * h2.c - Cleartext HTTP/2 (h2c) on the client listeners
+ */
+#include "h2.h"
+#include "hpack.h"
+#include "netio.h"
+#include "stats.h"
+#include <netinet/tcp.h>
+#include <stdint.h>
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define DEFAULT_WINDOW 65535
+#define MAX_FIELDS 128 /* Header fields accepted per request */
+
+/* Frame types, flags, settings and error codes (RFC 7540 sections 6, 6.5.2 and 7) */
+enum { FRAME_DATA, FRAME_HEADERS, FRAME_PRIORITY, FRAME_RST_STREAM, FRAME_SETTINGS, FRAME_PUSH_PROMISE, FRAME_PING, FRAME_GOAWAY, FRAME_WINDOW_UPDATE, FRAME_CONTINUATION };
+#define FLAG_END_STREAM 0x1
+#define FLAG_ACK 0x1
+#define FLAG_END_HEADERS 0x4
+#define FLAG_PADDED 0x8
+#define FLAG_PRIORITY 0x20
+#define SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define SETTINGS_MAX_FRAME_SIZE 0x5
+#define ERR_PROTOCOL 0x1
+#define ERR_INTERNAL 0x2
+#define ERR_FLOW_CONTROL 0x3
+#define ERR_FRAME_SIZE 0x6
+#define ERR_REFUSED_STREAM 0x7
+#define ERR_COMPRESSION 0x9
+#define ERR_ENHANCE_YOUR_CALM 0xb
+
+typedef struct H2Conn H2Conn;
+
+typedef struct H2Stream {
+    uint32_t id;
+    int32_t window;              // Send window; may go negative when the client shrinks the initial window.
+    int reset;                   // The client reset it: stop sending and just drain the handler.
+    int fd;                      // Handler's end of the socketpair.
+    H2Conn *conn;
+    struct H2Stream *next;
+    size_t len;
+    char request[H2_HEAD_MAX];   // The request rewritten as an HTTP/1.0 head.
+} H2Stream;
+
+struct H2Conn {
+    int fd;
+    void *arg;                   // Handed to the handler with every stream.
+    pthread_mutex_t lock;        // Protects the fields below.
+    pthread_cond_t cond;         // A window grew, a stream ended, or the connection is closing.
+    int32_t window;              // Connection send window.
+    int32_t initial_window;      // Client's SETTINGS_INITIAL_WINDOW_SIZE for stream windows.
+    uint32_t max_frame;          // Client's SETTINGS_MAX_FRAME_SIZE.
+    int nstreams;
+    int closing;
+    H2Stream *streams;
+    pthread_mutex_t write_lock;  // One frame (or header block) at a time on fd.
+};
+
+static h2_handler_t handler;
+static int origin_form;
+
+static unsigned long connections, upgrades, streams, active, refused, client_resets, window_stalls, protocol_errors;
+
+/* $begin h2_init */
+void h2_init(h2_handler_t fn, int origin) {
+    handler = fn;
+    origin_form = origin;
+}
+/* $end h2_init */
+
+int h2_enabled(void) { return handler != NULL; }
+
+static uint32_t get32(unsigned char *p) { return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]; }
+
+static void put32(unsigned char *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void set_closing(H2Conn *c) {
+    pthread_mutex_lock(&c->lock);
+    c->closing = 1;
+    pthread_cond_broadcast(&c->cond);
+    pthread_mutex_unlock(&c->lock);
+}
+
+/*
+ * write_frame_locked - Write one frame; the caller holds write_lock. Header
+ *     and payload go out in one writev, so a frame is one segment.
+ */
+static int write_frame_locked(H2Conn *c, int type, int flags, uint32_t id, void *payload, size_t len) {
+    unsigned char hdr[9];
+    struct iovec iov[2] = {{hdr, 9}, {payload, len}};
+
+    put32(hdr, len << 8 | type);
+    hdr[4] = flags;
+    put32(hdr + 5, id);
+    if (netio_writev(c->fd, iov, 2) < 0) {
+        set_closing(c);
+        return -1;
+    }
+    return 0;
+}
+
+static int write_frame(H2Conn *c, int type, int flags, uint32_t id, void *payload, size_t len) {
+    int rc;
+
+    pthread_mutex_lock(&c->write_lock);
+    rc = write_frame_locked(c, type, flags, id, payload, len);
+    pthread_mutex_unlock(&c->write_lock);
+    return rc;
+}
+
+static void send_code(H2Conn *c, int type, uint32_t id, uint32_t last, uint32_t code) {
+    unsigned char payload[8];
+
+    put32(payload, last);
+    put32(payload + 4, code);
+    if (type == FRAME_GOAWAY)
+        write_frame(c, type, 0, 0, payload, 8);
+    else
+        write_frame(c, type, 0, id, payload + 4, 4);
+}
+
+static void send_window_update(H2Conn *c, uint32_t id, uint32_t inc) {
+    unsigned char payload[4];
+
+    put32(payload, inc);
+    write_frame(c, FRAME_WINDOW_UPDATE, 0, id, payload, 4);
+}
+
+/* Send a header block as HEADERS plus CONTINUATION frames, which nothing may interleave with */
+static int send_headers(H2Stream *s, unsigned char *block, size_t len, int end_stream) {
+    H2Conn *c = s->conn;
+    size_t max = c->max_frame, n;
+    int type = FRAME_HEADERS, rc = 0;
+
+    pthread_mutex_lock(&c->write_lock);
+    do {
+        n = len < max ? len : max;
+        rc = write_frame_locked(c, type, (n == len ? FLAG_END_HEADERS : 0) | (type == FRAME_HEADERS && end_stream ? FLAG_END_STREAM : 0), s->id,
+                                block, n);
+        type = FRAME_CONTINUATION;
+        block += n;
+        len -= n;
+    } while (rc == 0 && len > 0);
+    pthread_mutex_unlock(&c->write_lock);
+    return rc;
+}
+
+/* A response with only a status, for requests refused before reaching the handler */
+static void send_status(H2Stream *s, char *status) {
+    unsigned char block[16];
+    send_headers(s, block, hpack_encode(block, sizeof(block), ":status", status), 1);
+}
+
+/* Send body bytes as DATA frames, waiting for window on both the stream and the connection */
+static int send_data(H2Stream *s, char *buf, size_t len) {
+    H2Conn *c = s->conn;
+    size_t n;
+
+    while (len > 0) {
+        pthread_mutex_lock(&c->lock);
+        if (c->window <= 0 || s->window <= 0)
+            STAT_INC(window_stalls);
+        while (!s->reset && !c->closing && (c->window <= 0 || s->window <= 0))
+            pthread_cond_wait(&c->cond, &c->lock);
+        if (s->reset || c->closing) {
+            pthread_mutex_unlock(&c->lock);
+            return -1;
+        }
+        n = len;
+        if (n > (size_t)c->window)
+            n = c->window;
+        if (n > (size_t)s->window)
+            n = s->window;
+        if (n > c->max_frame)
+            n = c->max_frame;
+        c->window -= n;
+        s->window -= n;
+        pthread_mutex_unlock(&c->lock);
+
+        if (write_frame(c, FRAME_DATA, 0, s->id, buf, n) < 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Connection-specific HTTP/1 headers that HTTP/2 forbids (and that must not be forwarded from it) */
+static int hop_by_hop(char *name) {
+    static char *names[] = {"connection", "keep-alive", "proxy-connection", "transfer-encoding", "upgrade", "te", "http2-settings", NULL};
+    int i;
+
+    for (i = 0; names[i]; i++)
+        if (!strcasecmp(name, names[i]))
+            return 1;
+    return 0;
+}
+
+/*
+ * relay_stream - Turn the handler's HTTP/1.0 response on fd into HEADERS
+ *     and DATA frames. If the client resets the stream (or the connection
+ *     goes), the rest is read and dropped, so the handler never writes
+ *     into a closed socket.
+ */
+static void relay_stream(H2Stream *s, int fd) {
+    unsigned char block[H2_MAX_BLOCK];
+    char line[MAXLINE], buf[H2_MAX_FRAME], status[8] = "502", *colon;
+    size_t len;
+    ssize_t n;
+    int code, ok = 0, sending;
+    rio_t rio;
+
+    rio_readinitb(&rio, fd);
+    if (rio_readlineb(&rio, line, MAXLINE) > 0 && sscanf(line, "HTTP/%*d.%*d %d", &code) == 1 && code >= 100 && code <= 999) {
+        snprintf(status, sizeof(status), "%d", code);
+        ok = 1;
+    }
+    len = hpack_encode(block, sizeof(block), ":status", status);
+    while (ok && rio_readlineb(&rio, line, MAXLINE) > 0 && line[0] != '\r' && line[0] != '\n') {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (!(colon = strchr(line, ':')))
+            continue;
+        *colon = '\0';
+        if (!hop_by_hop(line))
+            len += hpack_encode(block + len, sizeof(block) - len, line, colon + 1 + strspn(colon + 1, " \t"));
+    }
+    sending = send_headers(s, block, len, !ok) == 0 && ok;
+
+    /* Whatever the Rio already holds, then the rest as it comes */
+    if (sending && rio.rio_cnt > 0)
+        sending = send_data(s, rio.rio_bufptr, rio.rio_cnt) == 0;
+    while ((n = read(fd, buf, sizeof(buf))) > 0 || (n < 0 && errno == EINTR))
+        if (sending && n > 0)
+            sending = send_data(s, buf, n) == 0;
+    if (sending)
+        write_frame(s->conn, FRAME_DATA, FLAG_END_STREAM, s->id, NULL, 0);
+}
+
+static void *handler_thread(void *arg) {
+    H2Stream *s = arg;
+
+    handler(s->fd, s->request, s->len, s->conn->arg);
+    close(s->fd);
+    return NULL;
+}
+
+static void end_stream(H2Stream *s) {
+    H2Conn *c = s->conn;
+    H2Stream **link;
+
+    pthread_mutex_lock(&c->lock);
+    for (link = &c->streams; *link != s; link = &(*link)->next)
+        ;
+    *link = s->next;
+    c->nstreams--;
+    pthread_cond_broadcast(&c->cond);
+    pthread_mutex_unlock(&c->lock);
+    STAT_SUB(active, 1);
+    free(s);
+}
+
+/* One thread per stream: run the handler on a socketpair and relay what it answers */
+static void *stream_thread(void *arg) {
+    H2Stream *s = arg;
+    pthread_t tid;
+    int sv[2];
+
+    pthread_detach(pthread_self());
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        send_code(s->conn, FRAME_RST_STREAM, s->id, 0, ERR_INTERNAL);
+    } else {
+        s->fd = sv[1];
+        if (pthread_create(&tid, NULL, handler_thread, s) != 0) {
+            close(sv[1]);
+            send_code(s->conn, FRAME_RST_STREAM, s->id, 0, ERR_INTERNAL);
+        } else {
+            relay_stream(s, sv[0]);
+            pthread_join(tid, NULL);
+        }
+        close(sv[0]);
+    }
+    end_stream(s);
+    return NULL;
+}
+
+/* Admit a stream (or refuse it past H2_MAX_STREAMS) and start its thread; s is consumed */
+static void start_stream(H2Conn *c, H2Stream *s) {
+    pthread_t tid;
+    int admitted;
+
+    s->conn = c;
+    pthread_mutex_lock(&c->lock);
+    if ((admitted = !c->closing && c->nstreams < H2_MAX_STREAMS)) {
+        s->window = c->initial_window;
+        s->next = c->streams;
+        c->streams = s;
+        c->nstreams++;
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    if (!admitted) {
+        STAT_INC(refused);
+        send_code(c, FRAME_RST_STREAM, s->id, 0, ERR_REFUSED_STREAM);
+        free(s);
+        return;
+    }
+    STAT_INC(streams);
+    STAT_INC(active);
+    if (pthread_create(&tid, NULL, stream_thread, s) != 0) {
+        send_code(c, FRAME_RST_STREAM, s->id, 0, ERR_INTERNAL);
+        end_stream(s);
+    }
+}
+
+/*
+ * valid_field - RFC 9113 8.2.1: names are lowercase tokens (a leading ':'
+ *     for pseudo-headers) and values hold no CR, LF or NUL (decoded as CR).
+ *     Pseudo-header values become the request line, so they may not hold
+ *     spaces either. Anything else would be pasted into the HTTP/1.0 head.
+ */
+static int valid_field(HpackField *f) {
+    char *p = f->name + (f->name[0] == ':');
+
+    if (!*p)
+        return 0;
+    for (; *p; p++)
+        if (*p <= ' ' || *p >= 0x7f || (*p >= 'A' && *p <= 'Z') || *p == ':')
+            return 0;
+    if (strpbrk(f->value, "\r\n"))
+        return 0;
+    return f->name[0] != ':' || (f->value[0] && !strpbrk(f->value, " \t"));
+}
+
+/*
+ * open_stream - Decode a complete request header block and rewrite it as
+ *     an HTTP/1.0 head: the pseudo-headers become the request line (an
+ *     absolute URI, or the path in origin-form mode) and the Host header.
+ *     A malformed request gets RST_STREAM (PROTOCOL_ERROR) and is not
+ *     forwarded. Returns -1 on a compression error, which ends the connection.
+ */
+static int open_stream(H2Conn *c, Hpack *hpack, uint32_t id, unsigned char *block, size_t len) {
+    HpackField fields[MAX_FIELDS];
+    char *method = NULL, *scheme = "http", *authority = NULL, *path = NULL;
+    H2Stream *s;
+    int i, n, malformed = 0;
+
+    if ((n = hpack_decode(hpack, block, len, fields, MAX_FIELDS)) < 0 || !(s = calloc(1, sizeof(H2Stream)))) {
+        if (n >= 0)
+            hpack_free_fields(fields, n);
+        return -1;
+    }
+    s->id = id;
+    for (i = 0; i < n; i++) {
+        if (!valid_field(&fields[i]))
+            malformed = 1;
+        else if (!strcmp(fields[i].name, ":method"))
+            method = fields[i].value;
+        else if (!strcmp(fields[i].name, ":scheme"))
+            scheme = fields[i].value;
+        else if (!strcmp(fields[i].name, ":authority") || (!authority && !strcmp(fields[i].name, "host")))
+            authority = fields[i].value;
+        else if (!strcmp(fields[i].name, ":path"))
+            path = fields[i].value;
+    }
+
+    if (method && path && !malformed) {
+        if (origin_form || !authority)
+            s->len = snprintf(s->request, H2_HEAD_MAX, "%s %s HTTP/1.0\r\n", method, path);
+        else
+            s->len = snprintf(s->request, H2_HEAD_MAX, "%s %s://%s%s HTTP/1.0\r\n", method, scheme, authority, path);
+        if (authority && s->len < H2_HEAD_MAX)
+            s->len += snprintf(s->request + s->len, H2_HEAD_MAX - s->len, "Host: %s\r\n", authority);
+        for (i = 0; i < n && s->len < H2_HEAD_MAX; i++)
+            if (fields[i].name[0] != ':' && strcmp(fields[i].name, "host") && !hop_by_hop(fields[i].name))
+                s->len += snprintf(s->request + s->len, H2_HEAD_MAX - s->len, "%s: %s\r\n", fields[i].name, fields[i].value);
+        if (s->len < H2_HEAD_MAX)
+            s->len += snprintf(s->request + s->len, H2_HEAD_MAX - s->len, "\r\n");
+    }
+    hpack_free_fields(fields, n);
+
+    if (!method || !path || malformed) {
+        STAT_INC(protocol_errors);
+        send_code(c, FRAME_RST_STREAM, id, 0, ERR_PROTOCOL);
+        free(s);
+    } else if (s->len >= H2_HEAD_MAX) {
+        s->conn = c;
+        send_status(s, "431");
+        free(s);
+    } else {
+        start_stream(c, s);
+    }
+    return 0;
+}
+
+/* Apply SETTINGS entries; returns an error code, or -1 if they are fine */
+static int apply_settings(H2Conn *c, unsigned char *p, size_t len) {
+    H2Stream *s;
+    uint32_t value;
+    int err = -1;
+
+    pthread_mutex_lock(&c->lock);
+    for (; len >= 6 && err < 0; p += 6, len -= 6) {
+        value = get32(p + 2);
+        switch (p[0] << 8 | p[1]) {
+        case SETTINGS_INITIAL_WINDOW_SIZE:
+            if (value > 0x7fffffff)
+                err = ERR_FLOW_CONTROL;
+            for (s = c->streams; s && err < 0; s = s->next)
+                if ((int64_t)s->window + value - c->initial_window > 0x7fffffff)
+                    err = ERR_FLOW_CONTROL; // RFC 9113 6.9.2: no stream window may pass 2^31-1.
+            if (err >= 0)
+                break;
+            for (s = c->streams; s; s = s->next)
+                s->window += (int32_t)value - c->initial_window;
+            c->initial_window = value;
+            break;
+        case SETTINGS_MAX_FRAME_SIZE:
+            if (value < 16384 || value > 16777215)
+                err = ERR_PROTOCOL;
+            else
+                c->max_frame = value;
+            break;
+        }
+    }
+    pthread_cond_broadcast(&c->cond);
+    pthread_mutex_unlock(&c->lock);
+    return err;
+}
+
+static void send_settings(H2Conn *c) {
+    unsigned char payload[6] = {0, SETTINGS_MAX_CONCURRENT_STREAMS};
+
+    put32(payload + 2, H2_MAX_STREAMS);
+    write_frame(c, FRAME_SETTINGS, 0, 0, payload, 6);
+}
+
+/* Apply a WINDOW_UPDATE; returns an error code if a window would pass 2^31-1, else -1 */
+static int grow_window(H2Conn *c, uint32_t id, uint32_t inc) {
+    H2Stream *s;
+    int32_t *window = id ? NULL : &c->window;
+    int err = -1;
+
+    pthread_mutex_lock(&c->lock);
+    for (s = c->streams; id && s && !window; s = s->next)
+        if (s->id == id)
+            window = &s->window;
+    if (window && (int64_t)*window + inc > 0x7fffffff)
+        err = ERR_FLOW_CONTROL;
+    else if (window)
+        *window += inc;
+    pthread_cond_broadcast(&c->cond);
+    pthread_mutex_unlock(&c->lock);
+    return err;
+}
+
+static void reset_stream(H2Conn *c, uint32_t id) {
+    H2Stream *s;
+
+    pthread_mutex_lock(&c->lock);
+    for (s = c->streams; s; s = s->next)
+        if (s->id == id)
+            s->reset = 1;
+    pthread_cond_broadcast(&c->cond);
+    pthread_mutex_unlock(&c->lock);
+}
+
+static H2Conn *new_conn(int fd, void *arg) {
+    H2Conn *c = calloc(1, sizeof(H2Conn));
+    int one = 1;
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // Every write is a whole frame.
+    c->fd = fd;
+    c->arg = arg;
+    c->window = c->initial_window = DEFAULT_WINDOW;
+    c->max_frame = 16384;
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->cond, NULL);
+    pthread_mutex_init(&c->write_lock, NULL);
+    STAT_INC(connections);
+    return c;
+}
+
+/*
+ * serve - Read frames until the client closes the connection or breaks
+ *     the protocol, then wait for the streams still running to finish.
+ */
+static void serve(H2Conn *c, rio_t *rio, uint32_t last_id) {
+    unsigned char hdr[9], *payload = malloc(H2_MAX_FRAME), *block = malloc(H2_MAX_BLOCK);
+    Hpack *hpack = malloc(sizeof(Hpack));
+    size_t block_len = 0, off, pad;
+    uint32_t len, id, block_id = 0;
+    int type, flags, err = -1;
+
+    hpack_init(hpack);
+    while (err < 0 && rio_readnb(rio, hdr, 9) == 9) {
+        len = get32(hdr) >> 8;
+        type = hdr[3];
+        flags = hdr[4];
+        id = get32(hdr + 5) & 0x7fffffff;
+        off = pad = 0;
+        if (len > H2_MAX_FRAME) {
+            err = ERR_FRAME_SIZE;
+            break;
+        }
+        if (rio_readnb(rio, payload, len) != len)
+            break;
+        if (block_id && (type != FRAME_CONTINUATION || id != block_id)) {
+            err = ERR_PROTOCOL; // Nothing may come between the frames of one header block.
+            break;
+        }
+
+        switch (type) {
+        case FRAME_DATA:
+            if (len > 0) { // Request bodies are dropped, so hand the window straight back.
+                send_window_update(c, 0, len);
+                send_window_update(c, id, len);
+            }
+            break;
+        case FRAME_HEADERS:
+            if (!(id & 1) || id <= last_id) {
+                err = ERR_PROTOCOL;
+                break;
+            }
+            if (flags & FLAG_PADDED)
+                pad = payload[off++];
+            if (flags & FLAG_PRIORITY)
+                off += 5;
+            if (off + pad > len) {
+                err = ERR_PROTOCOL;
+                break;
+            }
+            last_id = block_id = id;
+            block_len = 0;
+            /* fall through */
+        case FRAME_CONTINUATION:
+            if (!block_id) {
+                err = ERR_PROTOCOL;
+                break;
+            }
+            if (block_len + len - off - pad > H2_MAX_BLOCK) {
+                err = ERR_ENHANCE_YOUR_CALM;
+                break;
+            }
+            memcpy(block + block_len, payload + off, len - off - pad);
+            block_len += len - off - pad;
+            if (flags & FLAG_END_HEADERS) {
+                if (open_stream(c, hpack, block_id, block, block_len) < 0)
+                    err = ERR_COMPRESSION;
+                block_id = 0;
+            }
+            break;
+        case FRAME_RST_STREAM:
+            STAT_INC(client_resets);
+            reset_stream(c, id);
+            break;
+        case FRAME_SETTINGS:
+            if (flags & FLAG_ACK)
+                break;
+            if (len % 6)
+                err = ERR_FRAME_SIZE;
+            else if ((err = apply_settings(c, payload, len)) < 0)
+                write_frame(c, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+            break;
+        case FRAME_PING:
+            if (!(flags & FLAG_ACK) && len == 8)
+                write_frame(c, FRAME_PING, FLAG_ACK, 0, payload, 8);
+            break;
+        case FRAME_WINDOW_UPDATE:
+            if (len != 4)
+                break;
+            if (!(get32(payload) & 0x7fffffff) && !id) {
+                err = ERR_PROTOCOL; // A zero increment is an error on the connection or the stream it names.
+            } else if (!(get32(payload) & 0x7fffffff)) {
+                STAT_INC(protocol_errors);
+                send_code(c, FRAME_RST_STREAM, id, 0, ERR_PROTOCOL);
+                reset_stream(c, id);
+            } else {
+                err = grow_window(c, id, get32(payload) & 0x7fffffff);
+            }
+            break;
+        default:
+            break; // PRIORITY, GOAWAY (no new streams will come) and unknown types.
+        }
+    }
+    if (err >= 0) {
+        STAT_INC(protocol_errors);
+        send_code(c, FRAME_GOAWAY, 0, last_id, err);
+    }
+
+    /* Unblock stream threads stuck writing to a client that is gone, and wait for them */
+    shutdown(c->fd, SHUT_RDWR);
+    pthread_mutex_lock(&c->lock);
+    c->closing = 1;
+    pthread_cond_broadcast(&c->cond);
+    while (c->nstreams > 0)
+        pthread_cond_wait(&c->cond, &c->lock);
+    pthread_mutex_unlock(&c->lock);
+
+    hpack_free(hpack);
+    free(hpack);
+    free(payload);
+    free(block);
+    free(c);
+}
+
+/* $begin h2_serve_prior */
+void h2_serve_prior(int fd, rio_t *rio, void *arg) {
+    char rest[sizeof(H2_PREFACE)];
+    size_t line = strlen("PRI * HTTP/2.0\r\n");
+    H2Conn *c;
+
+    if (rio_readnb(rio, rest, strlen(H2_PREFACE) - line) != strlen(H2_PREFACE) - line || memcmp(rest, H2_PREFACE + line, strlen(H2_PREFACE) - line))
+        return;
+    c = new_conn(fd, arg);
+    send_settings(c);
+    serve(c, rio, 0);
+}
+/* $end h2_serve_prior */
+
+/* Decode base64url (the HTTP2-Settings header) into out; returns the length, or -1 */
+static int base64url_decode(char *in, unsigned char *out, size_t size) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    uint32_t acc = 0;
+    int bits = 0;
+    size_t n = 0;
+    char *p;
+
+    for (; *in && *in != '='; in++) {
+        if (!(p = strchr(alphabet, *in)) || !*p)
+            return -1;
+        acc = acc << 6 | (p - alphabet);
+        if ((bits += 6) >= 8) {
+            if (n == size)
+                return -1;
+            out[n++] = acc >> (bits -= 8);
+        }
+    }
+    return n;
+}
+
+/*
+ * absolute_form - Stream 1 of an Upgrade arrives in origin form ("GET
+ *     /path"); outside reverse-proxy mode it is rewritten with its Host
+ *     header into an absolute URI, as the other streams are from their
+ *     :authority. Returns the new length, or len if nothing changed.
+ */
+static size_t absolute_form(char *out, char *request, size_t len) {
+    char *target = strchr(request, ' '), *line, *host = NULL;
+    int host_len = 0, n;
+
+    for (line = strchr(request, '\n'); !origin_form && line && !host; line = strchr(line + 1, '\n'))
+        if (!strncasecmp(line + 1, "Host:", 5)) {
+            host = line + 6 + strspn(line + 6, " \t");
+            host_len = strcspn(host, "\r\n");
+        }
+    if (!host || !target || target[1] != '/') {
+        memcpy(out, request, len);
+        return len;
+    }
+    n = snprintf(out, H2_HEAD_MAX, "%.*s http://%.*s%s", (int)(target - request), request, host_len, host, target + 1);
+    return n < H2_HEAD_MAX ? n : H2_HEAD_MAX;
+}
+
+/* $begin h2_serve_upgrade */
+void h2_serve_upgrade(int fd, rio_t *rio, char *settings, char *request, size_t len, void *arg) {
+    char *reply = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n", preface[sizeof(H2_PREFACE)];
+    unsigned char raw[MAXLINE];
+    H2Conn *c;
+    H2Stream *s;
+    int n;
+
+    if (netio_writen(fd, reply, strlen(reply)) < 0)
+        return;
+    STAT_INC(upgrades);
+    c = new_conn(fd, arg);
+    if ((n = base64url_decode(settings, raw, sizeof(raw))) > 0 && n % 6 == 0)
+        apply_settings(c, raw, n);
+    send_settings(c);
+
+    /* The upgrading request is stream 1, already half-closed by the client */
+    if (rio_readnb(rio, preface, strlen(H2_PREFACE)) == strlen(H2_PREFACE) && !memcmp(preface, H2_PREFACE, strlen(H2_PREFACE)) &&
+        len < H2_HEAD_MAX && (s = calloc(1, sizeof(H2Stream)))) {
+        s->id = 1;
+        if ((s->len = absolute_form(s->request, request, len)) < H2_HEAD_MAX) {
+            start_stream(c, s);
+        } else {
+            s->conn = c;
+            send_status(s, "431");
+            free(s);
+        }
+    } else {
+        set_closing(c);
+    }
+    serve(c, rio, 1);
+}
+/* $end h2_serve_upgrade */
+
+/* $begin h2_stats */
+int h2_stats(char *buf, size_t size) {
+    int len = 0;
+
+    len += snprintf(buf + len, size - len, "h2.connections %lu\nh2.upgrades %lu\nh2.streams %lu\nh2.active_streams %lu\n", STAT_GET(connections),
+                    STAT_GET(upgrades), STAT_GET(streams), STAT_GET(active));
+    len += snprintf(buf + len, size - len, "h2.refused %lu\nh2.client_resets %lu\nh2.window_stalls %lu\nh2.protocol_errors %lu\n", STAT_GET(refused),
+                    STAT_GET(client_resets), STAT_GET(window_stalls), STAT_GET(protocol_errors));
+    return len < size ? len : size - 1;
+}
+/* $end h2_stats */
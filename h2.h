@@ -0,0 +1,50 @@
+/*
+ * h2.h - Cleartext HTTP/2 (h2c) on the client listeners
+ *
+ * An HTTP/1.0 client needs a connection per outstanding request; an h2c
+ * client multiplexes dozens of fetches over one. With -2 the listeners
+ * accept h2c both with prior knowledge (the connection opens with the
+ * HTTP/2 preface) and by Upgrade (an HTTP/1.1 GET or HEAD with
+ * "Upgrade: h2c", answered with 101 and served as stream 1).
+ *
+ * One thread per connection reads frames: it decodes header blocks
+ * (HPACK), answers SETTINGS and PING, and tracks flow-control windows.
+ * Each request stream is mapped onto the ordinary HTTP/1.0 request path:
+ * it is rewritten as an HTTP/1.0 request head and handed to the handler
+ * (doit) on one end of a socketpair, in its own thread, so the cache,
+ * cluster, parents, retries and rate limits all apply unchanged. The
+ * stream thread reads the HTTP/1.0 response from the other end and sends
+ * it back as HEADERS and DATA frames within the client's windows.
+ *
+ * Request bodies are not forwarded (the HTTP/1.0 path does not forward
+ * them either); DATA from the client is acknowledged and dropped.
+ */
+/* $begin h2.h */
+#ifndef __H2_H__
+#define __H2_H__
+
+#include "csapp.h"
+
+#define H2_MAX_STREAMS 100      /* SETTINGS_MAX_CONCURRENT_STREAMS we advertise */
+#define H2_MAX_FRAME 16384      /* Largest frame we accept (the protocol default) */
+#define H2_MAX_BLOCK 65536      /* Largest request header block, across CONTINUATION frames */
+#define H2_HEAD_MAX RIO_BUFSIZE /* Largest rewritten request head (fits the handler's Rio buffer) */
+
+/* Serve one HTTP/1.0 request head on fd, as for a client connection; h2 closes fd afterwards */
+typedef void (*h2_handler_t)(int fd, char *request, size_t len, void *arg);
+
+/* Turn h2c on; origin_form rewrites requests as "GET /path" (reverse proxy) instead of absolute URIs */
+void h2_init(h2_handler_t handler, int origin_form);
+int h2_enabled(void);
+
+/* The connection opened with "PRI * HTTP/2.0\r\n" (already read from rio): serve it as h2c */
+void h2_serve_prior(int fd, rio_t *rio, void *arg);
+
+/* Answer an Upgrade: h2c request with 101 and serve request (an HTTP/1.0 head) as stream 1 */
+void h2_serve_upgrade(int fd, rio_t *rio, char *settings, char *request, size_t len, void *arg);
+
+/* Write a plain-text report of h2c connections and streams into buf */
+int h2_stats(char *buf, size_t size);
+
+#endif /* __H2_H__ */
+/* $end h2.h */
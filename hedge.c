@@ -0,0 +1,225 @@
+/*
+ * hedge.c - Hedged upstream requests for GET misses
+ */
+#include "hedge.h"
+#include "budget.h"
+#include "netio.h"
+#include "stats.h"
+#include "upstream.h"
+#include <poll.h>
+#include <time.h>
+
+typedef struct Replicas {
+    char *origin;                 // "host:port" this entry applies to.
+    char *hosts[MAX_REPLICAS];    // Alternate hostnames...
+    char *ports[MAX_REPLICAS];    // ...and their ports.
+    int count;                    // Number of alternates.
+    unsigned int next;            // Round-robin position.
+    struct Replicas *next_origin; // Pointer to the next origin's entry.
+} Replicas;
+
+static double percentile = 0; // 0 = hedging disabled
+static Replicas *replicas = NULL;
+
+/* Time-to-first-byte history and the delay derived from it */
+static int samples[HEDGE_WINDOW];
+static int nsamples = 0, sample_pos = 0, since_recompute = 0;
+static int hedge_delay_ms = HEDGE_DEFAULT_MS;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static Budget budget;
+static unsigned long requests, hedges, hedge_wins, primary_wins, budget_denied, no_replica, both_failed;
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static int cmp_int(const void *a, const void *b) { return *(const int *)a - *(const int *)b; }
+
+/* $begin hedge_set_percentile */
+int hedge_set_percentile(char *pct) {
+    percentile = atof(pct);
+    if (percentile <= 0 || percentile >= 100) {
+        fprintf(stderr, "hedge: percentile must be between 0 and 100 (got %s)\n", pct);
+        return -1;
+    }
+    budget_init(&budget, HEDGE_BUDGET_RATIO, HEDGE_BUDGET_BURST);
+    return 0;
+}
+/* $end hedge_set_percentile */
+
+/* $begin hedge_add_replicas */
+// parse "host:port=alt1:port1,alt2:port2"
+int hedge_add_replicas(char *spec) {
+    char copy[MAXLINE], *alts, *tok, *save, *colon;
+    Replicas *r;
+
+    snprintf(copy, sizeof(copy), "%s", spec);
+    if (!(alts = strchr(copy, '=')) || !strchr(copy, ':')) {
+        fprintf(stderr, "hedge: bad replica spec %s (expected host:port=host:port,...)\n", spec);
+        return -1;
+    }
+    *alts++ = '\0';
+
+    r = calloc(1, sizeof(Replicas));
+    r->origin = strdup(copy);
+    for (tok = strtok_r(alts, ",", &save); tok && r->count < MAX_REPLICAS; tok = strtok_r(NULL, ",", &save)) {
+        if (!(colon = strrchr(tok, ':'))) {
+            fprintf(stderr, "hedge: replica %s has no port\n", tok);
+            return -1;
+        }
+        *colon = '\0';
+        r->hosts[r->count] = strdup(tok);
+        r->ports[r->count] = strdup(colon + 1);
+        r->count++;
+    }
+    r->next_origin = replicas;
+    replicas = r;
+    return 0;
+}
+/* $end hedge_add_replicas */
+
+/* Add a time-to-first-byte sample; recompute the hedge delay every so often */
+static void record_ttfb(int ms) {
+    int sorted[HEDGE_WINDOW], i;
+
+    pthread_mutex_lock(&lock);
+    samples[sample_pos] = ms;
+    sample_pos = (sample_pos + 1) % HEDGE_WINDOW;
+    if (nsamples < HEDGE_WINDOW)
+        nsamples++;
+    if (nsamples >= HEDGE_MIN_SAMPLES && ++since_recompute >= 32) {
+        since_recompute = 0;
+        for (i = 0; i < nsamples; i++)
+            sorted[i] = samples[i];
+        qsort(sorted, nsamples, sizeof(int), cmp_int);
+        hedge_delay_ms = sorted[(int)(nsamples * percentile / 100.0)];
+        if (hedge_delay_ms < HEDGE_MIN_MS)
+            hedge_delay_ms = HEDGE_MIN_MS;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/* Current hedge delay */
+static int current_delay(void) {
+    pthread_mutex_lock(&lock);
+    int delay = nsamples >= HEDGE_MIN_SAMPLES ? hedge_delay_ms : HEDGE_DEFAULT_MS;
+    pthread_mutex_unlock(&lock);
+    return delay;
+}
+
+/* Open a connection to some replica other than the one primaryfd talks to */
+static int connect_replica(int primaryfd, char *hostname, char *port) {
+    char origin[MAXLINE];
+    Replicas *r;
+    int i, fd;
+
+    snprintf(origin, sizeof(origin), "%s:%s", hostname, port);
+    for (r = replicas; r; r = r->next_origin) {
+        if (strcmp(r->origin, origin))
+            continue;
+        unsigned int start = __atomic_fetch_add(&r->next, 1, __ATOMIC_RELAXED);
+        for (i = 0; i < r->count; i++) {
+            int k = (start + i) % r->count;
+            if ((fd = upstream_connect_other(r->hosts[k], r->ports[k], primaryfd)) >= 0)
+                return fd;
+        }
+    }
+    /* No configured replica answered: try another address of the same name */
+    return upstream_connect_other(hostname, port, primaryfd);
+}
+
+/*
+ * race - Both connections carry the request; return whichever produces
+ *     response bytes first and reset the other. A connection that hits
+ *     EOF or an error drops out of the race.
+ */
+static int race(int primaryfd, int hedgefd) {
+    struct pollfd pfds[2] = {{.fd = primaryfd, .events = POLLIN}, {.fd = hedgefd, .events = POLLIN}};
+    int i, winner = -1;
+
+    while (winner < 0 && (pfds[0].fd >= 0 || pfds[1].fd >= 0)) {
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        for (i = 0; i < 2 && winner < 0; i++) {
+            if (pfds[i].fd < 0 || !pfds[i].revents)
+                continue;
+            if (upstream_wait_response(pfds[i].fd, 0) == 1)
+                winner = i;
+            else
+                pfds[i].fd = -1; /* Failed before sending anything */
+        }
+    }
+
+    if (winner < 0) {
+        STAT_INC(both_failed);
+        upstream_abort(hedgefd);
+        return primaryfd; /* Let the relay report the primary's failure */
+    }
+    if (winner == 0) {
+        STAT_INC(primary_wins);
+        upstream_abort(hedgefd);
+        return primaryfd;
+    }
+    STAT_INC(hedge_wins);
+    upstream_abort(primaryfd);
+    return hedgefd;
+}
+
+/* $begin hedge_wait */
+int hedge_wait(int fd, char *hostname, char *port, char *request, int len) {
+    long long start = now_ms();
+    int hedgefd;
+
+    if (percentile <= 0)
+        return fd;
+    STAT_INC(requests);
+
+    budget_earn(&budget);
+    if (upstream_wait_response(fd, current_delay()) >= 0) {
+        record_ttfb(now_ms() - start);
+        return fd;
+    }
+
+    if (!budget_spend(&budget)) {
+        STAT_INC(budget_denied);
+    } else if ((hedgefd = connect_replica(fd, hostname, port)) < 0) {
+        STAT_INC(no_replica);
+    } else if (netio_writen(hedgefd, request, len) != len) {
+        upstream_abort(hedgefd);
+    } else {
+        STAT_INC(hedges);
+        fd = race(fd, hedgefd);
+        record_ttfb(now_ms() - start);
+        return fd;
+    }
+
+    /* No hedge: keep waiting on the primary, but still learn from its latency */
+    upstream_wait_response(fd, -1);
+    record_ttfb(now_ms() - start);
+    return fd;
+}
+/* $end hedge_wait */
+
+/* $begin hedge_stats */
+int hedge_stats(char *buf, size_t size) {
+    int len = 0;
+
+    len += snprintf(buf + len, size - len, "hedge.percentile %.1f\n", percentile);
+    if (percentile <= 0)
+        return len;
+
+    len += snprintf(buf + len, size - len, "hedge.delay_ms %d\nhedge.samples %d\nhedge.budget %.2f\n", current_delay(), nsamples,
+                    budget_level(&budget));
+    len += snprintf(buf + len, size - len, "hedge.requests %lu\nhedge.hedges %lu\nhedge.hedge_wins %lu\nhedge.primary_wins %lu\n",
+                    STAT_GET(requests), STAT_GET(hedges), STAT_GET(hedge_wins), STAT_GET(primary_wins));
+    len += snprintf(buf + len, size - len, "hedge.budget_denied %lu\nhedge.no_replica %lu\nhedge.both_failed %lu\n", STAT_GET(budget_denied),
+                    STAT_GET(no_replica), STAT_GET(both_failed));
+    return len < size ? len : size - 1;
+}
+/* $end hedge_stats */
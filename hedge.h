@@ -0,0 +1,40 @@
+/*
+ * hedge.h - Hedged upstream requests for GET misses
+ *
+ * One slow origin response sets the p99 for everyone. When hedging is on,
+ * doit() hands the primary upstream connection to hedge_wait() right after
+ * sending the request. If no response bytes arrive within the configured
+ * percentile of recent time-to-first-byte, the same request goes to a
+ * replica (a configured alternate, or another address of the same name).
+ * Whichever connection answers first is relayed; the other is reset.
+ *
+ * Hedges are paid for from a global token bucket that earns
+ * HEDGE_BUDGET_RATIO hedges per request, so a slow origin under load
+ * costs at most that much extra traffic instead of doubling it.
+ */
+/* $begin hedge.h */
+#ifndef __HEDGE_H__
+#define __HEDGE_H__
+
+#include "csapp.h"
+
+#define HEDGE_WINDOW 512        /* Recent time-to-first-byte samples kept */
+#define HEDGE_MIN_SAMPLES 20    /* Use HEDGE_DEFAULT_MS until we have this many */
+#define HEDGE_DEFAULT_MS 100    /* Hedge delay before there is any history */
+#define HEDGE_MIN_MS 5          /* Never hedge sooner than this */
+#define HEDGE_BUDGET_RATIO 0.05 /* Hedges earned per request */
+#define HEDGE_BUDGET_BURST 10.0 /* Most unspent hedges that can pile up */
+#define MAX_REPLICAS 8          /* Alternates per origin */
+
+/* Configuration: hedge at this percentile of TTFB, and alternates for an origin */
+int hedge_set_percentile(char *pct);
+int hedge_add_replicas(char *spec);
+
+/* Wait for the response on fd, hedging if it is late; returns the fd to relay from */
+int hedge_wait(int fd, char *hostname, char *port, char *request, int len);
+
+/* Write a plain-text report of hedging counters into buf */
+int hedge_stats(char *buf, size_t size);
+
+#endif /* __HEDGE_H__ */
+/* $end hedge.h */
@@ -0,0 +1,388 @@
+/*
+ * hpack.c - HTTP/2 header compression (RFC 7541) for the h2c listener
+ */
+#include "hpack.h"
+
+/* RFC 7541 Appendix B: the Huffman code of each byte (EOS is never decoded) */
+static const uint32_t huffman_codes[256] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+    0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+    0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+    0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+    0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+    0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+    0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+    0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+    0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+    0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+    0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+    0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+    0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+    0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+    0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+    0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+    0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+};
+
+static const uint8_t huffman_lengths[256] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+};
+
+static const char *static_table[HPACK_STATIC_ENTRIES + 1][2] = {
+    {NULL, NULL},
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+/*
+ * The Huffman decoder walks a binary tree built from the codes once.
+ * tree[n][bit] is the next node, ~sym for a leaf, or 0 where no code
+ * continues (the root is never a child, so 0 is free to mean that).
+ */
+static int16_t tree[256][2];
+static pthread_once_t tree_once = PTHREAD_ONCE_INIT;
+
+static void build_tree(void) {
+    int sym, bit, node, next = 1;
+
+    for (sym = 0; sym < 256; sym++) {
+        for (node = 0, bit = huffman_lengths[sym] - 1; bit > 0; bit--) {
+            int b = (huffman_codes[sym] >> bit) & 1;
+            if (!tree[node][b])
+                tree[node][b] = next++;
+            node = tree[node][b];
+        }
+        tree[node][huffman_codes[sym] & 1] = ~sym;
+    }
+}
+
+/* Decode len Huffman-coded bytes into a malloc'd string; NULL if the coding is invalid */
+static char *huffman_decode(unsigned char *in, size_t len) {
+    char *out = malloc(len * 8 / 5 + 1), *p = out; // The shortest code is 5 bits.
+    int node = 0, pad = 0, ones = 1, bit;
+    size_t i;
+
+    pthread_once(&tree_once, build_tree);
+    for (i = 0; i < len && out; i++) {
+        for (bit = 7; bit >= 0; bit--) {
+            int b = (in[i] >> bit) & 1, next = tree[node][b];
+            if (next == 0) {
+                free(out);
+                return NULL;
+            }
+            pad++;
+            ones &= b;
+            if (next < 0) {
+                *p++ = ~next ? ~next : '\r'; // See decode_string.
+                node = pad = 0;
+                ones = 1;
+            } else {
+                node = next;
+            }
+        }
+    }
+    if (out && (pad > 7 || !ones)) { // Padding is the most significant bits of EOS: up to 7 ones.
+        free(out);
+        return NULL;
+    }
+    if (out)
+        *p = '\0';
+    return out;
+}
+
+/* Decode an integer with an n-bit prefix; -1 if truncated or absurdly large */
+static int decode_int(unsigned char **p, unsigned char *end, int n, uint32_t *value) {
+    uint32_t max = (1 << n) - 1, shift = 0;
+
+    if (*p >= end)
+        return -1;
+    *value = *(*p)++ & max;
+    if (*value < max)
+        return 0;
+    while (*p < end && shift <= 21) {
+        unsigned char b = *(*p)++;
+        *value += (uint32_t)(b & 0x7f) << shift;
+        shift += 7;
+        if (!(b & 0x80))
+            return 0;
+    }
+    return -1;
+}
+
+/*
+ * decode_string - Decode a string literal (maybe Huffman-coded) into a
+ *     malloc'd string. A NUL, which a C string cannot carry, comes out as
+ *     CR: fields holding either are malformed and refused the same way.
+ */
+static char *decode_string(unsigned char **p, unsigned char *end) {
+    int huffman;
+    uint32_t len, i;
+    char *s;
+
+    if (*p >= end)
+        return NULL;
+    huffman = **p & 0x80;
+    if (decode_int(p, end, 7, &len) < 0 || len > (size_t)(end - *p))
+        return NULL;
+    if (huffman) {
+        s = huffman_decode(*p, len);
+    } else if ((s = malloc(len + 1))) {
+        memcpy(s, *p, len);
+        s[len] = '\0';
+        for (i = 0; i < len; i++)
+            if (s[i] == '\0')
+                s[i] = '\r';
+    }
+    *p += len;
+    return s;
+}
+
+void hpack_init(Hpack *h) {
+    memset(h, 0, sizeof(Hpack));
+    h->max_size = HPACK_TABLE_SIZE;
+}
+
+static void evict(Hpack *h) {
+    HpackField *f = &h->table[(h->head + h->count - 1) % HPACK_TABLE_ENTRIES];
+
+    h->size -= strlen(f->name) + strlen(f->value) + 32;
+    free(f->name);
+    free(f->value);
+    h->count--;
+}
+
+void hpack_free(Hpack *h) {
+    while (h->count > 0)
+        evict(h);
+}
+
+/* Add a field to the dynamic table, evicting the oldest to make room (a field larger than the table just empties it) */
+static void insert(Hpack *h, char *name, char *value) {
+    size_t size = strlen(name) + strlen(value) + 32;
+
+    while (h->count > 0 && h->size + size > h->max_size)
+        evict(h);
+    if (size > h->max_size)
+        return;
+    h->head = (h->head + HPACK_TABLE_ENTRIES - 1) % HPACK_TABLE_ENTRIES;
+    h->table[h->head].name = strdup(name);
+    h->table[h->head].value = strdup(value);
+    h->size += size;
+    h->count++;
+}
+
+/* Look up index (1-based, static entries first); 0 if out of range */
+static int lookup(Hpack *h, uint32_t index, char **name, char **value) {
+    if (index >= 1 && index <= HPACK_STATIC_ENTRIES) {
+        *name = (char *)static_table[index][0];
+        *value = (char *)static_table[index][1];
+        return 1;
+    }
+    index -= HPACK_STATIC_ENTRIES + 1;
+    if (index >= (uint32_t)h->count)
+        return 0;
+    *name = h->table[(h->head + index) % HPACK_TABLE_ENTRIES].name;
+    *value = h->table[(h->head + index) % HPACK_TABLE_ENTRIES].value;
+    return 1;
+}
+
+/*
+ * hpack_decode - Representations by their leading bits:
+ *     1xxxxxxx indexed field, 01xxxxxx literal added to the table,
+ *     001xxxxx table size update, 0000xxxx / 0001xxxx literal not added.
+ */
+/* $begin hpack_decode */
+int hpack_decode(Hpack *h, unsigned char *block, size_t len, HpackField *fields, int max) {
+    unsigned char *p = block, *end = block + len;
+    uint32_t index;
+    char *name, *value;
+    int n = 0;
+
+    while (p < end) {
+        if (*p & 0x80) {
+            if (decode_int(&p, end, 7, &index) < 0 || !lookup(h, index, &name, &value))
+                goto fail;
+            name = strdup(name);
+            value = strdup(value);
+        } else if ((*p & 0xe0) == 0x20) {
+            if (decode_int(&p, end, 5, &index) < 0 || index > HPACK_TABLE_SIZE)
+                goto fail;
+            h->max_size = index;
+            while (h->count > 0 && h->size > h->max_size)
+                evict(h);
+            continue;
+        } else {
+            int indexing = (*p & 0xc0) == 0x40;
+            if (decode_int(&p, end, indexing ? 6 : 4, &index) < 0)
+                goto fail;
+            if (index) {
+                if (!lookup(h, index, &name, &value))
+                    goto fail;
+                name = strdup(name);
+            } else if (!(name = decode_string(&p, end))) {
+                goto fail;
+            }
+            if (!(value = decode_string(&p, end))) {
+                free(name);
+                goto fail;
+            }
+            if (indexing)
+                insert(h, name, value);
+        }
+        if (n == max) {
+            free(name);
+            free(value);
+            goto fail;
+        }
+        fields[n].name = name;
+        fields[n++].value = value;
+    }
+    return n;
+
+fail:
+    hpack_free_fields(fields, n);
+    return -1;
+}
+/* $end hpack_decode */
+
+void hpack_free_fields(HpackField *fields, int n) {
+    while (n-- > 0) {
+        free(fields[n].name);
+        free(fields[n].value);
+    }
+}
+
+/* Encode an integer with an n-bit prefix after the pattern bits in first */
+static size_t encode_int(unsigned char *out, size_t size, unsigned char first, int n, size_t value) {
+    size_t max = (1 << n) - 1, len = 1;
+
+    if (size < 1)
+        return 0;
+    if (value < max) {
+        out[0] = first | value;
+        return 1;
+    }
+    out[0] = first | max;
+    for (value -= max; len < size; value >>= 7) {
+        out[len++] = (value & 0x7f) | (value >= 0x80 ? 0x80 : 0);
+        if (value < 0x80)
+            return len;
+    }
+    return 0;
+}
+
+static size_t encode_string(unsigned char *out, size_t size, char *s, int lower) {
+    size_t len = strlen(s), n = encode_int(out, size, 0, 7, len), i;
+
+    if (!n || n + len > size)
+        return 0;
+    for (i = 0; i < len; i++)
+        out[n + i] = lower ? tolower((unsigned char)s[i]) : s[i];
+    return n + len;
+}
+
+/* $begin hpack_encode */
+size_t hpack_encode(unsigned char *out, size_t size, char *name, char *value) {
+    size_t n, m, k;
+
+    /* Literal without indexing; :status uses the static table's name */
+    if (!strcmp(name, ":status"))
+        n = encode_int(out, size, 0, 4, 8);
+    else if ((n = encode_int(out, size, 0, 4, 0)) && (k = encode_string(out + n, size - n, name, 1)))
+        n += k;
+    else
+        return 0;
+    if (!n || !(m = encode_string(out + n, size - n, value, 0)))
+        return 0;
+    return n + m;
+}
+/* $end hpack_encode */
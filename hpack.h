@@ -0,0 +1,47 @@
+/*
+ * hpack.h - HTTP/2 header compression (RFC 7541) for the h2c listener
+ *
+ * Request headers arrive HPACK-encoded: indexes into the static table or
+ * into a per-connection dynamic table of recent fields, literals, and
+ * Huffman-coded strings. The decoder keeps the dynamic table at the
+ * default 4096 bytes, which is what the listener advertises.
+ *
+ * Responses are encoded without touching the dynamic table (literal
+ * fields "without indexing", plain strings). That costs a few bytes per
+ * response but leaves no encoder state to keep in step with the client.
+ */
+/* $begin hpack.h */
+#ifndef __HPACK_H__
+#define __HPACK_H__
+
+#include "csapp.h"
+#include <stdint.h>
+
+#define HPACK_STATIC_ENTRIES 61
+#define HPACK_TABLE_SIZE 4096                    /* SETTINGS_HEADER_TABLE_SIZE (the default) */
+#define HPACK_TABLE_ENTRIES (HPACK_TABLE_SIZE / 32) /* Every entry costs at least 32 bytes */
+
+typedef struct HpackField {
+    char *name;  // malloc'd, NUL-terminated.
+    char *value;
+} HpackField;
+
+typedef struct Hpack {
+    HpackField table[HPACK_TABLE_ENTRIES]; // Dynamic table as a ring, newest at head.
+    int head, count;
+    size_t size;                           // Sum of entry sizes (name + value + 32).
+    size_t max_size;                       // Current limit, set by size updates.
+} Hpack;
+
+void hpack_init(Hpack *h);
+void hpack_free(Hpack *h);
+
+/* Decode a header block into at most max fields (free them with hpack_free_fields); -1 on a compression error */
+int hpack_decode(Hpack *h, unsigned char *block, size_t len, HpackField *fields, int max);
+void hpack_free_fields(HpackField *fields, int n);
+
+/* Append one field to out (name lowercase); returns the bytes written, 0 if it does not fit */
+size_t hpack_encode(unsigned char *out, size_t size, char *name, char *value);
+
+#endif /* __HPACK_H__ */
+/* $end hpack.h */
@@ -0,0 +1,207 @@
+/*
+ * iobuf.c - Reference-counted buffer chains for responses
+ */
+#include "iobuf.h"
+#include "stats.h"
+
+static IoBuf *pool = NULL;
+static int npool = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER; // Protects pool.
+
+static unsigned long chains, bufs_malloced, bufs_reused, bufs_freed, bufs_in_use, linearized;
+
+static IoBuf *take_buf(void) {
+    IoBuf *b;
+
+    pthread_mutex_lock(&lock);
+    if ((b = pool)) {
+        pool = b->next;
+        npool--;
+    }
+    pthread_mutex_unlock(&lock);
+    if (b)
+        STAT_INC(bufs_reused);
+    else if ((b = malloc(sizeof(IoBuf))))
+        STAT_INC(bufs_malloced);
+    else
+        return NULL;
+    STAT_INC(bufs_in_use);
+    b->next = NULL;
+    b->len = 0;
+    return b;
+}
+
+/* Give back a list of buffers: to the pool while it has room, else to malloc */
+static void give_bufs(IoBuf *b) {
+    IoBuf *next;
+
+    for (; b; b = next) {
+        next = b->next;
+        STAT_SUB(bufs_in_use, 1);
+        pthread_mutex_lock(&lock);
+        if (npool < IOBUF_KEEP) {
+            b->next = pool;
+            pool = b;
+            npool++;
+            b = NULL;
+        }
+        pthread_mutex_unlock(&lock);
+        if (b) {
+            free(b);
+            STAT_INC(bufs_freed);
+        }
+    }
+}
+
+/* $begin iochain_new */
+IoChain *iochain_new(void) {
+    IoChain *c = calloc(1, sizeof(IoChain));
+
+    if (c) {
+        c->refs = 1;
+        STAT_INC(chains);
+    }
+    return c;
+}
+/* $end iochain_new */
+
+void iochain_hold(IoChain *c) { __atomic_fetch_add(&c->refs, 1, __ATOMIC_RELAXED); }
+
+/* $begin iochain_release */
+void iochain_release(IoChain *c) {
+    if (__atomic_sub_fetch(&c->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    give_bufs(c->head);
+    free(c);
+}
+/* $end iochain_release */
+
+/* $begin iochain_reserve */
+int iochain_reserve(IoChain *c, size_t n, struct iovec *iov, int max) {
+    IoBuf *b = c->tail && c->tail->len < IOBUF_SIZE ? c->tail : c->tail ? c->tail->next : c->head;
+    IoBuf *prev = c->tail;
+    int cnt = 0;
+
+    while (n > 0 && cnt < max) {
+        if (!b) {
+            if (!(b = take_buf()))
+                break;
+            if (prev)
+                prev->next = b;
+            else
+                c->head = b;
+        }
+        iov[cnt].iov_base = b->data + b->len;
+        iov[cnt].iov_len = IOBUF_SIZE - b->len < n ? IOBUF_SIZE - b->len : n;
+        n -= iov[cnt++].iov_len;
+        prev = b;
+        b = b->next;
+    }
+    return cnt;
+}
+/* $end iochain_reserve */
+
+/* $begin iochain_commit */
+int iochain_commit(IoChain *c, size_t n, struct iovec *iov, int iovcnt) {
+    IoBuf *b = c->tail && c->tail->len < IOBUF_SIZE ? c->tail : c->tail ? c->tail->next : c->head;
+    size_t take;
+    int cnt = 0;
+
+    c->len += n;
+    while (n > 0 && cnt < iovcnt) { // The reserved buffers, in order.
+        take = iov[cnt].iov_len < n ? iov[cnt].iov_len : n;
+        iov[cnt++].iov_len = take;
+        if (b->len == 0)
+            c->nbufs++;
+        b->len += take;
+        c->tail = b;
+        n -= take;
+        b = b->next;
+    }
+    return cnt;
+}
+/* $end iochain_commit */
+
+/* $begin iochain_append */
+int iochain_append(IoChain *c, void *data, size_t n) {
+    struct iovec iov[8];
+    char *p = data;
+    int i, cnt;
+
+    while (n > 0) {
+        if ((cnt = iochain_reserve(c, n, iov, 8)) == 0)
+            return -1;
+        size_t got = 0;
+        for (i = 0; i < cnt; i++) {
+            memcpy(iov[i].iov_base, p + got, iov[i].iov_len);
+            got += iov[i].iov_len;
+        }
+        iochain_commit(c, got, iov, cnt);
+        p += got;
+        n -= got;
+    }
+    return 0;
+}
+/* $end iochain_append */
+
+/* $begin iochain_clear */
+void iochain_clear(IoChain *c) {
+    IoBuf *b;
+
+    for (b = c->head; b; b = b->next)
+        b->len = 0;
+    c->tail = NULL;
+    c->len = 0;
+    c->nbufs = 0;
+}
+/* $end iochain_clear */
+
+/* $begin iochain_trim */
+void iochain_trim(IoChain *c) {
+    IoBuf **spare = c->tail ? &c->tail->next : &c->head;
+
+    give_bufs(*spare);
+    *spare = NULL;
+}
+/* $end iochain_trim */
+
+/* $begin iochain_iov */
+int iochain_iov(IoChain *c, struct iovec *iov, int max) {
+    IoBuf *b;
+    int cnt = 0;
+
+    for (b = c->head; b && b->len > 0 && cnt < max; b = b->next) {
+        iov[cnt].iov_base = b->data;
+        iov[cnt++].iov_len = b->len;
+    }
+    return cnt;
+}
+/* $end iochain_iov */
+
+/* $begin iochain_linearize */
+char *iochain_linearize(IoChain *c) {
+    char *out = malloc(c->len ? c->len : 1), *p = out;
+    IoBuf *b;
+
+    if (!out)
+        return NULL;
+    for (b = c->head; b && b->len > 0; b = b->next) {
+        memcpy(p, b->data, b->len);
+        p += b->len;
+    }
+    STAT_INC(linearized);
+    return out;
+}
+/* $end iochain_linearize */
+
+/* $begin iobuf_stats */
+int iobuf_stats(char *buf, size_t size) {
+    int len = 0;
+
+    len += snprintf(buf + len, size - len, "iobuf.chains %lu\niobuf.bufs_in_use %lu\niobuf.bufs_idle %d\n", STAT_GET(chains),
+                    STAT_GET(bufs_in_use), npool);
+    len += snprintf(buf + len, size - len, "iobuf.bufs_malloced %lu\niobuf.bufs_reused %lu\niobuf.bufs_freed %lu\niobuf.linearized %lu\n",
+                    STAT_GET(bufs_malloced), STAT_GET(bufs_reused), STAT_GET(bufs_freed), STAT_GET(linearized));
+    return len < size ? len : size - 1;
+}
+/* $end iobuf_stats */
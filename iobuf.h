@@ -0,0 +1,74 @@
+/*
+ * iobuf.h - Reference-counted buffer chains for responses
+ *
+ * A cached response used to be copied three times on its way in: read
+ * into a relay buffer, copied into a capture buffer, and copied again by
+ * cache_add. Now upstream reads land directly in pooled IoBufs linked into
+ * an IoChain. The client is written from those buffers, and the cache
+ * adopts the same chain, so each byte is copied once, by the kernel into
+ * the IoBuf (or not at all when the response is spliced).
+ *
+ * A chain is reference counted: the cache holds one reference while the
+ * object is linked, and each hit holds another while it sends, so a purge
+ * or eviction only drops the cache's reference. Chain contents do not
+ * change once the chain is shared. Hits are sent with one gathered write
+ * over the chain's buffers.
+ */
+/* $begin iobuf.h */
+#ifndef __IOBUF_H__
+#define __IOBUF_H__
+
+#include "csapp.h"
+
+#define IOBUF_SIZE 16384 /* Bytes per buffer (an SSL record fits in one) */
+#define IOBUF_KEEP 256   /* Idle buffers kept for reuse */
+
+typedef struct IoBuf {
+    struct IoBuf *next;
+    size_t len;             // Bytes used in data.
+    char data[IOBUF_SIZE];
+} IoBuf;
+
+typedef struct IoChain {
+    IoBuf *head, *tail;     // tail is the last buffer holding data (spare buffers may follow it).
+    size_t len;             // Bytes in the chain.
+    int nbufs;              // Buffers holding data.
+    int refs;
+} IoChain;
+
+/* An empty chain with one reference; NULL if out of memory */
+IoChain *iochain_new(void);
+
+/* Take another reference; drop one (the last gives the buffers back) */
+void iochain_hold(IoChain *c);
+void iochain_release(IoChain *c);
+
+/*
+ * Room for the next n bytes: up to max iovecs over the free space at the
+ * end of the chain, adding pooled buffers as needed. Returns the count.
+ * iochain_commit then appends the n bytes a read put there, trims iov to
+ * exactly them (to pass on), and returns that count.
+ */
+int iochain_reserve(IoChain *c, size_t n, struct iovec *iov, int max);
+int iochain_commit(IoChain *c, size_t n, struct iovec *iov, int iovcnt);
+
+/* Append a copy of n bytes; 0, or -1 if out of memory */
+int iochain_append(IoChain *c, void *data, size_t n);
+
+/* Forget the contents but keep the buffers, to read into again */
+void iochain_clear(IoChain *c);
+
+/* Give back the spare buffers past the data, before the chain is kept */
+void iochain_trim(IoChain *c);
+
+/* iovecs over the chain's data (at most max); returns the count */
+int iochain_iov(IoChain *c, struct iovec *iov, int max);
+
+/* Copy the contents into one malloc'd buffer; NULL if out of memory */
+char *iochain_linearize(IoChain *c);
+
+/* Write a plain-text report of buffer pool use into buf */
+int iobuf_stats(char *buf, size_t size);
+
+#endif /* __IOBUF_H__ */
+/* $end iobuf.h */
@@ -0,0 +1,262 @@
+/*
+ * listener.c - Accepting client connections without dying under load
+ */
+#include "listener.h"
+#include "affinity.h"
+#include "stats.h"
+#include <linux/filter.h>
+#include <sys/resource.h>
+
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU 49
+#endif
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+
+static int reserve_fd = -1;
+static pthread_mutex_t reserve_lock = PTHREAD_MUTEX_INITIALIZER;
+static int exhausted = 0; // Set while accept() is failing with EMFILE/ENFILE; every acceptor flips it, atomically.
+
+static rlim_t fd_limit_initial, fd_limit;
+static unsigned long accepts, accept_transient, accept_emfile, accept_enfile, accept_nomem;
+static unsigned long accept_shed, accept_backoff_ms;
+
+static int steered_listeners = 0; // 0 unless CPU steering is on.
+static unsigned long conn_cpu_local, conn_cpu_cross, conn_cpu_unknown;
+
+/* $begin listener_init */
+void listener_init(void) {
+    struct rlimit rl;
+
+    /* Raise the soft descriptor limit as far as the hard limit allows */
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        fd_limit_initial = rl.rlim_cur;
+        if (rl.rlim_cur < rl.rlim_max) {
+            rl.rlim_cur = rl.rlim_max;
+            if (setrlimit(RLIMIT_NOFILE, &rl) < 0)
+                fprintf(stderr, "listener: setrlimit(RLIMIT_NOFILE) failed: %s\n", strerror(errno));
+            getrlimit(RLIMIT_NOFILE, &rl);
+        }
+        fd_limit = rl.rlim_cur;
+        printf("File descriptor limit %lu (was %lu)\n", (unsigned long)fd_limit, (unsigned long)fd_limit_initial);
+    }
+
+    /* Keep one descriptor in hand so we can still accept-and-shed when out of fds */
+    if ((reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0)
+        fprintf(stderr, "listener: cannot open reserve descriptor: %s\n", strerror(errno));
+}
+/* $end listener_init */
+
+/*
+ * shed_one - Out of descriptors: free the reserve, accept the connection at
+ *     the head of the backlog, tell the client to come back later, and take
+ *     the reserve back. Better than leaving the client to time out.
+ */
+static void shed_one(int listenfd) {
+    static char *response = "HTTP/1.0 503 Service Unavailable\r\n"
+                            "Content-type: text/plain\r\n"
+                            "Content-length: 21\r\n"
+                            "Retry-After: 1\r\n\r\n"
+                            "Proxy is overloaded.\n";
+    int fd;
+
+    pthread_mutex_lock(&reserve_lock);
+    if (reserve_fd >= 0) {
+        close(reserve_fd);
+        if ((fd = accept(listenfd, NULL, NULL)) >= 0) {
+            send(fd, response, strlen(response), MSG_DONTWAIT | MSG_NOSIGNAL);
+            close(fd);
+            STAT_INC(accept_shed);
+        }
+        __atomic_store_n(&reserve_fd, open("/dev/null", O_RDONLY | O_CLOEXEC), __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&reserve_lock);
+}
+
+/*
+ * listener_accept - Accept a connection on listenfd. Transient errors
+ *     (the peer gave up, a signal) are retried at once; resource errors
+ *     are retried with exponential backoff. Only errors that mean the
+ *     listening socket itself is broken are fatal.
+ */
+/* $begin listener_accept */
+int listener_accept(int listenfd, SA *addr, socklen_t *addrlen) {
+    socklen_t len = *addrlen;
+    int fd, backoff_ms = 0;
+
+    while (1) {
+        *addrlen = len;
+        if ((fd = accept(listenfd, addr, addrlen)) >= 0) {
+            STAT_INC(accepts);
+            /* Only the acceptor that clears the flag reports the recovery (a plain load first keeps the line shared) */
+            if (__atomic_load_n(&exhausted, __ATOMIC_RELAXED) && __atomic_exchange_n(&exhausted, 0, __ATOMIC_RELAXED))
+                fprintf(stderr, "listener: descriptors available again (%lu connections shed so far)\n", STAT_GET(accept_shed));
+            if (__atomic_load_n(&reserve_fd, __ATOMIC_RELAXED) < 0) {
+                pthread_mutex_lock(&reserve_lock);
+                if (reserve_fd < 0)
+                    __atomic_store_n(&reserve_fd, open("/dev/null", O_RDONLY | O_CLOEXEC), __ATOMIC_RELAXED);
+                pthread_mutex_unlock(&reserve_lock);
+            }
+            return fd;
+        }
+
+        switch (errno) {
+        case EINTR:
+        case ECONNABORTED: /* Peer reset before we got to it */
+        case EPROTO:
+        case EPERM: /* Firewall rules */
+            STAT_INC(accept_transient);
+            continue;
+        case EMFILE:
+        case ENFILE:
+            if (errno == EMFILE)
+                STAT_INC(accept_emfile);
+            else
+                STAT_INC(accept_enfile);
+            if (!__atomic_exchange_n(&exhausted, 1, __ATOMIC_RELAXED)) {
+                fprintf(stderr, "listener: out of file descriptors (%s), shedding connections\n", errno == EMFILE ? "EMFILE" : "ENFILE");
+            }
+            shed_one(listenfd);
+            break;
+        case ENOBUFS:
+        case ENOMEM:
+            STAT_INC(accept_nomem);
+            break;
+        default:
+            unix_error("Accept error");
+        }
+
+        /* Resources are exhausted: give in-flight transactions time to finish */
+        backoff_ms = backoff_ms ? backoff_ms * 2 : ACCEPT_BACKOFF_MIN_MS;
+        if (backoff_ms > ACCEPT_BACKOFF_MAX_MS)
+            backoff_ms = ACCEPT_BACKOFF_MAX_MS;
+        STAT_ADD(accept_backoff_ms, backoff_ms);
+        usleep(backoff_ms * 1000);
+    }
+}
+/* $end listener_accept */
+
+/*
+ * open_reuseport_listenfd - Like open_listenfd(), but sets SO_REUSEPORT so
+ *     that several sockets can bind the same port and form one group.
+ */
+static int open_reuseport_listenfd(char *port) {
+    struct addrinfo hints, *listp, *p;
+    int listenfd, rc, optval = 1;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+    if ((rc = getaddrinfo(NULL, port, &hints, &listp)) != 0) {
+        fprintf(stderr, "getaddrinfo failed (port %s): %s\n", port, gai_strerror(rc));
+        return -2;
+    }
+
+    for (p = listp; p; p = p->ai_next) {
+        if ((listenfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+            continue;
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(int));
+        if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
+            break;
+        close(listenfd);
+    }
+
+    freeaddrinfo(listp);
+    if (!p)
+        return -1;
+    if (listen(listenfd, LISTENQ) < 0) {
+        close(listenfd);
+        return -1;
+    }
+    return listenfd;
+}
+
+/*
+ * listener_open_steered - Open one listener per online CPU, in CPU order,
+ *     and attach a BPF program to the group that returns the current CPU.
+ *     The kernel runs it on the CPU handling the SYN, and the value picks
+ *     the socket at that index in the group, i.e. the one whose acceptor
+ *     thread is pinned to the same CPU.
+ */
+/* $begin listener_open_steered */
+int listener_open_steered(char *port, int *listenfds, int max) {
+    int i, n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (n > max)
+        n = max;
+    if (n < 1)
+        n = 1;
+
+    struct sock_filter code[] = {
+        {BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU}, /* A = current CPU */
+        {BPF_ALU | BPF_MOD | BPF_K, 0, 0, n},                      /* A %= number of listeners */
+        {BPF_RET | BPF_A, 0, 0, 0},                                /* return A */
+    };
+    struct sock_fprog prog = {.len = sizeof(code) / sizeof(code[0]), .filter = code};
+
+    for (i = 0; i < n; i++) {
+        if ((listenfds[i] = open_reuseport_listenfd(port)) < 0)
+            unix_error("Open_listenfd (SO_REUSEPORT) error");
+    }
+    if (setsockopt(listenfds[0], SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0)
+        fprintf(stderr, "listener: SO_ATTACH_REUSEPORT_CBPF failed (%s), falling back to hashing\n", strerror(errno));
+
+    steered_listeners = n;
+    printf("CPU steering: %d listeners on port %s\n", n, port);
+    return n;
+}
+/* $end listener_open_steered */
+
+/* $begin listener_pin_cpu */
+int listener_pin_cpu(int cpu) {
+    int rc;
+
+    if ((rc = affinity_pin(cpu)) != 0) {
+        fprintf(stderr, "listener: cannot pin to CPU %d: %s\n", cpu, strerror(rc));
+        return -1;
+    }
+    return 0;
+}
+/* $end listener_pin_cpu */
+
+/*
+ * listener_note_cpu - Called by the thread that handles connfd. Compares
+ *     the CPU that processed the connection's packets (SO_INCOMING_CPU)
+ *     with the CPU we are running on. Counted with or without steering,
+ *     so the two modes can be compared from /proxy-stats.
+ */
+/* $begin listener_note_cpu */
+void listener_note_cpu(int connfd) {
+    int incoming, current = affinity_current_cpu();
+    socklen_t len = sizeof(incoming);
+
+    if (current < 0 || getsockopt(connfd, SOL_SOCKET, SO_INCOMING_CPU, &incoming, &len) < 0 || incoming < 0)
+        STAT_INC(conn_cpu_unknown);
+    else if (incoming == current)
+        STAT_INC(conn_cpu_local);
+    else
+        STAT_INC(conn_cpu_cross);
+}
+/* $end listener_note_cpu */
+
+/* $begin listener_stats */
+int listener_stats(char *buf, size_t size) {
+    int len = 0;
+
+    len += snprintf(buf + len, size - len, "listener.fd_limit %lu\nlistener.fd_limit_initial %lu\nlistener.reserve_fd %s\n",
+                    (unsigned long)fd_limit, (unsigned long)fd_limit_initial, reserve_fd >= 0 ? "held" : "missing");
+    len += snprintf(buf + len, size - len, "listener.accepts %lu\nlistener.accept_transient_errors %lu\n", STAT_GET(accepts),
+                    STAT_GET(accept_transient));
+    len += snprintf(buf + len, size - len, "listener.emfile %lu\nlistener.enfile %lu\nlistener.nomem %lu\n", STAT_GET(accept_emfile),
+                    STAT_GET(accept_enfile), STAT_GET(accept_nomem));
+    len += snprintf(buf + len, size - len, "listener.shed %lu\nlistener.backoff_ms %lu\n", STAT_GET(accept_shed),
+                    STAT_GET(accept_backoff_ms));
+    len += snprintf(buf + len, size - len, "listener.cpu_steering %s\nlistener.steered_listeners %d\n", steered_listeners ? "on" : "off",
+                    steered_listeners);
+    len += snprintf(buf + len, size - len, "listener.conn_cpu_local %lu\nlistener.conn_cpu_cross %lu\nlistener.conn_cpu_unknown %lu\n",
+                    STAT_GET(conn_cpu_local), STAT_GET(conn_cpu_cross), STAT_GET(conn_cpu_unknown));
+    return len < size ? len : size - 1;
+}
+/* $end listener_stats */
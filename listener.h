@@ -0,0 +1,49 @@
+/*
+ * listener.h - Accepting client connections without dying under load
+ *
+ * csapp's Accept() calls unix_error() and exits as soon as accept() fails,
+ * so running out of file descriptors under a connection burst takes the
+ * whole proxy (and its cache) down. listener_accept() instead:
+ *   - classifies accept() errors into transient, resource and fatal ones
+ *   - on EMFILE/ENFILE, gives up a reserved descriptor to accept and shed
+ *     the pending connection with a 503 instead of leaving it hanging
+ *   - backs off exponentially while resources stay exhausted
+ *
+ * With CPU steering, one SO_REUSEPORT listener is opened per CPU and a
+ * classic BPF program picks the listener by the CPU that is processing the
+ * incoming SYN. Each listener's acceptor thread is pinned to that CPU, so
+ * softirq and proxy work for a connection stay on one core.
+ */
+/* $begin listener.h */
+#ifndef __LISTENER_H__
+#define __LISTENER_H__
+
+#include "csapp.h"
+
+/* Backoff while accept() keeps failing for lack of resources */
+#define ACCEPT_BACKOFF_MIN_MS 1
+#define ACCEPT_BACKOFF_MAX_MS 256
+
+/* Upper bound on per-CPU listeners */
+#define MAX_LISTENERS 256
+
+/* Raise RLIMIT_NOFILE and set aside the reserve descriptor; call once at startup */
+void listener_init(void);
+
+/* Accept a connection, retrying through transient and resource errors */
+int listener_accept(int listenfd, SA *addr, socklen_t *addrlen);
+
+/* Open one SO_REUSEPORT listener per online CPU, steered by CPU; returns the count */
+int listener_open_steered(char *port, int *listenfds, int max);
+
+/* Pin the calling thread (and threads it creates later) to one CPU */
+int listener_pin_cpu(int cpu);
+
+/* Record whether a connection is handled on the CPU that received it */
+void listener_note_cpu(int connfd);
+
+/* Write a plain-text report of accept and fd-exhaustion counters into buf */
+int listener_stats(char *buf, size_t size);
+
+#endif /* __LISTENER_H__ */
+/* $end listener.h */
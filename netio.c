@@ -0,0 +1,92 @@
+/*
+ * netio.c - Error-returning socket I/O for the proxy's transactions
+ */
+#include "netio.h"
+#include "stats.h"
+
+enum { ERR_RESET, ERR_PIPE, ERR_TIMEOUT, ERR_OTHER, ERR_CLASSES };
+
+static const char *class_names[ERR_CLASSES] = {"reset", "broken_pipe", "timeout", "other"};
+static unsigned long errors[2][ERR_CLASSES]; // [writing][class]
+
+/* $begin netio_init */
+void netio_init(void) { Signal(SIGPIPE, SIG_IGN); }
+/* $end netio_init */
+
+/* $begin netio_error */
+void netio_error(int writing) {
+    int class = ERR_OTHER;
+
+    if (errno == ECONNRESET)
+        class = ERR_RESET;
+    else if (errno == EPIPE)
+        class = ERR_PIPE;
+    else if (errno == ETIMEDOUT || errno == EAGAIN || errno == EWOULDBLOCK)
+        class = ERR_TIMEOUT;
+    STAT_INC(errors[writing != 0][class]);
+}
+/* $end netio_error */
+
+/* $begin netio_writen */
+ssize_t netio_writen(int fd, void *buf, size_t n) {
+    char *p = buf;
+    size_t left = n;
+    ssize_t w;
+
+    while (left > 0) {
+        if ((w = send(fd, p, left, MSG_NOSIGNAL)) < 0 && errno == ENOTSOCK)
+            w = write(fd, p, left); // Pipes and files still need write; SIGPIPE is ignored.
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            netio_error(1);
+            return -1;
+        }
+        p += w;
+        left -= w;
+    }
+    return n;
+}
+/* $end netio_writen */
+
+/* $begin netio_writev */
+ssize_t netio_writev(int fd, struct iovec *iov, int iovcnt) {
+    ssize_t rc;
+
+    if ((rc = rio_writev(fd, iov, iovcnt)) < 0)
+        netio_error(1);
+    return rc;
+}
+/* $end netio_writev */
+
+/* $begin netio_readn */
+ssize_t netio_readn(int fd, void *buf, size_t n) {
+    ssize_t rc;
+
+    if ((rc = rio_readn(fd, buf, n)) < 0)
+        netio_error(0);
+    return rc;
+}
+/* $end netio_readn */
+
+/* $begin netio_readlineb */
+ssize_t netio_readlineb(rio_t *rp, void *buf, size_t maxlen) {
+    ssize_t rc;
+
+    if ((rc = rio_readlineb(rp, buf, maxlen)) < 0)
+        netio_error(0);
+    return rc;
+}
+/* $end netio_readlineb */
+
+/* $begin netio_stats */
+int netio_stats(char *buf, size_t size) {
+    int len = 0, writing, class;
+
+    for (writing = 0; writing < 2; writing++)
+        for (class = 0; class < ERR_CLASSES; class++)
+            len += snprintf(buf + len, size - len, "netio.%s_%s %lu\n", writing ? "write" : "read", class_names[class],
+                            STAT_GET(errors[writing][class]));
+    return len < size ? len : size - 1;
+}
+/* $end netio_stats */
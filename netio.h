@@ -0,0 +1,42 @@
+/*
+ * netio.h - Error-returning socket I/O for the proxy's transactions
+ *
+ * csapp's Rio_* wrappers call unix_error, which exits, and writes to a
+ * socket the peer has closed raise SIGPIPE, which also kills the process.
+ * So one client closing mid-download took the whole proxy down: every
+ * other transfer in flight and the cache with it.
+ *
+ * The transaction paths use these calls instead. Writes go out with send
+ * and MSG_NOSIGNAL, every call returns -1 with errno set on an error, and
+ * the caller abandons only its own transaction. SIGPIPE is ignored as
+ * well, for the writes that cannot pass MSG_NOSIGNAL (SSL_write, and
+ * writev for gathered writes). Errors are counted by direction and
+ * class for /proxy-stats.
+ */
+/* $begin netio.h */
+#ifndef __NETIO_H__
+#define __NETIO_H__
+
+#include "csapp.h"
+
+/* Ignore SIGPIPE; call once at startup */
+void netio_init(void);
+
+/* Write all n bytes: n, or -1 on an error */
+ssize_t netio_writen(int fd, void *buf, size_t n);
+
+/* Write all of iovcnt buffers, as few system calls as possible (iov is consumed): the total, or -1 on an error */
+ssize_t netio_writev(int fd, struct iovec *iov, int iovcnt);
+
+/* As rio_readn and rio_readlineb (short counts at EOF), but errors are counted */
+ssize_t netio_readn(int fd, void *buf, size_t n);
+ssize_t netio_readlineb(rio_t *rp, void *buf, size_t maxlen);
+
+/* Count the error in errno for a read (writing = 0) or write done elsewhere */
+void netio_error(int writing);
+
+/* Write a plain-text report of I/O errors by class into buf */
+int netio_stats(char *buf, size_t size);
+
+#endif /* __NETIO_H__ */
+/* $end netio.h */
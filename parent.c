@@ -0,0 +1,246 @@
+/*
+ * parent.c - Sending cache misses to parent proxies instead of origins
+ */
+#include "parent.h"
+#include "stats.h"
+#include "upstream.h"
+#include <time.h>
+
+typedef struct IdleConn {
+    int fd;
+    time_t since; // When it went idle.
+} IdleConn;
+
+struct Parent {
+    char host[NI_MAXHOST];
+    char port[NI_MAXSERV];
+    int weight;
+    int current;                        // Smooth weighted round-robin state.
+    time_t down_until;                  // Skipped until then after a failure.
+    IdleConn idle[PARENT_IDLE_CONNS];   // Idle keep-alive connections, newest last.
+    int nidle;
+    unsigned long requests, failures, conns_opened, conns_reused;
+};
+
+static Parent parents[MAX_PARENTS];
+static int nparents = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER; // Protects current, down_until and the idle lists.
+
+static unsigned long exchanges, failovers, all_failed, kept_alive, closed_after;
+
+/* $begin parent_add */
+int parent_add(char *list) {
+    char copy[MAXLINE], *tok, *save, *colon, *eq;
+
+    snprintf(copy, sizeof(copy), "%s", list);
+    for (tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        if (nparents == MAX_PARENTS) {
+            fprintf(stderr, "parent: at most %d parents\n", MAX_PARENTS);
+            return -1;
+        }
+        Parent *p = &parents[nparents];
+        memset(p, 0, sizeof(Parent));
+        p->weight = 1;
+        if ((eq = strchr(tok, '='))) {
+            *eq = '\0';
+            if ((p->weight = atoi(eq + 1)) < 1) {
+                fprintf(stderr, "parent: bad weight %s\n", eq + 1);
+                return -1;
+            }
+        }
+        if (!(colon = strrchr(tok, ':')) || colon == tok || !colon[1]) {
+            fprintf(stderr, "parent: bad parent %s (expected host:port[=weight])\n", tok);
+            return -1;
+        }
+        *colon = '\0';
+        snprintf(p->host, sizeof(p->host), "%s", tok);
+        snprintf(p->port, sizeof(p->port), "%s", colon + 1);
+        nparents++;
+    }
+    return 0;
+}
+/* $end parent_add */
+
+int parent_enabled(void) { return nparents > 0; }
+
+/*
+ * pick - Smooth weighted round-robin (every parent gains its weight, the
+ *     leader is picked and loses the total) over the parents not yet tried
+ *     for this request. Parents marked down are passed over while any other
+ *     is left, but are still tried last rather than failing the request.
+ */
+static Parent *pick(int *tried) {
+    Parent *best = NULL;
+    time_t now = time(NULL);
+    int i, pass, total = 0;
+
+    pthread_mutex_lock(&lock);
+    for (pass = 0; pass < 2 && !best; pass++) {
+        for (i = 0; i < nparents; i++) {
+            Parent *p = &parents[i];
+            if (tried[i] || (pass == 0 && p->down_until > now))
+                continue;
+            p->current += p->weight;
+            total += p->weight;
+            if (!best || p->current > best->current)
+                best = p;
+        }
+    }
+    if (best) {
+        best->current -= total;
+        tried[best - parents] = 1;
+    }
+    pthread_mutex_unlock(&lock);
+    return best;
+}
+
+static void mark_down(Parent *p) {
+    STAT_INC(p->failures);
+    pthread_mutex_lock(&lock);
+    p->down_until = time(NULL) + PARENT_DOWN_SECS;
+    pthread_mutex_unlock(&lock);
+    fprintf(stderr, "parent: %s:%s failed, skipping it for %ds\n", p->host, p->port, PARENT_DOWN_SECS);
+}
+
+/* The newest idle connection to p that is young enough, or a new one; *reused says it may be stale */
+static int take_conn(Parent *p, int *reused) {
+    time_t now = time(NULL);
+    int fd = -1;
+
+    pthread_mutex_lock(&lock);
+    while (fd < 0 && p->nidle > 0) {
+        IdleConn *c = &p->idle[--p->nidle];
+        if (now - c->since < PARENT_IDLE_SECS)
+            fd = c->fd;
+        else
+            close(c->fd);
+    }
+    pthread_mutex_unlock(&lock);
+    if ((*reused = fd >= 0)) {
+        STAT_INC(p->conns_reused);
+        return fd;
+    }
+
+    if ((fd = upstream_connect(p->host, p->port)) >= 0)
+        STAT_INC(p->conns_opened);
+    return fd;
+}
+
+/*
+ * response_length - Peek at the response head, without consuming it, and
+ *     work out where the response ends. Peeking with MSG_WAITALL for one
+ *     byte more than is buffered waits (up to the receive timeout) for the
+ *     rest of a head that arrived in pieces. Returns the total length if the
+ *     parent will keep the connection open, -1 if it closes after.
+ */
+static ssize_t response_length(int fd, char *method) {
+    char head[MAXBUF];
+    ssize_t n, have = 0;
+
+    while (1) {
+        n = recv(fd, head, have + 1 < sizeof(head) ? have + 1 : sizeof(head) - 1, have ? MSG_PEEK | MSG_WAITALL : MSG_PEEK);
+        if (n <= have || n >= sizeof(head) - 1)
+            return -1; // Closed, timed out or too long: relay to close and do not reuse.
+        have = n;
+        if ((n = recv(fd, head, sizeof(head) - 1, MSG_PEEK | MSG_DONTWAIT)) > have)
+            have = n;
+        head[have] = '\0';
+        if (strstr(head, "\r\n\r\n"))
+            return upstream_response_length(head, method);
+    }
+}
+
+/*
+ * attempt - One try at one parent. A pooled connection may have been
+ *     closed by the parent since it was last used, so a failure on a reused
+ *     connection is retried once on a fresh one. *sent tells the caller
+ *     whether the request may have reached the parent.
+ */
+static int attempt(Parent *p, char *method, char *request, int len, ssize_t *expect, int *sent) {
+    struct timeval tv = {.tv_sec = PARENT_TIMEOUT_MS / 1000, .tv_usec = PARENT_TIMEOUT_MS % 1000 * 1000};
+    int fd, reused;
+
+    *sent = 0;
+    do {
+        if ((fd = take_conn(p, &reused)) < 0)
+            return -1;
+        if (send(fd, request, len, MSG_NOSIGNAL) == len) {
+            *sent = 1;
+            if (upstream_wait_response(fd, PARENT_TIMEOUT_MS) == 1) {
+                setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+                *expect = response_length(fd, method);
+                tv.tv_sec = tv.tv_usec = 0; // The relay itself waits as long as the parent takes.
+                setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+                return fd;
+            }
+        }
+        upstream_abort(fd);
+    } while (reused);
+    return -1;
+}
+
+/* $begin parent_exchange */
+int parent_exchange(char *method, char *request, int len, Parent **parent, ssize_t *expect) {
+    int tried[MAX_PARENTS] = {0};
+    int fd, sent, idempotent = upstream_idempotent(method);
+    Parent *p;
+
+    STAT_INC(exchanges);
+    while ((p = pick(tried))) {
+        STAT_INC(p->requests);
+        if ((fd = attempt(p, method, request, len, expect, &sent)) >= 0) {
+            *parent = p;
+            return fd;
+        }
+        mark_down(p);
+        if (sent && !idempotent)
+            break; // The parent may have acted on it.
+        STAT_INC(failovers);
+    }
+    STAT_INC(all_failed);
+    return -1;
+}
+/* $end parent_exchange */
+
+/* $begin parent_release */
+void parent_release(Parent *p, int fd, int complete) {
+    if (!complete) {
+        STAT_INC(closed_after);
+        upstream_close(fd);
+        return;
+    }
+
+    STAT_INC(kept_alive);
+    pthread_mutex_lock(&lock);
+    if (p->nidle == PARENT_IDLE_CONNS) {
+        close(p->idle[0].fd); // Full: the oldest goes.
+        memmove(&p->idle[0], &p->idle[1], (PARENT_IDLE_CONNS - 1) * sizeof(IdleConn));
+        p->nidle--;
+    }
+    p->idle[p->nidle].fd = fd;
+    p->idle[p->nidle++].since = time(NULL);
+    pthread_mutex_unlock(&lock);
+}
+/* $end parent_release */
+
+/* $begin parent_stats */
+int parent_stats(char *buf, size_t size) {
+    time_t now = time(NULL);
+    int i, len = 0;
+
+    len += snprintf(buf + len, size - len, "parent.count %d\n", nparents);
+    if (!parent_enabled())
+        return len;
+
+    len += snprintf(buf + len, size - len, "parent.exchanges %lu\nparent.failovers %lu\nparent.all_failed %lu\n", STAT_GET(exchanges),
+                    STAT_GET(failovers), STAT_GET(all_failed));
+    len += snprintf(buf + len, size - len, "parent.kept_alive %lu\nparent.closed_after %lu\n", STAT_GET(kept_alive), STAT_GET(closed_after));
+    for (i = 0; i < nparents && len < size; i++) {
+        Parent *p = &parents[i];
+        len += snprintf(buf + len, size - len, "parent.pool %s:%s weight %d %s requests %lu failures %lu conns_opened %lu conns_reused %lu\n",
+                        p->host, p->port, p->weight, STAT_GET(p->down_until) > now ? "down" : "up", STAT_GET(p->requests),
+                        STAT_GET(p->failures), STAT_GET(p->conns_opened), STAT_GET(p->conns_reused));
+    }
+    return len < size ? len : size - 1;
+}
+/* $end parent_stats */
@@ -0,0 +1,51 @@
+/*
+ * parent.h - Sending cache misses to parent proxies instead of origins
+ *
+ * An edge proxy that should not talk to origins directly forwards its
+ * misses, in absolute form, to a regional parent cache. Parents are picked
+ * by smooth weighted round-robin; a parent that cannot be reached or fails
+ * before answering is skipped for PARENT_DOWN_SECS and the request fails
+ * over to the next one. Only when every parent has failed does the client
+ * get a 502.
+ *
+ * Connections to parents are kept open between requests when the parent
+ * agrees (HTTP/1.0 "Connection: keep-alive" plus a Content-Length, so the
+ * end of the response is known without waiting for a close). The response
+ * head is peeked, not consumed, so the relay reads the response as usual
+ * and simply stops after the advertised length.
+ */
+/* $begin parent.h */
+#ifndef __PARENT_H__
+#define __PARENT_H__
+
+#include "csapp.h"
+
+#define MAX_PARENTS 16
+#define PARENT_IDLE_CONNS 8      /* Idle keep-alive connections kept per parent */
+#define PARENT_IDLE_SECS 30      /* Idle connections older than this are not reused */
+#define PARENT_DOWN_SECS 10      /* How long a failed parent is skipped */
+#define PARENT_TIMEOUT_MS 30000  /* Time allowed for a parent (and its own origin fetch) to start answering */
+
+typedef struct Parent Parent;
+
+/* Parse "host:port[=weight],..." (weight defaults to 1); turns parent mode on */
+int parent_add(char *list);
+int parent_enabled(void);
+
+/*
+ * Send request (absolute-form, HTTP/1.0 with keep-alive) to a parent,
+ * failing over between parents, and wait for the response to start.
+ * Returns the connection with *parent and *expect filled in: expect is the
+ * total response length if the parent keeps the connection open, -1 if
+ * the response ends at close. Returns -1 if every parent failed.
+ */
+int parent_exchange(char *method, char *request, int len, Parent **parent, ssize_t *expect);
+
+/* Done relaying from fd; complete means all expect bytes were read, so it can be reused */
+void parent_release(Parent *p, int fd, int complete);
+
+/* Write a plain-text report of parent selection and reuse into buf */
+int parent_stats(char *buf, size_t size);
+
+#endif /* __PARENT_H__ */
+/* $end parent.h */
@@ -0,0 +1,391 @@
+/*
+ * preconnect.c - Predictive pre-connection to origins
+ *
+ * Origins are kept in a list, most recently used first, of at most
+ * PRECONNECT_ORIGINS_MAX: a forward proxy meets an open-ended set of them.
+ * An origin with no warm or pending connections, no live prediction and a
+ * rate decayed to about nothing is forgotten by the preconnect thread, or
+ * sooner when a new origin needs its place. Everything is guarded by one
+ * mutex; the slow part, connecting, runs with the mutex released in the
+ * preconnect thread, and an origin being connected to is never forgotten.
+ */
+#include "preconnect.h"
+#include "stats.h"
+#include "upstream.h"
+#include <time.h>
+
+typedef struct WarmConn {
+    int fd;                // Connected, never-used socket to the origin.
+    long long born_ms;     // When it was connected.
+    struct WarmConn *next; // Pointer to the next warm connection.
+} WarmConn;
+
+typedef struct Origin {
+    char *hostname, *port;     // Origin this entry is for.
+    double rate;               // Decaying request rate (requests/sec) as of last_ms.
+    long long last_ms;         // Time of the last request.
+    int predicted;             // Follow-up requests expected from the last HTML response.
+    long long predicted_until; // When that prediction goes stale.
+    int warm;                  // Idle connections in conns.
+    int connecting;            // Warm-ups in progress.
+    WarmConn *conns;           // Idle connections, newest first.
+    struct Origin *next;       // Pointer to the next origin.
+} Origin;
+
+static int max_speculative = 0; // 0 = pre-connection disabled
+static int speculative = 0;     // Warm plus connecting sockets, across all origins.
+static Origin *origins = NULL;
+static int norigins = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeup = PTHREAD_COND_INITIALIZER;
+
+static unsigned long opened, hits, misses, wasted_idle, wasted_dead, connect_failures, predicted_refs, forgotten, untracked;
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* Request rate of an origin decayed to time now */
+static double origin_rate(Origin *o, long long now) { return o->rate * exp(-(now - o->last_ms) / 1000.0 / PRECONNECT_RATE_TAU); }
+
+/* Whether an origin can be forgotten: nothing warm or connecting, no live prediction, rate about zero */
+static int origin_idle(Origin *o, long long now) {
+    return o->warm == 0 && o->connecting == 0 && now >= o->predicted_until && origin_rate(o, now) < PRECONNECT_RATE_FORGET;
+}
+
+/* Unlink the origin *pp points to and free it. Caller holds lock. */
+static void origin_forget(Origin **pp) {
+    Origin *o = *pp;
+
+    *pp = o->next;
+    free(o->hostname);
+    free(o->port);
+    free(o);
+    norigins--;
+    STAT_INC(forgotten);
+}
+
+/*
+ * origin_lookup - Find the origin entry for <hostname, port> and move it to
+ *     the front, creating it if asked. A full list makes room by forgetting
+ *     its least recently used idle origin; if none is idle, the new origin
+ *     is not tracked. Caller holds lock.
+ */
+static Origin *origin_lookup(char *hostname, char *port, int create) {
+    Origin **pp, **victim = NULL, *o;
+    long long now = now_ms();
+
+    for (pp = &origins; (o = *pp); pp = &o->next) {
+        if (!strcmp(o->hostname, hostname) && !strcmp(o->port, port)) {
+            *pp = o->next;
+            o->next = origins;
+            origins = o;
+            return o;
+        }
+        if (origin_idle(o, now))
+            victim = pp;
+    }
+    if (!create)
+        return NULL;
+    if (norigins >= PRECONNECT_ORIGINS_MAX) {
+        if (!victim) {
+            STAT_INC(untracked);
+            return NULL;
+        }
+        origin_forget(victim);
+    }
+    if (!(o = calloc(1, sizeof(Origin))))
+        return NULL;
+    o->hostname = strdup(hostname);
+    o->port = strdup(port);
+    o->next = origins;
+    origins = o;
+    norigins++;
+    return o;
+}
+
+/* How many warm connections this origin should have right now */
+static int origin_target(Origin *o, long long now) {
+    int target = 0;
+    double rate = origin_rate(o, now);
+
+    if (rate >= PRECONNECT_RATE_THRESHOLD)
+        target = (int)(rate / PRECONNECT_RATE_THRESHOLD);
+    if (now < o->predicted_until && o->predicted > target)
+        target = o->predicted;
+    return target < PRECONNECT_PER_ORIGIN ? target : PRECONNECT_PER_ORIGIN;
+}
+
+/* Is a warm socket still usable (origin hasn't closed or reset it)? */
+static int conn_alive(int fd) {
+    char c;
+    return recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/* Drop warm connections that have idled too long or died. Caller holds lock. */
+static void origin_expire(Origin *o, long long now) {
+    WarmConn **pp = &o->conns, *c;
+
+    while ((c = *pp)) {
+        int idle = now - c->born_ms >= PRECONNECT_IDLE_MS;
+        if (!idle && conn_alive(c->fd)) {
+            pp = &c->next;
+            continue;
+        }
+        if (idle)
+            STAT_INC(wasted_idle);
+        else
+            STAT_INC(wasted_dead);
+        *pp = c->next;
+        upstream_abort(c->fd);
+        free(c);
+        o->warm--;
+        speculative--;
+    }
+}
+
+/* Next origin that wants another warm connection, if the global budget allows. Caller holds lock. */
+static Origin *next_wanted(long long now) {
+    Origin *o;
+
+    if (speculative >= max_speculative)
+        return NULL;
+    for (o = origins; o; o = o->next)
+        if (o->warm + o->connecting < origin_target(o, now))
+            return o;
+    return NULL;
+}
+
+/*
+ * preconnect_thread - Wakes up on every new request or prediction, and at
+ *     least every half second to expire idle connections and forget idle
+ *     origins, and tops up origins that are below their target.
+ */
+static void *preconnect_thread(void *arg) {
+    struct timespec deadline;
+    Origin *o, **pp;
+
+    pthread_mutex_lock(&lock);
+    while (1) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 500 * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&wakeup, &lock, &deadline);
+
+        long long now = now_ms();
+        for (pp = &origins; (o = *pp);) {
+            origin_expire(o, now);
+            if (origin_idle(o, now))
+                origin_forget(pp);
+            else
+                pp = &o->next;
+        }
+
+        while ((o = next_wanted(now))) {
+            o->connecting++;
+            speculative++;
+            pthread_mutex_unlock(&lock);
+            int fd = upstream_connect(o->hostname, o->port);
+            pthread_mutex_lock(&lock);
+            o->connecting--;
+            if (fd < 0) {
+                speculative--;
+                STAT_INC(connect_failures);
+                break; /* Don't hammer an origin that is down; retry on the next wakeup */
+            }
+            WarmConn *c = malloc(sizeof(WarmConn));
+            c->fd = fd;
+            c->born_ms = now_ms();
+            c->next = o->conns;
+            o->conns = c;
+            o->warm++;
+            STAT_INC(opened);
+        }
+    }
+    return NULL;
+}
+
+/* $begin preconnect_init */
+void preconnect_init(int max_sockets) {
+    pthread_t tid;
+
+    max_speculative = max_sockets;
+    if (max_speculative > 0)
+        Pthread_create(&tid, NULL, preconnect_thread, NULL);
+}
+/* $end preconnect_init */
+
+int preconnect_enabled(void) { return max_speculative > 0; }
+
+/* $begin preconnect_take */
+int preconnect_take(char *hostname, char *port) {
+    int fd = -1;
+    Origin *o;
+    WarmConn *c;
+
+    if (!max_speculative)
+        return -1;
+
+    pthread_mutex_lock(&lock);
+    if ((o = origin_lookup(hostname, port, 0))) {
+        while (fd < 0 && (c = o->conns)) {
+            o->conns = c->next;
+            o->warm--;
+            speculative--;
+            if (conn_alive(c->fd)) {
+                fd = c->fd;
+                if (o->predicted > 0)
+                    o->predicted--;
+            } else {
+                STAT_INC(wasted_dead);
+                upstream_abort(c->fd);
+            }
+            free(c);
+        }
+        pthread_cond_signal(&wakeup); /* Refill if the origin is still hot */
+    }
+    pthread_mutex_unlock(&lock);
+
+    if (fd >= 0)
+        STAT_INC(hits);
+    else
+        STAT_INC(misses);
+    return fd;
+}
+/* $end preconnect_take */
+
+/* $begin preconnect_note_request */
+void preconnect_note_request(char *hostname, char *port) {
+    Origin *o;
+
+    if (!max_speculative)
+        return;
+
+    pthread_mutex_lock(&lock);
+    if ((o = origin_lookup(hostname, port, 1))) {
+        long long now = now_ms();
+        o->rate = origin_rate(o, now) + 1.0 / PRECONNECT_RATE_TAU;
+        o->last_ms = now;
+        pthread_cond_signal(&wakeup);
+    }
+    pthread_mutex_unlock(&lock);
+}
+/* $end preconnect_note_request */
+
+/* Case-insensitive search for needle in [s, end) */
+static char *find_ci(char *s, char *end, char *needle) {
+    size_t n = strlen(needle);
+
+    for (; s + n <= end; s++)
+        if (!strncasecmp(s, needle, n))
+            return s;
+    return NULL;
+}
+
+/*
+ * count_embedded - Count src= references in an HTML body that point back
+ *     at the same origin and are not cached yet, i.e. requests that will
+ *     reach this origin shortly. Stops at PRECONNECT_PER_ORIGIN.
+ */
+static int count_embedded(char *hostname, char *port, char *pathname, char *body, char *end, int (*cached)(char *uri)) {
+    char ref[MAXLINE], uri[3 * MAXLINE], base[MAXLINE], dir[MAXLINE];
+    char *p = body, *q, *slash;
+    int n = 0;
+
+    /* Cache keys are the clients' absolute URIs, which omit the default port */
+    if (!strcmp(port, "80"))
+        snprintf(base, sizeof(base), "http://%s", hostname);
+    else
+        snprintf(base, sizeof(base), "http://%s:%s", hostname, port);
+    snprintf(dir, sizeof(dir), "%s", pathname);
+    if ((slash = strrchr(dir, '/')))
+        slash[1] = '\0';
+
+    while (n < PRECONNECT_PER_ORIGIN && (p = find_ci(p, end, "src="))) {
+        p += 4;
+        if (p < end && (*p == '"' || *p == '\''))
+            p++;
+        for (q = p; q < end && q - p < MAXLINE - 1 && !strchr("\"' >", *q); q++)
+            ;
+        snprintf(ref, sizeof(ref), "%.*s", (int)(q - p), p);
+        p = q;
+
+        if (!strncasecmp(ref, "http://", 7)) {
+            if (strncmp(ref, base, strlen(base)) || (ref[strlen(base)] != '/' && ref[strlen(base)] != '\0'))
+                continue; /* Another origin */
+            snprintf(uri, sizeof(uri), "%s", ref);
+        } else if (ref[0] == '/' && ref[1] != '/') {
+            snprintf(uri, sizeof(uri), "%s%s", base, ref);
+        } else if (ref[0] && !strchr(ref, ':') && ref[0] != '/' && ref[0] != '#') {
+            snprintf(uri, sizeof(uri), "%s%s%s", base, dir, ref);
+        } else {
+            continue; /* Other scheme, protocol-relative or empty */
+        }
+        if (cached && cached(uri))
+            continue;
+        n++;
+    }
+    return n;
+}
+
+/*
+ * preconnect_note_response - After a miss for an HTML page, expect its
+ *     embedded objects to be requested from the same origin next.
+ */
+/* $begin preconnect_note_response */
+void preconnect_note_response(char *hostname, char *port, char *pathname, char *response, int size, int (*cached)(char *uri)) {
+    char *end = response + size, *body;
+    Origin *o;
+    int n;
+
+    if (!max_speculative || !response || size <= 0)
+        return;
+    if (!(body = find_ci(response, end, "\r\n\r\n")) || !find_ci(response, body, "Content-type: text/html"))
+        return;
+    if ((n = count_embedded(hostname, port, pathname, body + 4, end, cached)) == 0)
+        return;
+
+    STAT_ADD(predicted_refs, n);
+    pthread_mutex_lock(&lock);
+    if ((o = origin_lookup(hostname, port, 1))) {
+        o->predicted = n;
+        o->predicted_until = now_ms() + PRECONNECT_PREDICT_MS;
+        pthread_cond_signal(&wakeup);
+    }
+    pthread_mutex_unlock(&lock);
+}
+/* $end preconnect_note_response */
+
+/* $begin preconnect_stats */
+int preconnect_stats(char *buf, size_t size) {
+    int len = 0;
+    Origin *o;
+
+    len += snprintf(buf + len, size - len, "preconnect.max_sockets %d\n", max_speculative);
+    if (!max_speculative)
+        return len;
+
+    unsigned long h = STAT_GET(hits), w = STAT_GET(wasted_idle) + STAT_GET(wasted_dead);
+    len += snprintf(buf + len, size - len, "preconnect.predicted_refs %lu\npreconnect.opened %lu\npreconnect.connect_failures %lu\n",
+                    STAT_GET(predicted_refs), STAT_GET(opened), STAT_GET(connect_failures));
+    len += snprintf(buf + len, size - len, "preconnect.hits %lu\npreconnect.misses %lu\npreconnect.wasted_idle %lu\npreconnect.wasted_dead %lu\n", h,
+                    STAT_GET(misses), STAT_GET(wasted_idle), STAT_GET(wasted_dead));
+    len += snprintf(buf + len, size - len, "preconnect.hit_ratio %.1f%%\n", h + w ? 100.0 * h / (h + w) : 0.0);
+
+    pthread_mutex_lock(&lock);
+    long long now = now_ms();
+    len += snprintf(buf + len, size - len, "preconnect.speculative %d\npreconnect.origins %d\npreconnect.origins_forgotten %lu\n", speculative,
+                    norigins, STAT_GET(forgotten));
+    len += snprintf(buf + len, size - len, "preconnect.origins_untracked %lu\n", STAT_GET(untracked));
+    for (o = origins; o && len < size; o = o->next)
+        len += snprintf(buf + len, size - len, "preconnect.origin %s:%s rate %.2f/s warm %d target %d\n", o->hostname, o->port,
+                        origin_rate(o, now), o->warm, origin_target(o, now));
+    pthread_mutex_unlock(&lock);
+    return len < size ? len : size - 1;
+}
+/* $end preconnect_stats */
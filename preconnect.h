@@ -0,0 +1,45 @@
+/*
+ * preconnect.h - Predictive pre-connection to origins
+ *
+ * The first miss to an origin after an idle period pays DNS plus a TCP
+ * handshake. The proxy tracks a decaying request rate per origin and
+ * predicts follow-up requests (an HTML miss is followed by its embedded
+ * images and scripts), and a background thread opens connections to those
+ * origins ahead of time. doit() takes a warm connection when one is
+ * available and falls back to upstream_connect() otherwise.
+ *
+ * Speculative sockets are bounded globally and expire after
+ * PRECONNECT_IDLE_MS: an iterative origin like tiny serves nobody else
+ * while one of our idle connections sits in its accept queue. So is the
+ * number of origins tracked, and idle ones are forgotten.
+ */
+/* $begin preconnect.h */
+#ifndef __PRECONNECT_H__
+#define __PRECONNECT_H__
+
+#include "csapp.h"
+
+#define PRECONNECT_IDLE_MS 2000      /* Close warm connections unused for this long */
+#define PRECONNECT_PER_ORIGIN 4      /* At most this many warm connections per origin */
+#define PRECONNECT_RATE_TAU 10.0     /* Seconds over which request rates decay */
+#define PRECONNECT_RATE_THRESHOLD 1.0 /* Requests/sec before an origin is kept warm */
+#define PRECONNECT_PREDICT_MS 3000   /* How long an HTML-based prediction stays valid */
+#define PRECONNECT_ORIGINS_MAX 256   /* Origins tracked at once, least recently used forgotten first */
+#define PRECONNECT_RATE_FORGET 0.01  /* Requests/sec below which an idle origin is forgotten */
+
+/* Enable pre-connection with at most max_sockets speculative sockets */
+void preconnect_init(int max_sockets);
+int preconnect_enabled(void);
+
+/* Take a warm connection to <hostname, port>, or -1 if none is ready */
+int preconnect_take(char *hostname, char *port);
+
+/* Feed the predictor: a request for an origin, and the response it got */
+void preconnect_note_request(char *hostname, char *port);
+void preconnect_note_response(char *hostname, char *port, char *pathname, char *response, int size, int (*cached)(char *uri));
+
+/* Write a plain-text report of prediction hits and waste into buf */
+int preconnect_stats(char *buf, size_t size);
+
+#endif /* __PRECONNECT_H__ */
+/* $end preconnect.h */
@@ -1,9 +1,14 @@
 // #include <stdio.h>
 
-/* Recommended max cache and object sizes */
-#define MAX_CACHE_SIZE 1049000
+/* Recommended max object size (the cache's is in cache.h) */
 #define MAX_OBJECT_SIZE 102400
 
+/* Relay buffer: small for slow-drip responses, doubled while reads keep filling it */
+#define RELAY_BUF_MIN 4096
+#define RELAY_BUF_MAX 65536
+#define RELAY_IOV (RELAY_BUF_MAX / IOBUF_SIZE + 1)      /* Buffers one read can span (the first partly filled) */
+#define CACHE_IOV (CLUSTER_MAX_OBJECT / IOBUF_SIZE + 1) /* Buffers in the largest object the cache holds (peers store up to this) */
+
 /* You won't lose style points for including this long line in your code */
 // static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 "
 //                                     "Firefox/10.0.3\r\n";
@@ -12,116 +17,405 @@
 //     return 0;
 // }
 
+#include "arena.h"
+#include "backend.h"
+#include "cache.h"
+#include "cluster.h"
 #include "csapp.h"
+#include "engine.h"
+#include "front.h"
+#include "h2.h"
+#include "hedge.h"
+#include "iobuf.h"
+#include "listener.h"
+#include "netio.h"
+#include "parent.h"
+#include "preconnect.h"
+#include "purge.h"
+#include "ratelimit.h"
+#include "retry.h"
+#include "splice.h"
+#include "spool.h"
+#include "stats.h"
+#include "tls.h"
+#include "upstream.h"
+#include "zerocopy.h"
+#include <poll.h>
+#include <time.h>
 // #include <pthread.h> // already included in csapp.h
 
-typedef struct CachedItem {
-    char *uri;               // The URI of the requested object.
-    char *response;          // The HTTP response.
-    int size;                // Size of the response.
-    struct CachedItem *next; // Pointer to the next cached object.
-} CachedItem;
-
-typedef struct Cache {
-    CachedItem *head;     // Head of the linked list.
-    int total_size;       // Total size of objects in cache.
-    pthread_mutex_t lock; // Mutex for this cache.
-} Cache;
-
-void doit(int fd);
+typedef struct ClientConn {
+    int fd;                     // Connected client descriptor.
+    RateClient *limit;          // Rate-limit slot of the client's IP (NULL if unlimited).
+    int peer_fd;                // The client's own socket, whose address decides PURGE (fd is a socketpair for h2 streams).
+    size_t head_len;            // Request bytes already read by the front stage.
+    char head[FRONT_HEAD_MAX];  // Those bytes; the worker's Rio starts from them.
+} ClientConn;
+
+typedef struct Upstream {
+    int fd;         // Connection the response is read from.
+    ssize_t expect; // Response length when the connection outlives it, else -1 (ends at close).
+    Parent *parent; // Parent proxy the connection belongs to; NULL for an origin.
+    TlsConn *tls;   // TLS session the response is read through; NULL for plaintext.
+} Upstream;
+
+void doit(ClientConn *conn);
 int parse_uri(char *uri, char *hostname, char *pathname, char *port);
-void relay_response(int clientfd, int serverfd, char **response_buffer, ssize_t *response_size);
+void relay_response(int clientfd, Upstream *up, Arena *arena, IoChain **response, RateClient *limit);
+ssize_t relay_buffered(int clientfd, Upstream *up, ssize_t relayed, IoChain **capture, RateClient *limit);
+void release_upstream(Upstream *up, ssize_t relayed);
+ssize_t read_upstream(Upstream *up, struct iovec *iov, int iovcnt);
+ssize_t relay_spliced(int clientfd, Upstream *up, ssize_t relayed, RateClient *limit);
 void clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg);
-void *thread_function(void *arg);
-void cache_add(Cache *cache, char *uri, char *response, int size);
-CachedItem *cache_search(Cache *cache, char *uri);
-Cache cache;
+void serve_stats(int fd);
+void serve_purge(int fd, int peer_fd, char *uri);
+void serve_stream(int fd, char *request, size_t len, void *arg);
+void usage(char *prog);
+void serve_conn(void *arg);
+void start_worker(ClientConn *conn);
+void dispatch_conn(int fd, void *arg, char *head, size_t len);
+void drop_conn(int fd, void *arg);
+void accept_loop(int listenfd);
+void *acceptor_thread(void *arg);
+void *unix_acceptor_thread(void *arg);
+int listenfds[MAX_LISTENERS]; // Per-CPU listeners when CPU steering is on.
 
 int main(int argc, char **argv) {
-    int listenfd, connfd;
-    char hostname[MAXLINE], port[MAXLINE];
-    socklen_t clientlen;
-    struct sockaddr_storage clientaddr;
-    cache.head = NULL;
-    cache.total_size = 0;
-    pthread_mutex_init(&cache.lock, NULL);
+    int opt, cpu_steering = 0, preconnect_max = 0, h2c = 0;
+    char *unix_listen = NULL;
 
     /* Check command line args */
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    while ((opt = getopt(argc, argv, "s:r:c:CW:H:E:L:B:T:U:u:R:N:I:P:V:A:K:2Z:e:k:")) != -1) {
+        switch (opt) {
+        case 'e':
+            if (engine_configure(optarg) < 0)
+                exit(1);
+            break;
+        case 'k':
+            if (cache_configure(optarg) < 0)
+                exit(1);
+            break;
+        case 'Z':
+            if (zerocopy_configure(optarg) < 0)
+                exit(1);
+            break;
+        case '2':
+            h2c = 1;
+            break;
+        case 'K':
+            if (tls_configure(optarg) < 0)
+                exit(1);
+            break;
+        case 'V':
+            if (purge_configure(optarg) < 0)
+                exit(1);
+            break;
+        case 'A':
+            if (purge_set_key(optarg) < 0)
+                exit(1);
+            break;
+        case 'P':
+            if (parent_add(optarg) < 0)
+                exit(1);
+            break;
+        case 'N':
+            if (cluster_set_members(optarg) < 0)
+                exit(1);
+            break;
+        case 'I':
+            cluster_set_self(optarg);
+            break;
+        case 'R':
+            if (backend_add_pool(optarg) < 0)
+                exit(1);
+            break;
+        case 'u':
+            unix_listen = optarg;
+            break;
+        case 'U':
+            if (upstream_map_unix(optarg) < 0)
+                exit(1);
+            break;
+        case 'T':
+            if (front_set_deadline(optarg) < 0)
+                exit(1);
+            break;
+        case 'B':
+            if (spool_configure(optarg) < 0)
+                exit(1);
+            break;
+        case 'L':
+            if (ratelimit_configure(optarg) < 0)
+                exit(1);
+            break;
+        case 'H':
+            if (hedge_set_percentile(optarg) < 0)
+                exit(1);
+            break;
+        case 'E':
+            if (hedge_add_replicas(optarg) < 0)
+                exit(1);
+            break;
+        case 'W':
+            preconnect_max = atoi(optarg);
+            break;
+        case 'C':
+            cpu_steering = 1;
+            break;
+        case 's':
+            if (upstream_set_sources(optarg) < 0)
+                exit(1);
+            break;
+        case 'r':
+            if (upstream_set_port_range(optarg) < 0)
+                exit(1);
+            break;
+        case 'c':
+            if (upstream_set_close_strategy(optarg) < 0)
+                exit(1);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1)
+        usage(argv[0]);
+    if (cpu_steering && !engine_pinned()) {
+        fprintf(stderr, "-C needs -e thread: pool workers are not pinned, so connections would not stay on their CPU\n");
         exit(1);
     }
 
-    listenfd = Open_listenfd(argv[1]);
+    netio_init();
+    listener_init();
+    engine_init(serve_conn);
+    preconnect_init(preconnect_max);
+    retry_init();
+    backend_init();
+    cluster_init(cache_copy, cache_store_copy);
+    purge_init(cache_purge);
+    tls_init();
+    if (h2c)
+        h2_init(serve_stream, backend_enabled());
+    if (unix_listen) {
+        pthread_t tid;
+        Pthread_create(&tid, NULL, unix_acceptor_thread, unix_listen);
+    }
+    if (!cpu_steering)
+        accept_loop(Open_listenfd(argv[optind]));
+
+    /* One pinned acceptor per CPU; main just waits */
+    int i, n = listener_open_steered(argv[optind], listenfds, MAX_LISTENERS);
+    for (i = 0; i < n; i++) {
+        int *cpu_ptr = malloc(sizeof(int));
+        *cpu_ptr = i;
+        pthread_t tid;
+        Pthread_create(&tid, NULL, acceptor_thread, cpu_ptr);
+    }
+    while (1)
+        pause();
+}
+/* $end tinymain */
+
+/* $begin accept_loop */
+// accepts connections forever, handing each to the engine once its request head is in
+void accept_loop(int listenfd) {
+    Front *front = front_create(dispatch_conn, drop_conn); // NULL if heads are read by the workers
+    int connfd;
+    char hostname[MAXLINE], port[MAXLINE];
+    socklen_t clientlen;
+    struct sockaddr_storage clientaddr;
+    RateClient *limit;
+
     while (1) {
         clientlen = sizeof(clientaddr);
-        connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-        Getnameinfo((SA *)&clientaddr, clientlen, hostname, MAXLINE, port, MAXLINE, 0);
+        connfd = listener_accept(listenfd, (SA *)&clientaddr, &clientlen);
+        if (getnameinfo((SA *)&clientaddr, clientlen, hostname, MAXLINE, port, MAXLINE, NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
+            strcpy(hostname, "?"); // not worth dying over a log line
+            strcpy(port, "?");
+        }
         printf("Accepted connection from (%s, %s); a reminder that this is a proxy server.\n", hostname, port);
 
-        /* Dynamically allocate memory for each thread */
-        int *connfd_ptr = malloc(sizeof(int));
-        *connfd_ptr = connfd;
-
-        pthread_t tid;
-        if (pthread_create(&tid, NULL, thread_function, connfd_ptr) != 0) {
-            fprintf(stderr, "Error creating thread\n"); // Handle error
+        /* Refuse clients over their connection cap before spending a thread on them */
+        if (ratelimit_connect((SA *)&clientaddr, &limit) < 0) {
+            printf("Too many connections from %s\n", hostname);
+            ratelimit_reject(connfd);
             continue;
         }
+
+        /* Dynamically allocate memory for each thread */
+        ClientConn *conn = malloc(sizeof(ClientConn));
+        conn->fd = connfd;
+        conn->limit = limit;
+        conn->peer_fd = connfd;
+        conn->head_len = 0;
+
+        if (front)
+            front_submit(front, connfd, conn);
+        else
+            start_worker(conn);
     }
 }
-/* $end tinymain */
+/* $end accept_loop */
+
+/* $begin start_worker */
+void start_worker(ClientConn *conn) {
+    if (engine_submit(conn) < 0) {
+        fprintf(stderr, "No worker for connection\n"); // Handle error: drop this client, keep serving
+        drop_conn(conn->fd, conn);
+    }
+}
+/* $end start_worker */
+
+/* $begin dispatch_conn */
+// front stage callback: the request head is complete, hand it to a worker
+void dispatch_conn(int fd, void *arg, char *head, size_t len) {
+    ClientConn *conn = arg;
+    memcpy(conn->head, head, len);
+    conn->head_len = len;
+    start_worker(conn);
+}
+/* $end dispatch_conn */
+
+/* $begin drop_conn */
+// releases a connection that never reached doit
+void drop_conn(int fd, void *arg) {
+    ClientConn *conn = arg;
+    ratelimit_disconnect(conn->limit);
+    free(conn);
+    Close(fd);
+}
+/* $end drop_conn */
+
+/* $begin acceptor_thread */
+// runs accept_loop on one CPU's listener; connection threads inherit the CPU pinning
+void *acceptor_thread(void *arg) {
+    int cpu = *((int *)arg);
+    free(arg);
+
+    listener_pin_cpu(cpu);
+    accept_loop(listenfds[cpu]);
+    return NULL;
+}
+/* $end acceptor_thread */
+
+/* $begin unix_acceptor_thread */
+// runs accept_loop on the Unix-domain listener, alongside the TCP ones
+void *unix_acceptor_thread(void *arg) {
+    char *path = arg;
+    int listenfd = open_unix_listenfd(path);
+
+    if (listenfd < 0) {
+        fprintf(stderr, "Cannot listen on %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    printf("Listening on %s\n", path);
+    accept_loop(listenfd);
+    return NULL;
+}
+/* $end unix_acceptor_thread */
 
 /* $begin doit */
 // handle one HTTP request/response transaction
-void doit(int clientfd) {
+void doit(ClientConn *conn) {
+    int clientfd = conn->fd;
+    RateClient *limit = conn->limit;
     char request_buf[MAXLINE], line_buf[MAXLINE];
     int total_bytes = 0;
     char method[MAXLINE], uri[MAXLINE], version[MAXLINE];
     char hostname[MAXLINE], pathname[MAXLINE], port[MAXLINE];
-    char *response_buffer = NULL;
-    ssize_t response_size = 0;
+    IoChain *response = NULL;
     rio_t rio;
 
-    /* Initialize rio */
-    Rio_readinitb(&rio, clientfd);
+    /* Initialize rio with whatever the front stage has already read */
+    front_rio_init(&rio, clientfd, conn->head, conn->head_len);
 
     /* Read request line and parse them into compartments */
-    ssize_t bytes1 = Rio_readlineb(&rio, request_buf, MAXLINE);
-    if (!bytes1) {
-        printf("No data to read in Request Line");
-        clienterror(clientfd, "No request data", "400", "Bad Request", "Please submit a valid request");
-        return;
+    ssize_t bytes1 = netio_readlineb(&rio, request_buf, MAXLINE);
+    if (bytes1 <= 0) {
+        if (bytes1 == 0) {
+            printf("No data to read in Request Line");
+            clienterror(clientfd, "No request data", "400", "Bad Request", "Please submit a valid request");
+        }
+        return; // a read error means the client is gone: nothing to answer
     }
     sscanf(request_buf, "%s %s %s", method, uri, version);
 
-    /* Cache lookup */
-    pthread_mutex_lock(&cache.lock);
-    CachedItem *item = cache_search(&cache, uri);
-    pthread_mutex_unlock(&cache.lock);
+    /* An h2c client with prior knowledge opens with the HTTP/2 preface instead of a request */
+    if (h2_enabled() && !strcmp(request_buf, "PRI * HTTP/2.0\r\n")) {
+        h2_serve_prior(clientfd, &rio, conn);
+        return;
+    }
+
+    /* The proxy answers its own stats path instead of forwarding it */
+    if (!strcmp(uri, STATS_PATH)) {
+        serve_stats(clientfd);
+        return;
+    }
+
+    /* PURGE drops a URI (or, ending in '*', every URI with that prefix) here and on every peer */
+    if (!strcasecmp(method, "PURGE")) {
+        serve_purge(clientfd, conn->peer_fd, uri);
+        return;
+    }
 
-    if (item) {
+    /* A reverse proxy serves its backends only: an absolute-form URI would make it an open forward proxy */
+    if (backend_enabled() && uri[0] != '/') {
+        clienterror(clientfd, uri, "400", "Bad Request", "Only origin-form requests are served");
+        return;
+    }
+
+    /* Clients over their request rate get a quick 429 */
+    if (ratelimit_request(limit) < 0) {
+        clienterror(clientfd, uri, "429", "Too Many Requests", "Request rate limit exceeded");
+        return;
+    }
+
+    /* Cache lookup; a hit holds its buffer chain while it is sent, so eviction or a purge cannot free it under us */
+    IoChain *hit = cache_lookup(uri);
+
+    if (hit) {
         printf("Served from cache: %s\n", uri);
-        // Serve the cached content to the client.
-        Rio_writen(clientfd, item->response, item->size);
+        // Serve the cached content to the client, gathered from its buffers in one write.
+        struct iovec iov[CACHE_IOV];
+        int iovcnt = iochain_iov(hit, iov, CACHE_IOV);
+        ratelimit_pace(limit, hit->len);
+        if (zerocopy_wanted(hit->len)) {
+            zerocopy_send(clientfd, iov, iovcnt, hit); // Drops hit once the kernel is done with its pages.
+            return;
+        }
+        netio_writev(clientfd, iov, iovcnt);
+        iochain_release(hit);
         return;
     } else {
+        /* In cluster mode, a URI owned by a peer may be in the peer's cache */
+        char *peer_response;
+        int peer_size;
+        if (cluster_get(uri, &peer_response, &peer_size) == CLUSTER_HIT) {
+            printf("Served from cluster peer: %s\n", uri);
+            ratelimit_pace(limit, peer_size);
+            netio_writen(clientfd, peer_response, peer_size);
+            free(peer_response);
+            return;
+        }
         printf("Fetched from server: %s\n", uri);
     }
 
-    parse_uri(uri, hostname, pathname, port);
+    /* In reverse-proxy mode the (origin-form) URI is a path on one of the backends */
+    int reverse = backend_enabled();
+    if (reverse)
+        snprintf(pathname, MAXLINE, "%s", uri);
+    else
+        parse_uri(uri, hostname, pathname, port);
     snprintf(request_buf, MAXLINE, "%s %s %s\r\n", method, pathname, version);
-    total_bytes += bytes1;
+    total_bytes = strlen(request_buf); // the rewritten line is shorter than what was read
+    int line_bytes = total_bytes;
+    int upgrade_h2c = 0;
+    char h2_settings[MAXLINE] = "";
 
     /* Read request headers and append(strcat) them to request_buf */
     while (1) {
-        /* Check if we've reached the end of the HTTP headers */
-        if (strcmp(line_buf, "\r\n") == 0) {
-            break;
-        }
-
         /* Read a line from the client into line_buf */
-        ssize_t bytes2 = Rio_readlineb(&rio, line_buf, MAXLINE - 1);
+        ssize_t bytes2 = netio_readlineb(&rio, line_buf, MAXLINE - 1);
 
         /* Check for read errors or end of file */
         if (bytes2 <= 0) {
@@ -130,10 +424,29 @@ void doit(int clientfd) {
             return;
         }
 
+        /* Check if we've reached the end of the HTTP headers */
+        int end_of_headers = strcmp(line_buf, "\r\n") == 0;
+        if (end_of_headers) {
+            /* Ask the origin to close first, so the origin (not the proxy) holds TIME_WAIT */
+            snprintf(line_buf, MAXLINE, "Connection: close\r\n\r\n");
+            bytes2 = strlen(line_buf);
+        } else if (!strncasecmp(line_buf, "Connection:", 11) || !strncasecmp(line_buf, "Proxy-Connection:", 17)) {
+            continue;
+        } else if (h2_enabled() && !strncasecmp(line_buf, "Upgrade:", 8)) {
+            upgrade_h2c = strstr(line_buf, "h2c") != NULL;
+            continue;
+        } else if (h2_enabled() && !strncasecmp(line_buf, "HTTP2-Settings:", 15)) {
+            snprintf(h2_settings, MAXLINE, "%s", line_buf + 15 + strspn(line_buf + 15, " \t"));
+            h2_settings[strcspn(h2_settings, "\r\n")] = '\0';
+            continue;
+        }
+
         /* Ensure we don't overflow request_buf */
         if (total_bytes + bytes2 < MAXLINE) {
             strcat(request_buf, line_buf); // Append the line to request_buf
             total_bytes += bytes2;
+            if (end_of_headers)
+                break;
         } else {
             printf("Request headers too large to handle.");
             clienterror(clientfd, "Request too large", "413", "Request Entity Too Large", "Your request headers are too long");
@@ -141,27 +454,83 @@ void doit(int clientfd) {
         }
     }
 
-    /* Open connection to end server and relay the response */
-    int targetfd = open_clientfd(hostname, port);
-    if (targetfd < 0) {
-        printf("Error connecting to target server.\n");
-        clienterror(clientfd, "Cannot connect", "500", "Internal Server Error", "Could not connect to target server");
-        return;
+    /* An HTTP/1.1 GET or HEAD may ask to continue as h2c; the request itself becomes stream 1 */
+    if (upgrade_h2c && h2_settings[0] && (!strcmp(method, "GET") || !strcmp(method, "HEAD"))) {
+        char stream_buf[MAXLINE * 2];
+        int stream_bytes = snprintf(stream_buf, sizeof(stream_buf), "%s %s HTTP/1.0\r\n%s", method, uri, request_buf + line_bytes);
+        if (stream_bytes < sizeof(stream_buf)) {
+            h2_serve_upgrade(clientfd, &rio, h2_settings, stream_buf, stream_bytes, conn);
+            return;
+        }
     }
 
-    /* Forward the request line and header to the end server */
-    Rio_writen(targetfd, request_buf, total_bytes);
+    /* Open connection to end server (or a parent proxy), forward the request line and headers,
+     * and wait for the response to start; failures before any response byte are retried transparently */
+    Upstream up = {.fd = -1, .expect = -1, .parent = NULL, .tls = NULL};
+    Backend *backend = NULL;
+    int via_parent = parent_enabled() && !reverse;
+    int https = !via_parent && !reverse && !strncasecmp(uri, "https://", 8);
+    if (via_parent || https) {
+        /* Parents get the absolute-form URI and TLS origins the path; both are asked to keep the connection open */
+        char keepalive_buf[MAXLINE * 2];
+        int header_bytes = total_bytes - line_bytes - strlen("Connection: close\r\n\r\n");
+        int keepalive_bytes = snprintf(keepalive_buf, sizeof(keepalive_buf), "%s %s HTTP/1.0\r\n%.*sConnection: keep-alive\r\n\r\n", method,
+                                       via_parent ? uri : pathname, header_bytes, request_buf + line_bytes);
+        if (keepalive_bytes >= sizeof(keepalive_buf)) {
+            clienterror(clientfd, "Request too large", "413", "Request Entity Too Large", "Your request headers are too long");
+            return;
+        }
+        if (via_parent)
+            up.fd = parent_exchange(method, keepalive_buf, keepalive_bytes, &up.parent, &up.expect);
+        else
+            up.fd = tls_exchange(method, hostname, port, keepalive_buf, keepalive_bytes, &up.tls, &up.expect);
+        if (up.fd < 0) {
+            printf("Error reaching %s.\n", via_parent ? "parent proxies" : "TLS origin");
+            clienterror(clientfd, uri, "502", "Bad Gateway", via_parent ? "No parent proxy could be reached" : "Could not reach the origin over TLS");
+            return;
+        }
+    } else {
+        if (reverse) {
+            if (!(backend = backend_pick(uri))) {
+                clienterror(clientfd, uri, "503", "Service Unavailable", "No healthy backend");
+                return;
+            }
+            snprintf(hostname, MAXLINE, "%s", backend->host);
+            snprintf(port, MAXLINE, "%s", backend->port);
+        }
+        preconnect_note_request(hostname, port);
+        up.fd = retry_exchange(method, hostname, port, request_buf, total_bytes);
+        if (up.fd < 0) {
+            if (backend)
+                backend_release(backend, 0);
+            printf("Error connecting to target server.\n");
+            clienterror(clientfd, "Cannot connect", "500", "Internal Server Error", "Could not connect to target server");
+            return;
+        }
+    }
     // forward_requesthdrs(&rio, targetfd);
 
-    /* Relay the target server's response to the client */
-    relay_response(clientfd, targetfd, &response_buffer, &response_size);
-    Close(targetfd);
+    /* Relay the target server's response to the client; scratch buffers live in the arena until the end of the transaction */
+    Arena arena;
+    arena_init(&arena);
+    relay_response(clientfd, &up, &arena, &response, limit); // Also releases up.
+    arena_reset(&arena);
+    if (backend)
+        backend_release(backend, 1);
+    if (!response)
+        return; // Nothing to cache (too large, uncacheable, or cut short).
+    if (!up.parent && !up.tls && preconnect_enabled()) {
+        char *flat = iochain_linearize(response); // The predictor scans one contiguous response.
+        if (flat)
+            preconnect_note_response(hostname, port, pathname, flat, response->len, cache_contains);
+        free(flat);
+    }
 
-    /* Add to Cache */
-    pthread_mutex_lock(&cache.lock);
-    cache_add(&cache, uri, response_buffer, response_size);
-    free(response_buffer);
-    pthread_mutex_unlock(&cache.lock);
+    /* Add to Cache: the URI's owner caches it, which is this node unless a peer took it. The cache adopts the chain as read. */
+    struct iovec iov[CACHE_IOV];
+    if (!cluster_put(uri, iov, iochain_iov(response, iov, CACHE_IOV)))
+        cache_store(uri, response);
+    iochain_release(response);
 }
 /* $end doit */
 
@@ -211,45 +580,303 @@ int parse_uri(char *uri, char *hostname, char *pathname, char *port) {
 }
 /* $end parse_uri */
 
-void relay_response(int clientfd, int serverfd, char **response_buffer, ssize_t *response_size) {
-    char buf[MAXLINE];
+/* How much to read next: max, or less so a response of known length is not read past */
+static size_t read_size(Upstream *up, size_t max, ssize_t relayed) {
+    return up->expect < 0 || up->expect - relayed > (ssize_t)max ? max : up->expect - relayed;
+}
+
+/* Judging by the response head at the front of the upstream socket (peeked, not read), may it be cached? If unsure, yes */
+static int cacheable_response(int fd) {
+    char head[MAXBUF];
+    ssize_t n = recv(fd, head, sizeof(head) - 1, MSG_PEEK | MSG_DONTWAIT);
+
+    if (n <= 0)
+        return 1;
+    head[n] = '\0';
+    return !strstr(head, "\r\n\r\n") || upstream_cacheable(head, MAX_OBJECT_SIZE);
+}
+
+/*
+ * relay_head - Parents and TLS origins are asked to keep the connection, and
+ *     their response heads say they will. Read the head (with whatever of the
+ *     body came along), pass it to the client and *capture without its
+ *     hop-by-hop headers and tell from it whether the response may be cached;
+ *     if not, *capture is released and set to NULL. Returns the bytes read from the upstream (0 at EOF, -1 on error), of
+ *     which *stripped did not go on.
+ */
+static ssize_t relay_head(int clientfd, Upstream *up, IoChain **capture, RateClient *limit, ssize_t *stripped, int *cacheable) {
+    char head[MAXBUF + 1];
+    struct iovec iov = {head, read_size(up, MAXBUF, 0)};
     ssize_t n;
+    size_t len;
+
+    while ((n = read_upstream(up, &iov, 1)) < 0 && errno == EINTR)
+        ;
+    if (n <= 0)
+        return n;
+    len = upstream_strip_hop_by_hop(head, n);
+    head[len] = '\0';
+    *stripped = n - len;
+    *cacheable = upstream_cacheable(head, MAX_OBJECT_SIZE);
+    ratelimit_pace(limit, len);
+    netio_writen(clientfd, head, len); // A client that went is noticed by the next write; the response may still be cached.
+    if (*capture && (!*cacheable || iochain_append(*capture, head, len) != 0)) {
+        iochain_release(*capture); // Private, no-store or too large: no other client gets it.
+        *capture = NULL;
+    }
+    return n;
+}
 
-    *response_buffer = NULL;
-    *response_size = 0;
+void relay_response(int clientfd, Upstream *up, Arena *arena, IoChain **response, RateClient *limit) {
+    struct iovec iov[RELAY_IOV];
+    IoChain *capture = iochain_new(); // The response as read, while it may still be cached (NULL once it cannot be).
+    char *buf = NULL;                 // Where reads go after that.
+    size_t buf_size = RELAY_BUF_MIN;  // Bytes asked of each read.
+    ssize_t n, want, relayed = 0, stripped = 0; // stripped: head bytes read but not passed on.
+    int iovcnt, client_ok = 1, cacheable = 1;
+
+    *response = NULL;
+    // Whichever way it is relayed, a response whose head forbids caching is not captured
+    if (up->parent || up->tls) {
+        relayed = relay_head(clientfd, up, &capture, limit, &stripped, &cacheable);
+    } else if (!(cacheable = cacheable_response(up->fd)) && capture) {
+        iochain_release(capture); // Private, no-store or too large: no other client gets it.
+        capture = NULL;
+    }
 
-    char *tmp_buffer = malloc(MAX_OBJECT_SIZE); // Allocate memory for max possible response
-    if (!tmp_buffer) {
-        perror("malloc");
-        return;
+    if (relayed < 0 || (relayed == 0 && (up->parent || up->tls))) {
+        release_upstream(up, 0);
+        relayed = 0;
+    } else if (spool_enabled()) {
+        relayed = relay_buffered(clientfd, up, relayed, &capture, limit);
+    } else if (!up->tls && !cacheable && (n = relay_spliced(clientfd, up, relayed, limit)) >= 0) {
+        release_upstream(up, n); // Never cached, so never seen in user space.
+        relayed = n;
+    } else {
+        // Read data from server and write to client until no more data to read (or the known length is in).
+        // Whatever one read returns is forwarded at once: waiting for a full buffer would hold back slow-drip responses.
+        // A client that goes away only ends its own transaction; the response is still read if it can be cached.
+        while ((client_ok || capture) && (want = read_size(up, buf_size, relayed)) > 0) {
+            // Past MAX_OBJECT_SIZE the response will not be cached: the rest can go through the kernel only
+            if (!capture && !up->tls && (n = relay_spliced(clientfd, up, relayed, limit)) >= 0) {
+                relayed = n;
+                break;
+            }
+            // Reads land in the capture's buffers, which the client is written from and the cache adopts
+            if (capture)
+                iovcnt = iochain_reserve(capture, want, iov, RELAY_IOV);
+            else if (buf || (buf = arena_alloc(arena, RELAY_BUF_MAX)))
+                iov[0] = (struct iovec){buf, want}, iovcnt = 1;
+            else
+                iovcnt = 0;
+            if (iovcnt == 0) {
+                perror("relay buffer");
+                break;
+            }
+            if ((n = read_upstream(up, iov, iovcnt)) < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            relayed += n;
+            if (capture)
+                iovcnt = iochain_commit(capture, n, iov, iovcnt);
+            else
+                iov[0].iov_len = n;
+
+            if (client_ok) {
+                ratelimit_pace(limit, n);
+                client_ok = netio_writev(clientfd, iov, iovcnt) >= 0;
+            }
+            if (capture && capture->len > MAX_OBJECT_SIZE) {
+                iochain_release(capture); // Too large to cache.
+                capture = NULL;
+            }
+
+            // A full read means more was waiting: a bulk transfer, so read more per call
+            if (n == buf_size && buf_size < RELAY_BUF_MAX)
+                buf_size *= 2;
+        }
+        release_upstream(up, relayed);
+    }
+
+    // Hand out the captured response; a truncated capture is not a response
+    if (capture && capture->len > 0 && capture->len == relayed - stripped) {
+        iochain_trim(capture);
+        *response = capture;
+    } else if (capture) {
+        iochain_release(capture);
     }
-    ssize_t total_bytes = 0;
-
-    // Read data from server and write to client until no more data to read.
-    while ((n = Rio_readn(serverfd, buf, sizeof(buf))) > 0) {
-        // Check if the data size exceeds max object size
-        if (total_bytes + n <= MAX_OBJECT_SIZE) {
-            memcpy(tmp_buffer + total_bytes, buf, n); // Copy data to temp buffer
-            total_bytes += n;
+}
+/* $end relay_response */
+
+/*
+ * relay_spliced - Move the rest of a response that will not be cached from
+ *     a plaintext upstream to the client with splice(), never copying it
+ *     into user space. relayed is what was already passed on. Returns the
+ *     new total, or -1 if nothing could be spliced (no pipe, or a pair of
+ *     descriptors splice() does not take), in which case the caller copies.
+ */
+/* $begin relay_spliced */
+ssize_t relay_spliced(int clientfd, Upstream *up, ssize_t relayed, RateClient *limit) {
+    SplicePipe *sp = splice_open();
+    ssize_t n, want, start = relayed;
+
+    if (!sp)
+        return -1;
+    while ((want = read_size(up, SPLICE_CHUNK, relayed)) > 0) {
+        if ((n = splice_fill(sp, up->fd, want)) <= 0) {
+            if (n < 0 && errno == EINVAL && relayed == start) {
+                splice_close(sp);
+                return -1;
+            }
+            if (n < 0)
+                netio_error(0);
+            break;
         }
+        relayed += n;
+        ratelimit_pace(limit, n);
+        if (splice_drain(sp, clientfd) < 0) {
+            netio_error(1);
+            break; // Nobody to cache it for either: drop the rest with the upstream.
+        }
+    }
+    splice_close(sp);
+    splice_note_response(relayed - start);
+    return relayed;
+}
+/* $end relay_spliced */
+
+/* Read what the upstream has into iov, through TLS if it has it (TLS fills only the first buffer: a record fits in one) */
+ssize_t read_upstream(Upstream *up, struct iovec *iov, int iovcnt) {
+    ssize_t rc;
+
+    if (up->tls)
+        return tls_read(up->tls, iov[0].iov_base, iov[0].iov_len);
+    if ((rc = readv(up->fd, iov, iovcnt)) < 0 && errno != EINTR)
+        netio_error(0);
+    return rc;
+}
 
-        Rio_writen(clientfd, buf, n);
+/* Give up the upstream once its response is read: parent and TLS connections are kept if all of it was */
+void release_upstream(Upstream *up, ssize_t relayed) {
+    if (up->tls)
+        tls_release(up->tls, relayed == up->expect);
+    else if (up->parent)
+        parent_release(up->parent, up->fd, relayed == up->expect);
+    else
+        upstream_close(up->fd);
+}
+
+static int64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/*
+ * relay_buffered - Buffering mode (-B). Read the origin as fast as it sends
+ *     into a spool and pass data on only as fast as the client (and its byte
+ *     rate) takes it, using non-blocking sends. At EOF the upstream is
+ *     released and the client drains the rest of the spool. Reads land in
+ *     *capture while the response may be cached (it is released and set to
+ *     NULL once it cannot be). relayed is what was already passed on. Returns
+ *     the new total.
+ */
+/* $begin relay_buffered */
+ssize_t relay_buffered(int clientfd, Upstream *up, ssize_t relayed, IoChain **capture, RateClient *limit) {
+    char buf[MAXBUF];
+    struct iovec iov[RELAY_IOV];
+    struct pollfd fds[2];
+    Spool spool;
+    ssize_t n, want;
+    size_t stored;
+    int i, iovcnt, nfds, timeout, origin_open = relayed != up->expect, client_ok = 1;
+    int64_t now, resume_us = 0; // Client writes are paced until resume_us.
+
+    spool_init(&spool);
+    while (origin_open) {
+        fds[0].fd = up->fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = clientfd;
+        fds[1].events = POLLOUT;
+        nfds = 1;
+        timeout = -1;
+        if (client_ok && spool_pending(&spool) > 0) {
+            if ((now = now_us()) >= resume_us)
+                nfds = 2;
+            else
+                timeout = (resume_us - now + 999) / 1000;
+        }
+        int decrypted = up->tls && tls_pending(up->tls) > 0; // Already read from the socket, so poll cannot see it.
+        if (decrypted)
+            timeout = 0;
+
+        if (poll(fds, nfds, timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        if (fds[0].revents || decrypted) {
+            want = read_size(up, sizeof(buf), relayed);
+            if (!*capture || (iovcnt = iochain_reserve(*capture, want, iov, RELAY_IOV)) == 0)
+                iov[0] = (struct iovec){buf, want}, iovcnt = 1;
+            if ((n = read_upstream(up, iov, iovcnt)) < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                origin_open = 0;
+            } else {
+                if ((relayed += n) == up->expect)
+                    origin_open = 0;
+                if (iov[0].iov_base == buf)
+                    iov[0].iov_len = n;
+                else
+                    iovcnt = iochain_commit(*capture, n, iov, iovcnt);
+                for (i = 0; client_ok && i < iovcnt; i++) {
+                    if ((stored = spool_append(&spool, iov[i].iov_base, iov[i].iov_len)) < iov[i].iov_len) {
+                        /* Could not spill: fall back to a blocking write of what we hold */
+                        while (spool_pending(&spool) > 0 && spool_send(&spool, clientfd, SPOOL_CHUNK, MSG_NOSIGNAL) > 0)
+                            ;
+                        if (spool_pending(&spool) > 0 || netio_writen(clientfd, (char *)iov[i].iov_base + stored, iov[i].iov_len - stored) < 0)
+                            client_ok = 0;
+                    }
+                }
+                if (*capture && ((*capture)->len > MAX_OBJECT_SIZE || iov[0].iov_base == buf)) {
+                    iochain_release(*capture); // Too large to cache (or a read missed it).
+                    *capture = NULL;
+                }
+            }
+        }
+
+        if (nfds == 2 && fds[1].revents) {
+            if ((n = spool_send(&spool, clientfd, SPOOL_CHUNK, MSG_DONTWAIT | MSG_NOSIGNAL)) > 0)
+                resume_us = now_us() + ratelimit_charge(limit, n);
+            else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                netio_error(1);
+                client_ok = 0; // Client is gone; keep reading so the response can still be cached.
+            }
+        }
+        if (!client_ok && !*capture)
+            break; // Nobody to send to and nothing to cache: the upstream is closed, not read to the end.
     }
 
-    // Resize buffer to actual response size and assign to response_buffer
-    if (total_bytes > 0) {
-        *response_buffer = realloc(tmp_buffer, total_bytes);
-        if (!*response_buffer) {
-            free(tmp_buffer);
-            perror("realloc");
-            return;
+    /* The origin (or parent) is done with: release it before the client has drained */
+    release_upstream(up, relayed);
+    spool_note_release(&spool);
+
+    while (client_ok && spool_pending(&spool) > 0) {
+        if ((n = spool_send(&spool, clientfd, SPOOL_CHUNK, MSG_NOSIGNAL)) > 0)
+            ratelimit_pace(limit, n);
+        else if (n == 0 || errno != EINTR) {
+            if (n < 0)
+                netio_error(1);
+            break;
         }
-        *response_size = total_bytes;
-    } else {
-        free(tmp_buffer);
     }
+    spool_free(&spool);
+    return relayed;
 }
-/* $end relay_response */
+/* $end relay_buffered */
 
 /* $begin clienterror */
 // returns an error message to the client
@@ -267,80 +894,124 @@ void clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longms
     body_length += snprintf(body + body_length, sizeof(body) - body_length, "<p>%s: %s\r\n", longmsg, cause);
     body_length += snprintf(body + body_length, sizeof(body) - body_length, "<hr><em>The Tiny Web server</em>\r\n");
 
-    /* Print the HTTP response updated to not use sprintf repeatedly (violation of C99) */
-    snprintf(buf, sizeof(buf), "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-
-    snprintf(buf, sizeof(buf), "Content-type: text/html\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-
-    snprintf(buf, sizeof(buf), "Content-length: %d\r\n\r\n", body_length);
-    Rio_writen(fd, buf, strlen(buf));
-
-    Rio_writen(fd, body, body_length);
+    /* Print the HTTP response updated to not use sprintf repeatedly (violation of C99); head and body go out in one write */
+    int head_length = snprintf(buf, sizeof(buf), "HTTP/1.0 %s %s\r\nContent-type: text/html\r\nContent-length: %d\r\n\r\n", errnum, shortmsg,
+                               body_length);
+    struct iovec iov[2] = {{buf, head_length}, {body, body_length}};
+    netio_writev(fd, iov, 2);
 }
 /* $end clienterror */
 
-/* $start thread_function */
-// handles clinet communication
-void *thread_function(void *arg) {
-    int connfd = *((int *)arg);
-    free(arg); // Free the dynamically allocated memory for the file descriptor.
-
-    pthread_detach(pthread_self()); // Detach the thread to ensure resources are reclaimed when the thread finishes.
-    doit(connfd);
-    Close(connfd);
-    return NULL;
+/* $begin serve_stats */
+// returns the proxy's internal counters to the client as text/plain
+void serve_stats(int fd) {
+    char buf[MAXLINE], body[MAXBUF * 8];
+    int body_length = 0;
+
+    body_length += engine_stats(body + body_length, sizeof(body) - body_length);
+    body_length += cache_stats(body + body_length, sizeof(body) - body_length);
+    body_length += listener_stats(body + body_length, sizeof(body) - body_length);
+    body_length += netio_stats(body + body_length, sizeof(body) - body_length);
+    body_length += upstream_stats(body + body_length, sizeof(body) - body_length);
+    body_length += preconnect_stats(body + body_length, sizeof(body) - body_length);
+    body_length += hedge_stats(body + body_length, sizeof(body) - body_length);
+    body_length += retry_stats(body + body_length, sizeof(body) - body_length);
+    body_length += ratelimit_stats(body + body_length, sizeof(body) - body_length);
+    body_length += cluster_stats(body + body_length, sizeof(body) - body_length);
+    body_length += backend_stats(body + body_length, sizeof(body) - body_length);
+    body_length += parent_stats(body + body_length, sizeof(body) - body_length);
+    body_length += purge_stats(body + body_length, sizeof(body) - body_length);
+    body_length += tls_stats(body + body_length, sizeof(body) - body_length);
+    body_length += h2_stats(body + body_length, sizeof(body) - body_length);
+    body_length += front_stats(body + body_length, sizeof(body) - body_length);
+    body_length += spool_stats(body + body_length, sizeof(body) - body_length);
+    body_length += splice_stats(body + body_length, sizeof(body) - body_length);
+    body_length += zerocopy_stats(body + body_length, sizeof(body) - body_length);
+    body_length += arena_stats(body + body_length, sizeof(body) - body_length);
+    body_length += iobuf_stats(body + body_length, sizeof(body) - body_length);
+
+    int head_length = snprintf(buf, sizeof(buf), "HTTP/1.0 200 OK\r\nContent-type: text/plain\r\nContent-length: %d\r\n\r\n", body_length);
+    struct iovec iov[2] = {{buf, head_length}, {body, body_length}};
+    netio_writev(fd, iov, 2);
 }
-/* $end thread_function */
-
-/* $start cache_init */
-void cache_init(Cache *cache) {
-    cache->head = NULL;
-    cache->total_size = 0;
-    pthread_mutex_init(&cache->lock, NULL);
-}
-/* $end cache_init */
-
-/* $start cache_search */
-CachedItem *cache_search(Cache *cache, char *uri) {
-    CachedItem *current = cache->head;
+/* $end serve_stats */
 
-    while (current) {
-        if (strcmp(uri, current->uri) == 0) {
-            return current;
-        }
-        current = current->next;
-    }
-    return NULL;
-}
-/* $end cache_search */
+/* $begin serve_purge */
+// purges uri from this node and its peers; 200 if something was cached here, else 404. The client's address is taken from peer_fd
+void serve_purge(int fd, int peer_fd, char *uri) {
+    char buf[MAXLINE], body[MAXLINE];
+    int body_length, purged;
 
-/* $start cache_add */
-void cache_add(Cache *cache, char *uri, char *response, int size) {
-    // If object is too big for the cache, ignore it.
-    if (size > MAX_CACHE_SIZE) {
+    if (!purge_allowed(peer_fd)) {
+        clienterror(fd, uri, "403", "Forbidden", "PURGE is only accepted from this host");
         return;
     }
-
-    // Remove oldest items from cache until we have enough space.
-    while (cache->total_size + size > MAX_CACHE_SIZE) {
-        CachedItem *oldest = cache->head;
-        cache->head = oldest->next;
-        cache->total_size -= oldest->size;
-        free(oldest->uri);
-        free(oldest->response);
-        free(oldest);
-    }
-
-    // Create new cache item.
-    CachedItem *new_item = malloc(sizeof(CachedItem));
-    new_item->uri = strdup(uri);
-    new_item->response = malloc(size);
-    memcpy(new_item->response, response, size);
-    new_item->size = size;
-    new_item->next = cache->head;
-    cache->head = new_item;
-    cache->total_size += size;
+    purged = purge_apply(uri);
+    printf("Purged %s: %d objects\n", uri, purged);
+
+    body_length = snprintf(body, sizeof(body), "purged %d\n", purged);
+    int head_length = snprintf(buf, sizeof(buf), "HTTP/1.0 %s\r\nContent-type: text/plain\r\nContent-length: %d\r\n\r\n",
+                               purged ? "200 OK" : "404 Not Found", body_length);
+    struct iovec iov[2] = {{buf, head_length}, {body, body_length}};
+    netio_writev(fd, iov, 2);
+}
+/* $end serve_purge */
+
+/* $begin serve_stream */
+// h2 handler: serves one h2c stream, whose request arrives as an HTTP/1.0 head, as if it had its own connection
+void serve_stream(int fd, char *request, size_t len, void *arg) {
+    ClientConn *client = arg;
+    ClientConn *conn = malloc(sizeof(ClientConn));
+
+    conn->fd = fd;
+    conn->limit = client->limit; // Streams count against the client's request rate, not its connections
+    conn->peer_fd = client->peer_fd; // Open until every stream has ended
+    memcpy(conn->head, request, len);
+    conn->head_len = len;
+    doit(conn);
+    free(conn);
+}
+/* $end serve_stream */
+
+/* $begin usage */
+void usage(char *prog) {
+    fprintf(stderr, "usage: %s [options] <port>\n", prog);
+    fprintf(stderr, "  -s ip[,ip...]  source addresses for upstream connections\n");
+    fprintf(stderr, "  -r lo-hi       local port range allocated per origin (default: kernel ephemeral ports)\n");
+    fprintf(stderr, "  -c strategy    upstream close strategy: default, origin, reset\n");
+    fprintf(stderr, "  -W n           pre-connect to hot origins, at most n speculative sockets\n");
+    fprintf(stderr, "  -H pct         hedge GET misses not answered within the pct percentile of latency\n");
+    fprintf(stderr, "  -E o=r[,r...]  replicas (host:port) to hedge origin o (host:port) to; repeatable\n");
+    fprintf(stderr, "  -N host:port[,...]  cluster members (inter-node addresses); -I names this node\n");
+    fprintf(stderr, "  -I host:port   this node's entry in the -N list\n");
+    fprintf(stderr, "  -R host:port[,...]  reverse-proxy origin-form requests to this backend pool\n");
+    fprintf(stderr, "  -P host:port[=w][,...]  send misses to these parent proxies (weight w, default 1)\n");
+    fprintf(stderr, "  -K file|none   CA bundle for verifying https:// origins (default: system store)\n");
+    fprintf(stderr, "  -V [host:]port[,peer...]  receive purges from peers on this UDP address (or path) and fan them out to them\n");
+    fprintf(stderr, "  -A keyfile     sign purges to and from -V peers with this shared secret (HMAC-SHA256)\n");
+    fprintf(stderr, "  -u path        also listen on a Unix-domain socket at path\n");
+    fprintf(stderr, "  -U host:port=/path[,...]  reach these origins over Unix-domain sockets\n");
+    fprintf(stderr, "  -T ms          deadline for a complete request head (default %d; 0 = workers read heads)\n", FRONT_DEADLINE_MS);
+    fprintf(stderr, "  -B bytes       buffer responses so origins are released early; spill to disk past bytes (k/m)\n");
+    fprintf(stderr, "  -L limits      per-client-IP limits: conns=N,rps=R,bps=B (any subset)\n");
+    fprintf(stderr, "  -2             accept cleartext HTTP/2 (h2c) by prior knowledge or Upgrade\n");
+    fprintf(stderr, "  -Z bytes       send cache hits of at least bytes (k) with MSG_ZEROCOPY\n");
+    fprintf(stderr, "  -e engine      thread (one per connection, default) or pool[:n] (n workers, default %d)\n", ENGINE_POOL_THREADS);
+    fprintf(stderr, "  -k cache       list (FIFO, linear search, default) or lru (hashed, least recently used out)\n");
+    fprintf(stderr, "  -C             one listener and pinned acceptor per CPU, steered by BPF (not with -e pool)\n");
+    exit(1);
+}
+/* $end usage */
+
+/* $start serve_conn */
+// engine handler: serves a client connection on a worker thread
+void serve_conn(void *arg) {
+    ClientConn *conn = arg;
+
+    listener_note_cpu(conn->fd);
+    doit(conn);
+    Close(conn->fd);
+    ratelimit_disconnect(conn->limit);
+    free(conn); // Free the dynamically allocated memory for the connection.
 }
-/* $end cache_add */
\ No newline at end of file
+/* $end serve_conn */
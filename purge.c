@@ -0,0 +1,377 @@
+/*
+ * purge.c - Invalidating cached objects on every proxy node
+ */
+#include "purge.h"
+#include "stats.h"
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <stdint.h>
+#include <time.h>
+
+typedef struct Peer {
+    char name[MAXLINE];            // host:port or path, as configured.
+    int fd;                        // Unbound datagram socket of the peer's family.
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+} Peer;
+
+typedef struct MessageId {
+    uint64_t node;
+    unsigned long seq;
+} MessageId;
+
+static char listen_spec[MAXLINE];
+static unsigned char key[PURGE_KEY_MAX]; // Shared secret purges are signed with (-A); none if key_len is 0.
+static size_t key_len = 0;
+static Peer peers[MAX_PURGE_PEERS];
+static int npeers = 0;
+static uint64_t node_id;
+static unsigned long next_seq;
+static purge_fn_t purge_fn;
+static MessageId seen[PURGE_SEEN]; // Ring of recent ids; only the receiver thread touches it.
+static int seen_next = 0;
+
+static unsigned long local_purges, objects_purged, sent, send_errors, received, duplicates, malformed, not_peer, bad_mac, recv_errors;
+
+/* $begin purge_configure */
+int purge_configure(char *spec) {
+    char copy[MAXLINE], *tok, *save;
+
+    snprintf(copy, sizeof(copy), "%s", spec);
+    if (!(tok = strtok_r(copy, ",", &save))) {
+        fprintf(stderr, "purge: expected port-or-path[,peer,...]\n");
+        return -1;
+    }
+    snprintf(listen_spec, sizeof(listen_spec), "%s", tok);
+    while ((tok = strtok_r(NULL, ",", &save))) {
+        if (npeers == MAX_PURGE_PEERS) {
+            fprintf(stderr, "purge: at most %d peers\n", MAX_PURGE_PEERS);
+            return -1;
+        }
+        if (!strchr(tok, '/') && !strrchr(tok, ':')) {
+            fprintf(stderr, "purge: bad peer %s (expected host:port or a path)\n", tok);
+            return -1;
+        }
+        snprintf(peers[npeers++].name, MAXLINE, "%s", tok);
+    }
+    return 0;
+}
+/* $end purge_configure */
+
+/* $begin purge_set_key */
+int purge_set_key(char *path) {
+    FILE *fp = fopen(path, "r");
+    size_t n;
+
+    if (!fp) {
+        fprintf(stderr, "purge: cannot read key file %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    n = fread(key, 1, sizeof(key), fp);
+    fclose(fp);
+    while (n > 0 && (key[n - 1] == '\n' || key[n - 1] == '\r'))
+        n--;
+    if (n < PURGE_KEY_MIN) {
+        fprintf(stderr, "purge: key in %s is shorter than %d bytes\n", path, PURGE_KEY_MIN);
+        return -1;
+    }
+    key_len = n;
+    return 0;
+}
+/* $end purge_set_key */
+
+/* HMAC-SHA256 of "<node> <seq> <pattern>" under the key, in hex */
+static void sign(unsigned long long node, unsigned long seq, char *pattern, char *hex) {
+    char text[MAXLINE + 64];
+    unsigned char mac[EVP_MAX_MD_SIZE];
+    unsigned int i, maclen = 0;
+    int len = snprintf(text, sizeof(text), "%llx %lu %s", node, seq, pattern);
+
+    HMAC(EVP_sha256(), key, key_len, (unsigned char *)text, len, mac, &maclen);
+    for (i = 0; i < maclen; i++)
+        sprintf(hex + 2 * i, "%02x", mac[i]);
+    hex[2 * maclen] = '\0';
+}
+
+/*
+ * resolve - Fill in a peer's address and open a datagram socket for it.
+ *     A name with a '/' is a Unix-domain path, anything else host:port.
+ */
+static int resolve(Peer *p) {
+    struct addrinfo hints, *res;
+    char host[MAXLINE], *colon;
+    int rc;
+
+    if (strchr(p->name, '/')) {
+        struct sockaddr_un *un = (struct sockaddr_un *)&p->addr;
+        if (strlen(p->name) >= sizeof(un->sun_path))
+            return -1;
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, p->name);
+        p->addrlen = sizeof(struct sockaddr_un);
+    } else {
+        snprintf(host, sizeof(host), "%s", p->name);
+        colon = strrchr(host, ':');
+        *colon = '\0';
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_socktype = SOCK_DGRAM;
+        hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+        if ((rc = getaddrinfo(host, colon + 1, &hints, &res)) != 0) {
+            fprintf(stderr, "purge: cannot resolve %s: %s\n", p->name, gai_strerror(rc));
+            return -1;
+        }
+        memcpy(&p->addr, res->ai_addr, res->ai_addrlen);
+        p->addrlen = res->ai_addrlen;
+        freeaddrinfo(res);
+    }
+    return (p->fd = socket(p->addr.ss_family, SOCK_DGRAM, 0));
+}
+
+/*
+ * open_receiver - The socket purges from peers arrive on: a Unix-domain
+ *     path, or a UDP host:port. A bare port binds loopback only; nodes on
+ *     other hosts name the local address to listen on.
+ */
+static int open_receiver(char *spec) {
+    struct addrinfo hints, *res;
+    char host[MAXLINE], *port = spec;
+    int fd;
+
+    if (strchr(spec, '/')) {
+        struct sockaddr_un addr;
+        struct stat sb;
+        if (strlen(spec) >= sizeof(addr.sun_path) || (fd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0)
+            return -1;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, spec);
+        if (lstat(spec, &sb) == 0 && S_ISSOCK(sb.st_mode))
+            unlink(spec);
+        if (bind(fd, (SA *)&addr, sizeof(addr)) < 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    snprintf(host, sizeof(host), "%s", "localhost");
+    if (strrchr(spec, ':')) {
+        snprintf(host, sizeof(host), "%s", spec);
+        *strrchr(host, ':') = '\0';
+        port = strrchr(spec, ':') + 1;
+    }
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    if (getaddrinfo(host, port, &hints, &res) != 0)
+        return -1;
+    if ((fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol)) >= 0 && bind(fd, res->ai_addr, res->ai_addrlen) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+/* Remember id; returns 1 if it was already among the recent ones */
+static int seen_before(uint64_t node, unsigned long seq) {
+    int i;
+
+    for (i = 0; i < PURGE_SEEN; i++)
+        if (seen[i].node == node && seen[i].seq == seq)
+            return 1;
+    seen[seen_next].node = node;
+    seen[seen_next].seq = seq;
+    seen_next = (seen_next + 1) % PURGE_SEEN;
+    return 0;
+}
+
+/* Apply a pattern: a trailing '*' makes it a prefix */
+static int apply_local(char *pattern) {
+    size_t len = strlen(pattern);
+    int prefix = len > 0 && pattern[len - 1] == '*', n;
+
+    if (prefix)
+        pattern[len - 1] = '\0';
+    n = purge_fn(pattern, prefix);
+    if (prefix)
+        pattern[len - 1] = '*';
+    STAT_ADD(objects_purged, n);
+    return n;
+}
+
+/* An IP address as IPv6, IPv4 ones mapped, so a dual-stack socket compares equal to a peer's IPv4 address */
+static void host_of(struct sockaddr_storage *addr, struct in6_addr *host) {
+    if (addr->ss_family == AF_INET6) {
+        *host = ((struct sockaddr_in6 *)addr)->sin6_addr;
+        return;
+    }
+    memset(host, 0, sizeof(*host));
+    host->s6_addr[10] = host->s6_addr[11] = 0xff;
+    memcpy(&host->s6_addr[12], &((struct sockaddr_in *)addr)->sin_addr, 4);
+}
+
+/*
+ * from_peer - Whether a UDP datagram came from a configured peer. Peers
+ *     send from unbound sockets, so only the address is compared, not the
+ *     port.
+ */
+static int from_peer(struct sockaddr_storage *addr) {
+    struct in6_addr from, peer;
+    int i;
+
+    if (addr->ss_family != AF_INET && addr->ss_family != AF_INET6)
+        return 0;
+    host_of(addr, &from);
+    for (i = 0; i < npeers; i++) {
+        if (peers[i].addr.ss_family != AF_INET && peers[i].addr.ss_family != AF_INET6)
+            continue;
+        host_of(&peers[i].addr, &peer);
+        if (!memcmp(&from, &peer, sizeof(from)))
+            return 1;
+    }
+    return 0;
+}
+
+static void *receiver(void *arg) {
+    int fd = *((int *)arg);
+    char msg[MAXLINE + 160], mac[2 * EVP_MAX_MD_SIZE + 1], expected[2 * EVP_MAX_MD_SIZE + 1];
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    unsigned long long node;
+    unsigned long seq;
+    ssize_t n;
+    int off, backoff_ms = 0;
+    int local = strchr(listen_spec, '/') != NULL; // Unix-domain senders are local processes the socket file's permissions let in.
+
+    free(arg);
+    pthread_detach(pthread_self());
+    while (1) {
+        addrlen = sizeof(addr);
+        if ((n = recvfrom(fd, msg, sizeof(msg) - 1, 0, (SA *)&addr, &addrlen)) < 0) {
+            if (errno == EINTR)
+                continue;
+            /* A persistent error must not spin: back off as the accept loop does */
+            STAT_INC(recv_errors);
+            backoff_ms = backoff_ms ? backoff_ms * 2 : PURGE_BACKOFF_MIN_MS;
+            if (backoff_ms > PURGE_BACKOFF_MAX_MS)
+                backoff_ms = PURGE_BACKOFF_MAX_MS;
+            usleep(backoff_ms * 1000);
+            continue;
+        }
+        backoff_ms = 0;
+        msg[n] = '\0';
+        STAT_INC(received);
+        if (!local && !from_peer(&addr)) {
+            STAT_INC(not_peer);
+            continue;
+        }
+        if (sscanf(msg, "PURGE %llx %lu %128s %n", &node, &seq, mac, &off) != 3 || !msg[off]) {
+            STAT_INC(malformed);
+            continue;
+        }
+        if (key_len > 0) {
+            sign(node, seq, msg + off, expected);
+            if (strlen(mac) != strlen(expected) || CRYPTO_memcmp(mac, expected, strlen(expected))) {
+                STAT_INC(bad_mac); // Unsigned, or signed with another key: a source address alone proves nothing.
+                continue;
+            }
+        }
+        if (node == node_id || seen_before(node, seq)) {
+            STAT_INC(duplicates);
+            continue;
+        }
+        apply_local(msg + off);
+    }
+    return NULL;
+}
+
+/* $begin purge_init */
+void purge_init(purge_fn_t purge) {
+    pthread_t tid;
+    int i;
+
+    purge_fn = purge; // PURGE works locally even without peers.
+    if (!listen_spec[0])
+        return;
+    srandom(time(NULL) ^ getpid());
+    node_id = ((uint64_t)random() << 32) ^ random();
+
+    for (i = 0; i < npeers; i++) {
+        if (resolve(&peers[i]) < 0) {
+            fprintf(stderr, "purge: cannot reach peer %s\n", peers[i].name);
+            exit(1);
+        }
+    }
+    int *fd = malloc(sizeof(int));
+    if ((*fd = open_receiver(listen_spec)) < 0) {
+        fprintf(stderr, "purge: cannot listen on %s: %s\n", listen_spec, strerror(errno));
+        exit(1);
+    }
+    Pthread_create(&tid, NULL, receiver, fd);
+    printf("Purges: listening on %s, %d peers\n", listen_spec, npeers);
+    if (!key_len && !strchr(listen_spec, '/'))
+        fprintf(stderr, "purge: datagrams are not signed (no -A): run -V on a trusted network only\n");
+}
+/* $end purge_init */
+
+/* $begin purge_allowed */
+int purge_allowed(int fd) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+
+    if (getpeername(fd, (SA *)&addr, &len) < 0)
+        return 0;
+    if (addr.ss_family == AF_UNIX)
+        return 1;
+    if (addr.ss_family == AF_INET)
+        return (ntohl(((struct sockaddr_in *)&addr)->sin_addr.s_addr) >> 24) == 127;
+    if (addr.ss_family == AF_INET6) {
+        struct in6_addr *a = &((struct sockaddr_in6 *)&addr)->sin6_addr;
+        return IN6_IS_ADDR_LOOPBACK(a) || (IN6_IS_ADDR_V4MAPPED(a) && a->s6_addr[12] == 127);
+    }
+    return 0;
+}
+/* $end purge_allowed */
+
+/* $begin purge_apply */
+int purge_apply(char *pattern) {
+    char msg[MAXLINE + 160], mac[2 * EVP_MAX_MD_SIZE + 1] = "-";
+    unsigned long seq;
+    int i, copy, n, len;
+
+    STAT_INC(local_purges);
+    n = apply_local(pattern);
+    if (!listen_spec[0])
+        return n;
+
+    seq = STAT_INC(next_seq);
+    if (key_len > 0)
+        sign(node_id, seq, pattern, mac);
+    len = snprintf(msg, sizeof(msg), "PURGE %llx %lu %s %s", (unsigned long long)node_id, seq, mac, pattern);
+    for (copy = 0; copy < PURGE_COPIES; copy++) {
+        for (i = 0; i < npeers; i++) {
+            if (sendto(peers[i].fd, msg, len, MSG_DONTWAIT, (SA *)&peers[i].addr, peers[i].addrlen) == len)
+                STAT_INC(sent);
+            else
+                STAT_INC(send_errors);
+        }
+    }
+    return n;
+}
+/* $end purge_apply */
+
+/* $begin purge_stats */
+int purge_stats(char *buf, size_t size) {
+    int len = 0;
+
+    len += snprintf(buf + len, size - len, "purge.peers %d\npurge.local %lu\npurge.objects %lu\n", npeers, STAT_GET(local_purges),
+                    STAT_GET(objects_purged));
+    len += snprintf(buf + len, size - len, "purge.sent %lu\npurge.send_errors %lu\npurge.received %lu\npurge.duplicates %lu\npurge.malformed %lu\n",
+                    STAT_GET(sent), STAT_GET(send_errors), STAT_GET(received), STAT_GET(duplicates), STAT_GET(malformed));
+    len += snprintf(buf + len, size - len, "purge.signed %s\npurge.not_peer %lu\npurge.bad_mac %lu\npurge.recv_errors %lu\n", key_len ? "yes" : "no",
+                    STAT_GET(not_peer), STAT_GET(bad_mac), STAT_GET(recv_errors));
+    return len < size ? len : size - 1;
+}
+/* $end purge_stats */
@@ -0,0 +1,63 @@
+/*
+ * purge.h - Invalidating cached objects on every proxy node
+ *
+ * Each node keeps its own copy of hot objects, so fixing stale content used
+ * to mean restarting every node and losing every cache. A PURGE request
+ * for a URI (or, ending in '*', for every URI with that prefix) now drops
+ * the objects locally and fans the purge out to the peers listed with -V
+ * as datagrams: UDP to host:port peers, Unix-domain datagram sockets to
+ * peers given as paths. Peers apply it without forwarding it further, so
+ * a purge reaches the whole (full-mesh) peer list in one hop.
+ *
+ * The UDP receiver binds the address given with -V (loopback for a bare
+ * port) and only accepts datagrams whose source address is one of the
+ * peers; anything else is counted and dropped, since a purge from any
+ * host could otherwise empty every node's cache. A UDP source address is
+ * easily forged, though, so nodes that share a secret (-A keyfile) sign
+ * each message with HMAC-SHA256 over its id and pattern, and receivers
+ * drop any message without the right signature. Without -A, -V belongs on
+ * a trusted network only.
+ *
+ * Datagrams can be lost, so each purge is sent PURGE_COPIES times; every
+ * message carries the sender's random node id and a sequence number, and
+ * receivers drop ids they have seen among the last PURGE_SEEN.
+ *
+ *   "PURGE <node> <seq> <hmac hex, or - unsigned> <uri>[*]"
+ */
+/* $begin purge.h */
+#ifndef __PURGE_H__
+#define __PURGE_H__
+
+#include "csapp.h"
+
+#define MAX_PURGE_PEERS 32
+#define PURGE_COPIES 2  /* Times each purge is sent to each peer */
+#define PURGE_SEEN 1024 /* Recent message ids remembered for deduplication */
+#define PURGE_BACKOFF_MIN_MS 1    /* Backoff while the receiving socket keeps failing */
+#define PURGE_BACKOFF_MAX_MS 1000
+#define PURGE_KEY_MIN 16  /* Shortest shared secret -A accepts */
+#define PURGE_KEY_MAX 256 /* Bytes of the key file used */
+
+/* Drop uri from the cache (every uri starting with it if prefix); returns how many objects went */
+typedef int (*purge_fn_t)(char *uri, int prefix);
+
+/* "[host:]port-or-path[,peer,...]": where this node listens, then the peers (host:port or path) */
+int purge_configure(char *spec);
+
+/* Sign and check peer purges with the secret in path (-A) */
+int purge_set_key(char *path);
+
+/* Set the cache hook, resolve peers and start listening for purges; call once after option parsing */
+void purge_init(purge_fn_t purge);
+
+/* Only loopback and Unix-domain clients may send PURGE */
+int purge_allowed(int fd);
+
+/* Purge pattern locally and on every peer; returns the number of objects dropped here */
+int purge_apply(char *pattern);
+
+/* Write a plain-text report of purge traffic into buf */
+int purge_stats(char *buf, size_t size);
+
+#endif /* __PURGE_H__ */
+/* $end purge.h */
@@ -0,0 +1,218 @@
+/*
+ * ratelimit.c - Per-client connection caps and token-bucket rate limits
+ */
+#include "ratelimit.h"
+#include "stats.h"
+#include <time.h>
+
+static RateClient table[RATELIMIT_SLOTS];
+static int max_conns = 0;  // 0 = no cap
+static double max_rps = 0; // 0 = no request limit
+static double max_bps = 0; // 0 = no byte limit
+
+static unsigned long rejected_conns, rejected_requests, paced_ms, table_full, reclaimed;
+
+static int64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static int enabled(void) { return max_conns || max_rps > 0 || max_bps > 0; }
+
+/* $begin ratelimit_configure */
+int ratelimit_configure(char *spec) {
+    char copy[MAXLINE], *tok, *save;
+    double value;
+
+    snprintf(copy, sizeof(copy), "%s", spec);
+    for (tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        char *eq = strchr(tok, '=');
+        if (!eq || (value = atof(eq + 1)) <= 0) {
+            fprintf(stderr, "ratelimit: bad limit %s (expected conns=N, rps=R or bps=B)\n", tok);
+            return -1;
+        }
+        *eq = '\0';
+        if (!strcmp(tok, "conns"))
+            max_conns = (int)value;
+        else if (!strcmp(tok, "rps"))
+            max_rps = value;
+        else if (!strcmp(tok, "bps"))
+            max_bps = value;
+        else {
+            fprintf(stderr, "ratelimit: unknown limit %s\n", tok);
+            return -1;
+        }
+    }
+    return 0;
+}
+/* $end ratelimit_configure */
+
+/* FNV-1a over the client's IP address (not its port) */
+static uint64_t client_key(SA *addr) {
+    unsigned char *p;
+    size_t i, len;
+    uint64_t h = 14695981039346656037ULL;
+
+    if (addr->sa_family == AF_INET) {
+        p = (unsigned char *)&((struct sockaddr_in *)addr)->sin_addr;
+        len = sizeof(struct in_addr);
+    } else if (addr->sa_family == AF_INET6) {
+        p = (unsigned char *)&((struct sockaddr_in6 *)addr)->sin6_addr;
+        len = sizeof(struct in6_addr);
+    } else {
+        return 1; /* Unix-domain and other peers share one slot */
+    }
+    for (i = 0; i < len; i++)
+        h = (h ^ p[i]) * 1099511628211ULL;
+    return h ? h : 1;
+}
+
+/* Find or claim the slot for key without locking */
+static RateClient *lookup(uint64_t key) {
+    int i;
+    uint64_t idx = key & (RATELIMIT_SLOTS - 1), expected;
+    int64_t now = now_us();
+
+    for (i = 0; i < RATELIMIT_PROBES; i++) {
+        RateClient *c = &table[(idx + i) & (RATELIMIT_SLOTS - 1)];
+        expected = __atomic_load_n(&c->key, __ATOMIC_ACQUIRE);
+        if (expected == 0 && __atomic_compare_exchange_n(&c->key, &expected, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return c;
+        if (expected == key)
+            return c;
+    }
+
+    /* Probe window full: take over a slot whose client has gone quiet */
+    for (i = 0; i < RATELIMIT_PROBES; i++) {
+        RateClient *c = &table[(idx + i) & (RATELIMIT_SLOTS - 1)];
+        expected = __atomic_load_n(&c->key, __ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&c->conns, __ATOMIC_RELAXED) == 0 &&
+            __atomic_load_n(&c->last_us, __ATOMIC_RELAXED) < now - RATELIMIT_IDLE_SECS * 1000000LL &&
+            __atomic_compare_exchange_n(&c->key, &expected, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            STAT_INC(reclaimed);
+            return c;
+        }
+    }
+    STAT_INC(table_full);
+    return NULL; /* Fail open rather than refuse service */
+}
+
+/*
+ * gcra - Advance a GCRA bucket by cost microseconds of "emission time".
+ *     If reject is set and the bucket is already more than tolerance
+ *     ahead of now, nothing changes and -1 is returned. Otherwise returns
+ *     0 and sets *over to how far (us) the bucket now runs past tolerance.
+ */
+static int gcra(int64_t *tat, int64_t cost, int64_t tolerance, int reject, int64_t *over) {
+    int64_t now = now_us(), old = __atomic_load_n(tat, __ATOMIC_RELAXED), next;
+
+    do {
+        int64_t base = old > now ? old : now;
+        if (reject && base - now > tolerance)
+            return -1;
+        next = base + cost;
+    } while (!__atomic_compare_exchange_n(tat, &old, next, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    *over = next - now - tolerance;
+    return 0;
+}
+
+/* $begin ratelimit_connect */
+int ratelimit_connect(SA *addr, RateClient **client) {
+    RateClient *c;
+
+    *client = NULL;
+    if (!enabled() || !(c = lookup(client_key(addr))))
+        return 0;
+
+    __atomic_store_n(&c->last_us, now_us(), __ATOMIC_RELAXED);
+    if (__atomic_add_fetch(&c->conns, 1, __ATOMIC_RELAXED) > max_conns && max_conns) {
+        __atomic_sub_fetch(&c->conns, 1, __ATOMIC_RELAXED);
+        STAT_INC(rejected_conns);
+        return -1;
+    }
+    *client = c;
+    return 0;
+}
+/* $end ratelimit_connect */
+
+void ratelimit_disconnect(RateClient *client) {
+    if (!client)
+        return;
+    __atomic_store_n(&client->last_us, now_us(), __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&client->conns, 1, __ATOMIC_RELAXED);
+}
+
+/* $begin ratelimit_reject */
+void ratelimit_reject(int fd) {
+    static char *response = "HTTP/1.0 429 Too Many Requests\r\n"
+                            "Content-type: text/plain\r\n"
+                            "Content-length: 18\r\n"
+                            "Retry-After: 1\r\n\r\n"
+                            "Too many requests\n";
+
+    send(fd, response, strlen(response), MSG_DONTWAIT | MSG_NOSIGNAL);
+    Close(fd);
+}
+/* $end ratelimit_reject */
+
+/* $begin ratelimit_request */
+int ratelimit_request(RateClient *client) {
+    if (!client || max_rps <= 0)
+        return 0;
+
+    /* One request costs 1/rps seconds; a second's worth of requests may burst */
+    int64_t cost = 1000000 / max_rps, over;
+    if (gcra(&client->req_tat, cost, 1000000 - cost, 1, &over) < 0) {
+        STAT_INC(rejected_requests);
+        return -1;
+    }
+    return 0;
+}
+/* $end ratelimit_request */
+
+/* $begin ratelimit_charge */
+int64_t ratelimit_charge(RateClient *client, size_t n) {
+    if (!client || max_bps <= 0)
+        return 0;
+
+    /* n bytes cost n/bps seconds; a second's worth of bytes may burst */
+    int64_t over;
+    gcra(&client->byte_tat, (int64_t)(n * 1000000.0 / max_bps), 1000000, 0, &over);
+    if (over <= 0)
+        return 0;
+    STAT_ADD(paced_ms, over / 1000);
+    return over;
+}
+/* $end ratelimit_charge */
+
+/* $begin ratelimit_pace */
+void ratelimit_pace(RateClient *client, size_t n) {
+    int64_t over = ratelimit_charge(client, n);
+
+    if (over > 0)
+        usleep(over);
+}
+/* $end ratelimit_pace */
+
+/* $begin ratelimit_stats */
+int ratelimit_stats(char *buf, size_t size) {
+    int i, len = 0, clients = 0, conns = 0;
+
+    len += snprintf(buf + len, size - len, "ratelimit.max_conns %d\nratelimit.max_rps %.1f\nratelimit.max_bps %.0f\n", max_conns, max_rps, max_bps);
+    if (!enabled())
+        return len;
+
+    for (i = 0; i < RATELIMIT_SLOTS; i++) {
+        if (__atomic_load_n(&table[i].key, __ATOMIC_RELAXED)) {
+            clients++;
+            conns += __atomic_load_n(&table[i].conns, __ATOMIC_RELAXED);
+        }
+    }
+    len += snprintf(buf + len, size - len, "ratelimit.clients %d\nratelimit.conns %d\n", clients, conns);
+    len += snprintf(buf + len, size - len, "ratelimit.rejected_conns %lu\nratelimit.rejected_requests %lu\nratelimit.paced_ms %lu\n",
+                    STAT_GET(rejected_conns), STAT_GET(rejected_requests), STAT_GET(paced_ms));
+    len += snprintf(buf + len, size - len, "ratelimit.table_full %lu\nratelimit.reclaimed %lu\n", STAT_GET(table_full), STAT_GET(reclaimed));
+    return len < size ? len : size - 1;
+}
+/* $end ratelimit_stats */
@@ -0,0 +1,58 @@
+/*
+ * ratelimit.h - Per-client connection caps and token-bucket rate limits
+ *
+ * One aggressive client can open unlimited connections and monopolize
+ * threads and origin bandwidth. Each client IP gets a slot with:
+ *   - a connection count, capped at accept time (fast 429, no thread)
+ *   - a request bucket, checked once per request (429 when empty)
+ *   - a byte bucket, which paces the relay instead of rejecting
+ *
+ * Buckets use GCRA: one "theoretical arrival time" per bucket, updated
+ * with compare-and-swap, so no lock is taken on the hot path. Slots live
+ * in a fixed open-addressing table claimed by CAS on the key; a slot whose
+ * client has been idle for RATELIMIT_IDLE_SECS can be taken over, and a
+ * stale arrival time is simply in the past, so no reset is needed.
+ */
+/* $begin ratelimit.h */
+#ifndef __RATELIMIT_H__
+#define __RATELIMIT_H__
+
+#include "csapp.h"
+#include <stdint.h>
+
+#define RATELIMIT_SLOTS 4096    /* Power of two */
+#define RATELIMIT_PROBES 16     /* Linear probes before giving up */
+#define RATELIMIT_IDLE_SECS 60  /* Idle clients' slots may be reclaimed */
+
+typedef struct RateClient {
+    uint64_t key;      // Hash of the client IP; 0 if the slot is free.
+    int conns;         // Open connections from this client.
+    int64_t req_tat;   // GCRA arrival time for the request bucket (us).
+    int64_t byte_tat;  // GCRA arrival time for the byte bucket (us).
+    int64_t last_us;   // Last activity, for reclaiming the slot.
+} __attribute__((aligned(64))) RateClient;
+
+/* Parse "conns=N,rps=R,bps=B" (any subset); limits are off until called */
+int ratelimit_configure(char *spec);
+
+/* At accept time: find the client's slot and count the connection. Returns -1 if over the cap. */
+int ratelimit_connect(SA *addr, RateClient **client);
+void ratelimit_disconnect(RateClient *client);
+
+/* Send a 429 to a connection refused at accept time and close it */
+void ratelimit_reject(int fd);
+
+/* Per request: 0 if allowed, -1 if the client is over its request rate */
+int ratelimit_request(RateClient *client);
+
+/* Before relaying n bytes to the client: sleep as needed to stay under its byte rate */
+void ratelimit_pace(RateClient *client, size_t n);
+
+/* Like ratelimit_pace, but return the delay in microseconds instead of sleeping */
+int64_t ratelimit_charge(RateClient *client, size_t n);
+
+/* Write a plain-text report of rate-limit counters into buf */
+int ratelimit_stats(char *buf, size_t size);
+
+#endif /* __RATELIMIT_H__ */
+/* $end ratelimit.h */
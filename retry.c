@@ -0,0 +1,101 @@
+/*
+ * retry.c - Transparent retry of idempotent upstream failures
+ */
+#include "retry.h"
+#include "budget.h"
+#include "hedge.h"
+#include "preconnect.h"
+#include "netio.h"
+#include "stats.h"
+#include "upstream.h"
+
+static Budget budget;
+static unsigned long requests, failed_connect, failed_send, failed_empty;
+static unsigned long retries, retry_successes, budget_denied, not_idempotent, given_up;
+
+void retry_init(void) { budget_init(&budget, RETRY_BUDGET_RATIO, RETRY_BUDGET_BURST); }
+
+/*
+ * open_attempt - Get a connection for this attempt. After a failure on
+ *     failedfd, prefer a warm connection, then another address than the
+ *     one that failed, then the same origin again after a backoff.
+ */
+static int open_attempt(int attempt, int failedfd, char *hostname, char *port) {
+    int fd;
+
+    if ((fd = preconnect_take(hostname, port)) >= 0)
+        return fd;
+    if (failedfd >= 0 && (fd = upstream_connect_other(hostname, port, failedfd)) >= 0)
+        return fd;
+    if (attempt > 0)
+        usleep(RETRY_BACKOFF_MS * attempt * 1000);
+    return upstream_connect(hostname, port);
+}
+
+/* $begin retry_exchange */
+int retry_exchange(char *method, char *hostname, char *port, char *request, int len) {
+    int attempt, fd, failedfd = -1;
+
+    STAT_INC(requests);
+    budget_earn(&budget);
+
+    for (attempt = 0;; attempt++) {
+        fd = open_attempt(attempt, failedfd, hostname, port);
+        if (failedfd >= 0)
+            upstream_abort(failedfd);
+        failedfd = -1;
+
+        if (fd < 0) {
+            STAT_INC(failed_connect);
+        } else if (netio_writen(fd, request, len) != len) {
+            STAT_INC(failed_send);
+            failedfd = fd;
+        } else {
+            /* Idempotent misses may be hedged to a replica if the origin is slow to answer */
+            if (!strcasecmp(method, "GET"))
+                fd = hedge_wait(fd, hostname, port, request, len);
+            if (upstream_wait_response(fd, -1) == 1) {
+                if (attempt > 0)
+                    STAT_INC(retry_successes);
+                return fd;
+            }
+            STAT_INC(failed_empty); /* Closed or reset before the response was committed */
+            failedfd = fd;
+        }
+
+        /* Nothing has reached the client yet: retry if that's safe and affordable */
+        if (!upstream_idempotent(method)) {
+            STAT_INC(not_idempotent);
+            break;
+        }
+        if (attempt >= RETRY_MAX) {
+            STAT_INC(given_up);
+            break;
+        }
+        if (!budget_spend(&budget)) {
+            STAT_INC(budget_denied);
+            break;
+        }
+        STAT_INC(retries);
+        printf("Retrying %s %s:%s (attempt %d)\n", method, hostname, port, attempt + 2);
+    }
+
+    if (failedfd >= 0)
+        upstream_abort(failedfd);
+    return -1;
+}
+/* $end retry_exchange */
+
+/* $begin retry_stats */
+int retry_stats(char *buf, size_t size) {
+    int len = 0;
+
+    len += snprintf(buf + len, size - len, "retry.requests %lu\nretry.budget %.2f\n", STAT_GET(requests), budget_level(&budget));
+    len += snprintf(buf + len, size - len, "retry.failed_connect %lu\nretry.failed_send %lu\nretry.failed_empty %lu\n", STAT_GET(failed_connect),
+                    STAT_GET(failed_send), STAT_GET(failed_empty));
+    len += snprintf(buf + len, size - len, "retry.retries %lu\nretry.successes %lu\nretry.budget_denied %lu\n", STAT_GET(retries),
+                    STAT_GET(retry_successes), STAT_GET(budget_denied));
+    len += snprintf(buf + len, size - len, "retry.not_idempotent %lu\nretry.given_up %lu\n", STAT_GET(not_idempotent), STAT_GET(given_up));
+    return len < size ? len : size - 1;
+}
+/* $end retry_stats */
@@ -0,0 +1,39 @@
+/*
+ * retry.h - Transparent retry of idempotent upstream failures
+ *
+ * A connect failure, or an origin that resets or closes before sending a
+ * single byte, used to turn straight into a 500 for the client, which then
+ * retried from scratch. Nothing has been sent to the client at that point,
+ * so the proxy can safely retry an idempotent request itself: on a warm
+ * connection if the predictor has one, otherwise on another address of the
+ * origin, otherwise on the same address after a short backoff.
+ *
+ * Retries draw on a global budget (see budget.h) earning RETRY_BUDGET_RATIO
+ * retries per request, so a dead origin sees at most that much extra load
+ * instead of every request being multiplied by RETRY_MAX.
+ */
+/* $begin retry.h */
+#ifndef __RETRY_H__
+#define __RETRY_H__
+
+#include "csapp.h"
+
+#define RETRY_MAX 2              /* Retries per request, on top of the first attempt */
+#define RETRY_BACKOFF_MS 20      /* Wait before retrying the same address, times the attempt */
+#define RETRY_BUDGET_RATIO 0.1   /* Retries earned per request */
+#define RETRY_BUDGET_BURST 10.0  /* Most unspent retries that can pile up */
+
+void retry_init(void);
+
+/*
+ * Connect, send the request, and wait until the origin starts answering,
+ * retrying idempotent requests that fail before any response byte.
+ * Returns the connection to relay from, or -1 if every attempt failed.
+ */
+int retry_exchange(char *method, char *hostname, char *port, char *request, int len);
+
+/* Write a plain-text report of retry counters into buf */
+int retry_stats(char *buf, size_t size);
+
+#endif /* __RETRY_H__ */
+/* $end retry.h */
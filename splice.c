@@ -0,0 +1,114 @@
+/*
+ * splice.c - Zero-copy relay of responses that will not be cached
+ */
+#define _GNU_SOURCE
+#include "splice.h"
+#include "stats.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+struct SplicePipe {
+    int fd[2];   // Read end, write end.
+    size_t held; // Bytes in the pipe not yet drained.
+};
+
+static SplicePipe *pool[SPLICE_POOL];
+static int npool = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER; // Protects pool.
+
+static unsigned long responses, bytes, pipes_created, pipes_reused, pipes_closed;
+
+/* $begin splice_open */
+SplicePipe *splice_open(void) {
+    SplicePipe *p = NULL;
+
+    pthread_mutex_lock(&lock);
+    if (npool > 0)
+        p = pool[--npool];
+    pthread_mutex_unlock(&lock);
+    if (p) {
+        STAT_INC(pipes_reused);
+        return p;
+    }
+
+    if (!(p = malloc(sizeof(SplicePipe))))
+        return NULL;
+    if (pipe2(p->fd, O_CLOEXEC) < 0) {
+        free(p);
+        return NULL;
+    }
+    p->held = 0;
+    STAT_INC(pipes_created);
+    return p;
+}
+/* $end splice_open */
+
+/* $begin splice_fill */
+ssize_t splice_fill(SplicePipe *p, int from, size_t max) {
+    ssize_t n;
+
+    if (max > SPLICE_CHUNK - p->held)
+        max = SPLICE_CHUNK - p->held;
+    while ((n = splice(from, NULL, p->fd[1], NULL, max, SPLICE_F_MOVE | SPLICE_F_MORE)) < 0 && errno == EINTR)
+        ;
+    if (n > 0)
+        p->held += n;
+    return n;
+}
+/* $end splice_fill */
+
+/* $begin splice_drain */
+int splice_drain(SplicePipe *p, int to) {
+    ssize_t n;
+
+    while (p->held > 0) {
+        if ((n = splice(p->fd[0], NULL, to, NULL, p->held, SPLICE_F_MOVE | SPLICE_F_MORE)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p->held -= n;
+    }
+    return 0;
+}
+/* $end splice_drain */
+
+/* $begin splice_close */
+void splice_close(SplicePipe *p) {
+    if (p->held == 0) {
+        pthread_mutex_lock(&lock);
+        if (npool < SPLICE_POOL) {
+            pool[npool++] = p;
+            p = NULL;
+        }
+        pthread_mutex_unlock(&lock);
+        if (!p)
+            return;
+    }
+    /* Holding data for a client that went away (or the pool is full): it cannot be reused */
+    STAT_INC(pipes_closed);
+    close(p->fd[0]);
+    close(p->fd[1]);
+    free(p);
+}
+/* $end splice_close */
+
+void splice_note_response(size_t n) {
+    STAT_INC(responses);
+    STAT_ADD(bytes, n);
+}
+
+/* $begin splice_stats */
+int splice_stats(char *buf, size_t size) {
+    int len = 0;
+
+    len += snprintf(buf + len, size - len, "splice.responses %lu\nsplice.bytes %lu\n", STAT_GET(responses), STAT_GET(bytes));
+    len += snprintf(buf + len, size - len, "splice.pipes_created %lu\nsplice.pipes_reused %lu\nsplice.pipes_closed %lu\nsplice.pipes_idle %d\n",
+                    STAT_GET(pipes_created), STAT_GET(pipes_reused), STAT_GET(pipes_closed), npool);
+    return len < size ? len : size - 1;
+}
+/* $end splice_stats */
@@ -0,0 +1,49 @@
+/*
+ * splice.h - Zero-copy relay of responses that will not be cached
+ *
+ * relay_response() reads every response into user space so that it can be
+ * captured for the cache. A response that will never be cached (larger than
+ * MAX_OBJECT_SIZE, or marked no-store or private) pays for that copy in and
+ * out of the proxy for nothing. Such responses are moved with splice()
+ * instead: upstream socket to a pipe, pipe to client socket, so the data
+ * stays in kernel pages the whole way.
+ *
+ * Pipes are reused across responses from a small pool, since creating one
+ * per response would cost two descriptors and a syscall each time. Only
+ * plaintext upstreams can be spliced; TLS has to be decrypted in user space.
+ *
+ * Kept in its own file because splice() needs _GNU_SOURCE, which clashes
+ * with csapp.h (see affinity.h).
+ */
+/* $begin splice.h */
+#ifndef __SPLICE_H__
+#define __SPLICE_H__
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define SPLICE_CHUNK 65536 /* Most moved per splice() call (the default pipe capacity) */
+#define SPLICE_POOL 64     /* Idle pipes kept for reuse */
+
+typedef struct SplicePipe SplicePipe;
+
+/* A pipe to relay one response through (pooled if one is idle); NULL if none can be made */
+SplicePipe *splice_open(void);
+
+/* Move up to max bytes from socket from into the pipe: bytes moved, 0 at EOF, -1 on error (errno set) */
+ssize_t splice_fill(SplicePipe *p, int from, size_t max);
+
+/* Move everything the pipe holds to socket to: 0, or -1 on error (errno set) */
+int splice_drain(SplicePipe *p, int to);
+
+/* Done with the pipe: an empty one goes back to the pool */
+void splice_close(SplicePipe *p);
+
+/* Note one spliced response of n bytes */
+void splice_note_response(size_t n);
+
+/* Write a plain-text report of spliced responses into buf */
+int splice_stats(char *buf, size_t size);
+
+#endif /* __SPLICE_H__ */
+/* $end splice.h */
@@ -0,0 +1,210 @@
+/*
+ * spool.c - Buffering upstream responses so origins are released early
+ */
+#include "spool.h"
+#include "stats.h"
+
+static size_t threshold = 0; // 0 = buffering mode off
+
+static unsigned long responses, bytes_in, spill_files, spill_bytes, spill_errors;
+static unsigned long mem_held, files_open;
+static unsigned long early_releases, early_release_bytes;
+
+/* $begin spool_configure */
+int spool_configure(char *spec) {
+    char *end;
+    double value = strtod(spec, &end);
+
+    if (*end == 'k' || *end == 'K')
+        value *= 1024, end++;
+    else if (*end == 'm' || *end == 'M')
+        value *= 1024 * 1024, end++;
+    if (*end != '\0' || value < SPOOL_CHUNK) {
+        fprintf(stderr, "spool: bad threshold %s (expected bytes >= %d, k/m suffix allowed)\n", spec, SPOOL_CHUNK);
+        return -1;
+    }
+    threshold = (size_t)value;
+    return 0;
+}
+/* $end spool_configure */
+
+int spool_enabled(void) { return threshold > 0; }
+
+void spool_init(Spool *sp) {
+    memset(sp, 0, sizeof(Spool));
+    sp->fd = -1;
+}
+
+/* $begin spool_free */
+void spool_free(Spool *sp) {
+    SpoolChunk *c, *next;
+
+    for (c = sp->head; c; c = next) {
+        next = c->next;
+        free(c);
+    }
+    STAT_SUB(mem_held, sp->mem_bytes);
+    if (sp->fd >= 0) {
+        close(sp->fd);
+        STAT_SUB(files_open, 1);
+    }
+    spool_init(sp);
+}
+/* $end spool_free */
+
+/* Open an anonymous spill file: created in $TMPDIR (or /tmp) and unlinked at once */
+static int open_spill_file(void) {
+    char path[MAXLINE], *dir = getenv("TMPDIR");
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/proxy-spool-XXXXXX", dir && *dir ? dir : "/tmp");
+    if ((fd = mkstemp(path)) < 0)
+        return -1;
+    unlink(path);
+    return fd;
+}
+
+/*
+ * spool_append - Keep data in memory while the spool holds less than the
+ *     threshold. Once it spills, everything after goes to the file so the
+ *     memory part always precedes the file part.
+ */
+/* $begin spool_append */
+size_t spool_append(Spool *sp, char *buf, size_t n) {
+    SpoolChunk *c;
+    size_t m, stored = 0;
+
+    STAT_ADD(bytes_in, n);
+    while (n > 0 && sp->fd < 0 && sp->mem_bytes < threshold) {
+        if (!(c = sp->tail) || c->len == SPOOL_CHUNK) {
+            if (!(c = malloc(sizeof(SpoolChunk))))
+                break;
+            c->next = NULL;
+            c->len = 0;
+            if (sp->tail)
+                sp->tail->next = c;
+            else
+                sp->head = c;
+            sp->tail = c;
+        }
+        m = SPOOL_CHUNK - c->len < n ? SPOOL_CHUNK - c->len : n;
+        memcpy(c->data + c->len, buf, m);
+        c->len += m;
+        sp->mem_bytes += m;
+        STAT_ADD(mem_held, m);
+        buf += m;
+        n -= m;
+        stored += m;
+    }
+    if (n == 0)
+        return stored;
+
+    /* Past the threshold (or out of memory): spill the rest */
+    if (sp->fd < 0) {
+        if ((sp->fd = open_spill_file()) < 0) {
+            fprintf(stderr, "spool: cannot create spill file: %s\n", strerror(errno));
+            STAT_INC(spill_errors);
+            return stored;
+        }
+        STAT_INC(spill_files);
+        STAT_INC(files_open);
+    }
+    while (n > 0) {
+        ssize_t w = pwrite(sp->fd, buf, n, sp->file_len);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "spool: spill write failed: %s\n", strerror(errno));
+            STAT_INC(spill_errors);
+            return stored;
+        }
+        sp->file_len += w;
+        STAT_ADD(spill_bytes, w);
+        buf += w;
+        n -= w;
+        stored += w;
+    }
+    return stored;
+}
+/* $end spool_append */
+
+size_t spool_pending(Spool *sp) { return sp->mem_bytes - sp->head_off + (sp->file_len - sp->file_off); }
+
+/*
+ * spool_send - Send from the oldest pending data: the head chunk first,
+ *     then the spill file. A fully sent chunk is freed at once, so memory
+ *     drains as fast as the client reads.
+ */
+/* $begin spool_send */
+ssize_t spool_send(Spool *sp, int fd, size_t max, int flags) {
+    char buf[SPOOL_CHUNK];
+    SpoolChunk *c;
+    size_t n;
+    ssize_t sent;
+
+    if ((c = sp->head)) {
+        n = c->len - sp->head_off < max ? c->len - sp->head_off : max;
+        if ((sent = send(fd, c->data + sp->head_off, n, flags)) <= 0)
+            return sent;
+        sp->head_off += sent;
+
+        /* Free the chunk once sent, unless appends may still fill it */
+        if (sp->head_off == c->len && (c != sp->tail || c->len == SPOOL_CHUNK || sp->fd >= 0)) {
+            if (!(sp->head = c->next))
+                sp->tail = NULL;
+            sp->mem_bytes -= c->len;
+            STAT_SUB(mem_held, c->len);
+            sp->head_off = 0;
+            free(c);
+        }
+        return sent;
+    }
+
+    n = sp->file_len - sp->file_off;
+    if (n > sizeof(buf))
+        n = sizeof(buf);
+    if (n > max)
+        n = max;
+    if (n == 0)
+        return 0;
+    if ((sent = pread(sp->fd, buf, n, sp->file_off)) <= 0) {
+        STAT_INC(spill_errors);
+        if (sent == 0)
+            errno = EIO; // The file is shorter than what we wrote to it.
+        return -1;
+    }
+    if ((sent = send(fd, buf, sent, flags)) > 0)
+        sp->file_off += sent;
+    return sent;
+}
+/* $end spool_send */
+
+/* $begin spool_note_release */
+void spool_note_release(Spool *sp) {
+    size_t pending = spool_pending(sp);
+
+    STAT_INC(responses);
+    if (pending > 0) {
+        STAT_INC(early_releases);
+        STAT_ADD(early_release_bytes, pending);
+    }
+}
+/* $end spool_note_release */
+
+/* $begin spool_stats */
+int spool_stats(char *buf, size_t size) {
+    int len = 0;
+
+    len += snprintf(buf + len, size - len, "spool.threshold %lu\n", (unsigned long)threshold);
+    if (!spool_enabled())
+        return len;
+
+    len += snprintf(buf + len, size - len, "spool.responses %lu\nspool.bytes %lu\n", STAT_GET(responses), STAT_GET(bytes_in));
+    len += snprintf(buf + len, size - len, "spool.early_releases %lu\nspool.early_release_bytes %lu\n", STAT_GET(early_releases),
+                    STAT_GET(early_release_bytes));
+    len += snprintf(buf + len, size - len, "spool.mem_held %lu\nspool.files_open %lu\n", STAT_GET(mem_held), STAT_GET(files_open));
+    len += snprintf(buf + len, size - len, "spool.spill_files %lu\nspool.spill_bytes %lu\nspool.spill_errors %lu\n", STAT_GET(spill_files),
+                    STAT_GET(spill_bytes), STAT_GET(spill_errors));
+    return len < size ? len : size - 1;
+}
+/* $end spool_stats */
@@ -0,0 +1,61 @@
+/*
+ * spool.h - Buffering upstream responses so origins are released early
+ *
+ * relay_response() normally writes each block to the client before reading
+ * the next one from the origin, so a slow client holds the origin
+ * connection (and, with an iterative origin like tiny, the whole origin)
+ * for as long as its download takes. In buffering mode the proxy reads the
+ * origin as fast as it sends into a spool, releases the upstream at EOF,
+ * and lets the client drain from the spool afterwards.
+ *
+ * A spool keeps up to the configured threshold in memory chunks; anything
+ * beyond that is appended to an unlinked temporary file, so a large
+ * response to a slow client costs disk rather than memory.
+ */
+/* $begin spool.h */
+#ifndef __SPOOL_H__
+#define __SPOOL_H__
+
+#include "csapp.h"
+
+#define SPOOL_CHUNK 16384 /* Bytes per in-memory chunk */
+
+typedef struct SpoolChunk {
+    struct SpoolChunk *next;
+    size_t len;              // Bytes used in data.
+    char data[SPOOL_CHUNK];
+} SpoolChunk;
+
+typedef struct Spool {
+    SpoolChunk *head, *tail; // In-memory part, oldest first.
+    size_t head_off;         // Bytes of head already sent.
+    size_t mem_bytes;        // Bytes held in chunks, sent or not.
+    int fd;                  // Spill file, -1 until the threshold is passed.
+    off_t file_len;          // Bytes appended to the spill file.
+    off_t file_off;          // Bytes of the spill file already sent.
+} Spool;
+
+/* Enable buffering mode, spilling to disk past threshold bytes ("64k", "1m", ...) */
+int spool_configure(char *threshold);
+int spool_enabled(void);
+
+void spool_init(Spool *sp);
+void spool_free(Spool *sp);
+
+/* Append n bytes; returns how many were stored (short only if spilling failed) */
+size_t spool_append(Spool *sp, char *buf, size_t n);
+
+/* Bytes appended but not yet sent */
+size_t spool_pending(Spool *sp);
+
+/* Send up to max pending bytes to fd with send(2) flags; returns bytes sent, or -1 with errno set */
+ssize_t spool_send(Spool *sp, int fd, size_t max, int flags);
+
+/* Count a finished response: bytes still pending when its upstream was released */
+void spool_note_release(Spool *sp);
+
+/* Write a plain-text report of buffering and spill counters into buf */
+int spool_stats(char *buf, size_t size);
+
+#endif /* __SPOOL_H__ */
+/* $end spool.h */
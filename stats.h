@@ -0,0 +1,22 @@
+/*
+ * stats.h - Counters shared by the proxy modules
+ *
+ * Counters are plain unsigned longs bumped with relaxed atomics so that the
+ * hot path never takes a lock just to count something. Each module exposes
+ * a <module>_stats(buf, size) function that appends a plain-text report,
+ * and the proxy serves all of them at STATS_PATH.
+ */
+/* $begin stats.h */
+#ifndef __STATS_H__
+#define __STATS_H__
+
+/* Origin-form path the proxy answers itself with a stats report */
+#define STATS_PATH "/proxy-stats"
+
+#define STAT_ADD(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+#define STAT_SUB(counter, n) __atomic_fetch_sub(&(counter), (n), __ATOMIC_RELAXED)
+#define STAT_INC(counter) STAT_ADD(counter, 1)
+#define STAT_GET(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+#endif /* __STATS_H__ */
+/* $end stats.h */
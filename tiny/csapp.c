@@ -882,9 +882,73 @@ int open_clientfd(char *hostname, char *port) {
 }
 /* $end open_clientfd */
 
+/*
+ * open_unix_clientfd - Open connection to a server listening on the
+ *     Unix-domain socket at path.
+ *
+ *     On error, returns -1 with errno set.
+ */
+/* $begin open_unix_clientfd */
+int open_unix_clientfd(char *path) {
+    struct sockaddr_un addr;
+    int clientfd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if ((clientfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return -1;
+    if (connect(clientfd, (SA *)&addr, sizeof(addr)) < 0) {
+        close(clientfd);
+        return -1;
+    }
+    return clientfd;
+}
+/* $end open_unix_clientfd */
+
+/*
+ * open_unix_listenfd - Open and return a listening socket bound to the
+ *     Unix-domain path. A socket file left behind by an earlier run is
+ *     removed first; any other kind of file at path is an error.
+ *
+ *     On error, returns -1 with errno set.
+ */
+/* $begin open_unix_listenfd */
+int open_unix_listenfd(char *path) {
+    struct sockaddr_un addr;
+    struct stat sb;
+    int listenfd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if (lstat(path, &sb) == 0 && S_ISSOCK(sb.st_mode))
+        unlink(path);
+
+    if ((listenfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return -1;
+    if (bind(listenfd, (SA *)&addr, sizeof(addr)) < 0 || listen(listenfd, LISTENQ) < 0) {
+        close(listenfd);
+        return -1;
+    }
+    return listenfd;
+}
+/* $end open_unix_listenfd */
+
 /*
  * open_listenfd - Open and return a listening socket on port. This
- *     function is reentrant and protocol-independent.
+ *     function is reentrant and protocol-independent. A port that
+ *     contains a '/' is taken as a Unix-domain socket path.
  *
  *     On error, returns:
  *       -2 for getaddrinfo error
@@ -895,6 +959,9 @@ int open_listenfd(char *port) {
     struct addrinfo hints, *listp, *p;
     int listenfd, rc, optval = 1;
 
+    if (strchr(port, '/'))
+        return open_unix_listenfd(port);
+
     /* Get a list of potential server addresses */
     memset(&hints, 0, sizeof(struct addrinfo));
     hints.ai_socktype = SOCK_STREAM;             /* Accept connections */
@@ -29,7 +29,11 @@ int main(int argc, char **argv) {
     while (1) {
         clientlen = sizeof(clientaddr);
         connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-        Getnameinfo((SA *)&clientaddr, clientlen, hostname, MAXLINE, port, MAXLINE, 0);
+        if (clientaddr.ss_family == AF_UNIX) { /* Unix-domain peers have no host or port */
+            strcpy(hostname, "local");
+            strcpy(port, "-");
+        } else
+            Getnameinfo((SA *)&clientaddr, clientlen, hostname, MAXLINE, port, MAXLINE, 0);
         printf("Accepted connection from (%s, %s)\n", hostname, port);
         doit(connfd);
         Close(connfd);
@@ -0,0 +1,288 @@
+/*
+ * tls.c - HTTPS origins over the system OpenSSL
+ */
+#include "tls.h"
+#include "stats.h"
+#include "upstream.h"
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#include <limits.h>
+#include <time.h>
+
+typedef struct Origin {
+    char host[NI_MAXHOST];
+    char port[NI_MAXSERV];
+    SSL_SESSION *session;            // Latest session to offer for resumption (NULL if none yet).
+    TlsConn *idle[TLS_IDLE_CONNS];   // Idle keep-alive connections, newest last.
+    int nidle;
+} Origin;
+
+struct TlsConn {
+    SSL *ssl;
+    int fd;
+    Origin *origin;                  // NULL if the origin table was full.
+    time_t since;                    // When it went idle.
+    char head[TLS_HEAD_MAX + 1];     // Bytes read with the response head, handed out first.
+    size_t off, len;
+    int eof;                         // The response ended cleanly at close.
+};
+
+static SSL_CTX *ctx;
+static char ca_file[MAXLINE];
+static int verify = 1;
+static Origin origins[TLS_MAX_ORIGINS];
+static int norigins = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER; // Protects origins, their sessions and idle lists.
+
+static unsigned long handshakes_full, handshakes_resumed, handshake_failures, sessions_saved;
+static unsigned long exchanges, conns_reused, kept_alive, closed_after;
+
+/* $begin tls_configure */
+int tls_configure(char *cafile) {
+    if (!strcmp(cafile, "none"))
+        verify = 0;
+    else
+        snprintf(ca_file, sizeof(ca_file), "%s", cafile);
+    return 0;
+}
+/* $end tls_configure */
+
+/* The origin's slot, created on first use; NULL once the table is full */
+static Origin *find_origin(char *host, char *port) {
+    Origin *o = NULL;
+    int i;
+
+    pthread_mutex_lock(&lock);
+    for (i = 0; i < norigins && !o; i++)
+        if (!strcmp(origins[i].host, host) && !strcmp(origins[i].port, port))
+            o = &origins[i];
+    if (!o && norigins < TLS_MAX_ORIGINS) {
+        o = &origins[norigins++];
+        snprintf(o->host, sizeof(o->host), "%s", host);
+        snprintf(o->port, sizeof(o->port), "%s", port);
+    }
+    pthread_mutex_unlock(&lock);
+    return o;
+}
+
+/* OpenSSL hands us each new session (TLS 1.3 tickets arrive after the handshake); keep the latest per origin */
+static int new_session(SSL *ssl, SSL_SESSION *session) {
+    Origin *o = SSL_get_app_data(ssl);
+
+    if (!o)
+        return 0;
+    pthread_mutex_lock(&lock);
+    if (o->session)
+        SSL_SESSION_free(o->session);
+    o->session = session;
+    pthread_mutex_unlock(&lock);
+    STAT_INC(sessions_saved);
+    return 1; // We keep the reference.
+}
+
+/* $begin tls_init */
+void tls_init(void) {
+    if (!(ctx = SSL_CTX_new(TLS_client_method()))) {
+        fprintf(stderr, "tls: cannot create context\n");
+        exit(1);
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF); // Many origins close without close_notify.
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, new_session);
+    if (verify) {
+        SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+        if (ca_file[0] ? !SSL_CTX_load_verify_locations(ctx, ca_file, NULL) : !SSL_CTX_set_default_verify_paths(ctx)) {
+            fprintf(stderr, "tls: cannot load trusted certificates%s%s\n", ca_file[0] ? " from " : "", ca_file);
+            exit(1);
+        }
+    }
+}
+/* $end tls_init */
+
+/*
+ * discard - Close a connection without sending close_notify (the origin is
+ *     asked to close first anyway). Freeing an SSL that was not shut down
+ *     marks its session unresumable, which is right after an error but
+ *     would throw away the cached session after every clean response.
+ */
+static void discard(TlsConn *c, int clean) {
+    if (clean)
+        SSL_set_shutdown(c->ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+    SSL_free(c->ssl);
+    upstream_close(c->fd);
+    free(c);
+}
+
+/*
+ * take_idle - The newest idle connection to o that is young enough and
+ *     still open, if any. A connection the origin has closed or reset is
+ *     dropped here rather than written to: SSL_write has no MSG_NOSIGNAL.
+ */
+static TlsConn *take_idle(Origin *o) {
+    TlsConn *c;
+    time_t now = time(NULL);
+    char byte;
+
+    while (1) {
+        pthread_mutex_lock(&lock);
+        c = o->nidle > 0 ? o->idle[--o->nidle] : NULL;
+        pthread_mutex_unlock(&lock);
+        if (!c || (now - c->since < TLS_IDLE_SECS && recv(c->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && errno == EAGAIN))
+            return c;
+        discard(c, 1);
+    }
+}
+
+/*
+ * handshake - Connect to hostname:port and run the TLS handshake,
+ *     offering the origin's cached session if it has one.
+ */
+static TlsConn *handshake(Origin *o, char *hostname, char *port) {
+    TlsConn *c;
+    struct in6_addr addr;
+    int literal = inet_pton(AF_INET, hostname, &addr) == 1 || inet_pton(AF_INET6, hostname, &addr) == 1;
+
+    if (!(c = calloc(1, sizeof(TlsConn))))
+        return NULL;
+    if ((c->fd = upstream_connect(hostname, port)) < 0) {
+        free(c);
+        return NULL;
+    }
+    c->origin = o;
+    c->ssl = SSL_new(ctx);
+    SSL_set_fd(c->ssl, c->fd);
+    SSL_set_app_data(c->ssl, o);
+    if (!literal)
+        SSL_set_tlsext_host_name(c->ssl, hostname); // SNI is for names only.
+    if (verify && !(literal ? X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(c->ssl), hostname) : SSL_set1_host(c->ssl, hostname)))
+        goto fail;
+    if (o) {
+        pthread_mutex_lock(&lock);
+        if (o->session)
+            SSL_set_session(c->ssl, o->session);
+        pthread_mutex_unlock(&lock);
+    }
+
+    if (SSL_connect(c->ssl) != 1) {
+        fprintf(stderr, "tls: handshake with %s:%s failed: %s\n", hostname, port, ERR_reason_error_string(ERR_get_error()));
+        ERR_clear_error();
+        goto fail;
+    }
+    if (SSL_session_reused(c->ssl))
+        STAT_INC(handshakes_resumed);
+    else
+        STAT_INC(handshakes_full);
+    return c;
+
+fail:
+    STAT_INC(handshake_failures);
+    discard(c, 0);
+    return NULL;
+}
+
+/* Read until the response head is complete (or TLS_HEAD_MAX is full); returns the bytes read, 0 if none came */
+static size_t read_head(TlsConn *c) {
+    int n;
+
+    c->off = c->len = 0;
+    while (c->len < TLS_HEAD_MAX && (n = SSL_read(c->ssl, c->head + c->len, TLS_HEAD_MAX - c->len)) > 0) {
+        c->len += n;
+        c->head[c->len] = '\0';
+        if (strstr(c->head, "\r\n\r\n"))
+            break;
+    }
+    ERR_clear_error();
+    return c->len;
+}
+
+/*
+ * tls_exchange - A pooled connection may have been closed by the origin
+ *     since it was last used, so a failure on a reused connection is
+ *     retried once on a fresh one.
+ */
+/* $begin tls_exchange */
+int tls_exchange(char *method, char *hostname, char *port, char *request, int len, TlsConn **conn, ssize_t *expect) {
+    Origin *o = find_origin(hostname, port);
+    TlsConn *c;
+    int reused;
+
+    STAT_INC(exchanges);
+    do {
+        if ((reused = o && (c = take_idle(o)) != NULL))
+            STAT_INC(conns_reused);
+        else if (!(c = handshake(o, hostname, port)))
+            return -1;
+        if (SSL_write(c->ssl, request, len) == len && read_head(c) > 0) {
+            *expect = upstream_response_length(c->head, method);
+            *conn = c;
+            return c->fd;
+        }
+        ERR_clear_error();
+        discard(c, 0);
+    } while (reused);
+    return -1;
+}
+/* $end tls_exchange */
+
+/* $begin tls_read */
+ssize_t tls_read(TlsConn *c, void *buf, size_t n) {
+    int rc;
+
+    if (c->off < c->len) {
+        if (n > c->len - c->off)
+            n = c->len - c->off;
+        memcpy(buf, c->head + c->off, n);
+        c->off += n;
+        return n;
+    }
+    if ((rc = SSL_read(c->ssl, buf, n > INT_MAX ? INT_MAX : n)) > 0)
+        return rc;
+    rc = SSL_get_error(c->ssl, rc) == SSL_ERROR_ZERO_RETURN ? 0 : -1;
+    c->eof = rc == 0;
+    ERR_clear_error();
+    return rc;
+}
+/* $end tls_read */
+
+size_t tls_pending(TlsConn *c) { return c->len - c->off + SSL_pending(c->ssl); }
+
+/* $begin tls_release */
+void tls_release(TlsConn *c, int complete) {
+    Origin *o = c->origin;
+    TlsConn *old = NULL;
+
+    if (!complete || !o) {
+        STAT_INC(closed_after);
+        discard(c, c->eof);
+        return;
+    }
+
+    STAT_INC(kept_alive);
+    c->since = time(NULL);
+    pthread_mutex_lock(&lock);
+    if (o->nidle == TLS_IDLE_CONNS) {
+        old = o->idle[0]; // Full: the oldest goes.
+        memmove(&o->idle[0], &o->idle[1], (TLS_IDLE_CONNS - 1) * sizeof(TlsConn *));
+        o->nidle--;
+    }
+    o->idle[o->nidle++] = c;
+    pthread_mutex_unlock(&lock);
+    if (old)
+        discard(old, 1);
+}
+/* $end tls_release */
+
+/* $begin tls_stats */
+int tls_stats(char *buf, size_t size) {
+    int len = 0;
+
+    len += snprintf(buf + len, size - len, "tls.origins %d\ntls.exchanges %lu\n", norigins, STAT_GET(exchanges));
+    len += snprintf(buf + len, size - len, "tls.handshakes_full %lu\ntls.handshakes_resumed %lu\ntls.handshake_failures %lu\ntls.sessions_saved %lu\n",
+                    STAT_GET(handshakes_full), STAT_GET(handshakes_resumed), STAT_GET(handshake_failures), STAT_GET(sessions_saved));
+    len += snprintf(buf + len, size - len, "tls.conns_reused %lu\ntls.kept_alive %lu\ntls.closed_after %lu\n", STAT_GET(conns_reused),
+                    STAT_GET(kept_alive), STAT_GET(closed_after));
+    return len < size ? len : size - 1;
+}
+/* $end tls_stats */
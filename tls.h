@@ -0,0 +1,62 @@
+/*
+ * tls.h - HTTPS origins over the system OpenSSL
+ *
+ * parse_uri has always mapped https:// URIs to port 443, but the request
+ * then went out as plaintext and failed. Misses for https:// URIs now go
+ * to the origin over TLS. A full handshake costs extra round trips and
+ * the server's signature, so two things keep repeat misses cheap:
+ *   - the latest session (TLS 1.3 ticket) of each origin is cached and
+ *     offered on the next connection, which then resumes without a
+ *     certificate exchange
+ *   - requests ask for HTTP/1.0 keep-alive; a connection whose response
+ *     had a Content-Length goes back to a per-origin idle pool and the
+ *     next miss skips the handshake altogether
+ *
+ * Certificates are verified against the system trust store (or the -K
+ * file) and the origin's host name; -K none turns verification off for
+ * testing against a self-signed openssl s_server.
+ *
+ * The response head is read (not peeked: TLS records cannot be peeked
+ * across) into the connection, and tls_read hands it out before the rest.
+ */
+/* $begin tls.h */
+#ifndef __TLS_H__
+#define __TLS_H__
+
+#include "csapp.h"
+
+#define TLS_MAX_ORIGINS 256    /* Origins with a cached session and pool; others get neither */
+#define TLS_IDLE_CONNS 4       /* Idle connections kept per origin */
+#define TLS_IDLE_SECS 30       /* Idle connections older than this are not reused */
+#define TLS_HEAD_MAX MAXBUF    /* Longest response head read up front */
+
+typedef struct TlsConn TlsConn;
+
+/* CA bundle to verify origins against, or "none"; default is the system store */
+int tls_configure(char *cafile);
+
+/* Create the client context; call once after option parsing */
+void tls_init(void);
+
+/*
+ * Send request (HTTP/1.0 with keep-alive) to hostname:port over TLS and
+ * read the response head. Returns the socket, with *conn and *expect
+ * (total response length if the connection stays open, else -1) filled
+ * in, or -1 if the origin could not be reached.
+ */
+int tls_exchange(char *method, char *hostname, char *port, char *request, int len, TlsConn **conn, ssize_t *expect);
+
+/* Read decrypted response bytes: >0, 0 at the end, -1 on error */
+ssize_t tls_read(TlsConn *c, void *buf, size_t n);
+
+/* Bytes readable without touching the socket */
+size_t tls_pending(TlsConn *c);
+
+/* Done with c; complete means the whole response was read, so it can be reused */
+void tls_release(TlsConn *c, int complete);
+
+/* Write a plain-text report of handshakes and reuse into buf */
+int tls_stats(char *buf, size_t size);
+
+#endif /* __TLS_H__ */
+/* $end tls.h */
@@ -0,0 +1,713 @@
+/*
+ * upstream.c - Upstream (origin server) connection management for the proxy
+ *
+ * Port pools: when a local port range is configured, each (source, destination)
+ * pair gets its own pool over that range. A port is either free, in use, or
+ * parked until its TIME_WAIT expires. Because the destination is part of the
+ * key, the same local port can be in use towards many origins at once; only
+ * the full 4-tuple has to be unique. A forward proxy meets an open-ended set
+ * of destinations, so a pool with no port in use is freed once the last of
+ * its ports has left TIME_WAIT.
+ */
+#include "upstream.h"
+#include "stats.h"
+#include <netinet/tcp.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <time.h>
+
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT 24 /* Linux 4.2+, missing from older headers */
+#endif
+
+#define MAX_SOURCES 16
+#define MAX_UNIX_ORIGINS 16
+#define PORT_IN_USE UINT32_MAX /* marker in PortPool.until */
+
+typedef struct PortPool {
+    struct sockaddr_storage src; // Configured source address (port 0); AF_UNSPEC if wildcard.
+    struct sockaddr_storage dst; // Destination address and port.
+    uint32_t *until;             // Per port: 0 if free, PORT_IN_USE, or TIME_WAIT expiry (monotonic secs).
+    int next;                    // Index to try next (round-robin through the range).
+    int in_use;                  // Number of ports currently connected.
+    uint32_t quiet_at;           // When the last parked port leaves TIME_WAIT (monotonic secs).
+    struct PortPool *next_pool;  // Pointer to the next pool.
+} PortPool;
+
+typedef struct UnixOrigin {
+    char origin[MAXLINE]; // "host:port" as it appears in request URIs.
+    char path[108];       // Unix-domain socket the origin listens on (sun_path size).
+} UnixOrigin;
+
+static struct sockaddr_storage sources[MAX_SOURCES];
+static int nsources = 0;
+static unsigned int source_rr = 0;
+
+static UnixOrigin unix_origins[MAX_UNIX_ORIGINS];
+static int nunix_origins = 0;
+
+static int port_lo = 0, port_hi = 0; // 0 = let the kernel pick ephemeral ports
+static close_strategy_t close_strategy = CLOSE_DEFAULT;
+
+static PortPool *pools = NULL;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long connects, connect_failures, port_exhaustions, bind_conflicts, pools_created, pools_reclaimed;
+static unsigned long unix_connects, unix_connect_failures;
+static unsigned long closes_active, closes_passive, closes_reset;
+
+static uint32_t now_secs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)ts.tv_sec + 1; // never 0, which means "free"
+}
+
+static int addr_port(struct sockaddr_storage *ss) {
+    if (ss->ss_family == AF_INET)
+        return ntohs(((struct sockaddr_in *)ss)->sin_port);
+    return ntohs(((struct sockaddr_in6 *)ss)->sin6_port);
+}
+
+static void addr_set_port(struct sockaddr_storage *ss, int port) {
+    if (ss->ss_family == AF_INET)
+        ((struct sockaddr_in *)ss)->sin_port = htons(port);
+    else
+        ((struct sockaddr_in6 *)ss)->sin6_port = htons(port);
+}
+
+static socklen_t addr_len(struct sockaddr_storage *ss) {
+    return ss->ss_family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+}
+
+/* Compare the host part of two addresses, and the port too if with_port */
+static int addr_equal(struct sockaddr_storage *a, struct sockaddr_storage *b, int with_port) {
+    if (a->ss_family != b->ss_family)
+        return 0;
+    if (with_port && addr_port(a) != addr_port(b))
+        return 0;
+    if (a->ss_family == AF_INET)
+        return ((struct sockaddr_in *)a)->sin_addr.s_addr == ((struct sockaddr_in *)b)->sin_addr.s_addr;
+    return memcmp(&((struct sockaddr_in6 *)a)->sin6_addr, &((struct sockaddr_in6 *)b)->sin6_addr, sizeof(struct in6_addr)) == 0;
+}
+
+static void addr_format(struct sockaddr_storage *ss, char *buf, size_t size) {
+    if (ss->ss_family == AF_INET)
+        inet_ntop(AF_INET, &((struct sockaddr_in *)ss)->sin_addr, buf, size);
+    else if (ss->ss_family == AF_INET6)
+        inet_ntop(AF_INET6, &((struct sockaddr_in6 *)ss)->sin6_addr, buf, size);
+    else
+        snprintf(buf, size, "*");
+}
+
+/* $begin upstream_set_sources */
+// parse a comma-separated list of source IPs ("10.0.0.1,10.0.0.2,fd00::1")
+int upstream_set_sources(char *list) {
+    char copy[MAXLINE], *tok, *save;
+
+    snprintf(copy, sizeof(copy), "%s", list);
+    for (tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        if (nsources == MAX_SOURCES) {
+            fprintf(stderr, "upstream: at most %d source addresses\n", MAX_SOURCES);
+            return -1;
+        }
+        struct sockaddr_storage *ss = &sources[nsources];
+        memset(ss, 0, sizeof(*ss));
+        if (inet_pton(AF_INET, tok, &((struct sockaddr_in *)ss)->sin_addr) == 1) {
+            ss->ss_family = AF_INET;
+        } else if (inet_pton(AF_INET6, tok, &((struct sockaddr_in6 *)ss)->sin6_addr) == 1) {
+            ss->ss_family = AF_INET6;
+        } else {
+            fprintf(stderr, "upstream: bad source address %s\n", tok);
+            return -1;
+        }
+        nsources++;
+    }
+    return 0;
+}
+/* $end upstream_set_sources */
+
+/* $begin upstream_map_unix */
+// parse "host:port=/path[,host:port=/path...]": reach those origins over a Unix-domain socket
+int upstream_map_unix(char *spec) {
+    char copy[MAXLINE], *tok, *save, *eq;
+
+    snprintf(copy, sizeof(copy), "%s", spec);
+    for (tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        if (nunix_origins == MAX_UNIX_ORIGINS) {
+            fprintf(stderr, "upstream: at most %d Unix-socket origins\n", MAX_UNIX_ORIGINS);
+            return -1;
+        }
+        if (!(eq = strchr(tok, '=')) || !strchr(tok, ':') || eq[1] != '/' || strlen(eq + 1) >= sizeof(unix_origins[0].path)) {
+            fprintf(stderr, "upstream: bad Unix origin %s (expected host:port=/path)\n", tok);
+            return -1;
+        }
+        *eq = '\0';
+        UnixOrigin *u = &unix_origins[nunix_origins++];
+        snprintf(u->origin, sizeof(u->origin), "%s", tok);
+        snprintf(u->path, sizeof(u->path), "%s", eq + 1);
+    }
+    return 0;
+}
+/* $end upstream_map_unix */
+
+/* Socket path for <hostname, port> if it is mapped to a Unix-domain origin, else NULL */
+static char *unix_path(char *hostname, char *port) {
+    char origin[MAXLINE];
+    int i;
+
+    if (nunix_origins == 0)
+        return NULL;
+    snprintf(origin, sizeof(origin), "%s:%s", hostname, port);
+    for (i = 0; i < nunix_origins; i++)
+        if (!strcasecmp(unix_origins[i].origin, origin))
+            return unix_origins[i].path;
+    return NULL;
+}
+
+/* $begin upstream_set_port_range */
+// parse a local port range ("20000-29999") to allocate per destination
+int upstream_set_port_range(char *range) {
+    int lo, hi;
+
+    if (sscanf(range, "%d-%d", &lo, &hi) != 2 || lo < 1 || hi > 65535 || lo > hi) {
+        fprintf(stderr, "upstream: bad port range %s (expected lo-hi)\n", range);
+        return -1;
+    }
+    port_lo = lo;
+    port_hi = hi;
+    return 0;
+}
+/* $end upstream_set_port_range */
+
+/* $begin upstream_set_close_strategy */
+int upstream_set_close_strategy(char *name) {
+    if (!strcmp(name, "default"))
+        close_strategy = CLOSE_DEFAULT;
+    else if (!strcmp(name, "origin"))
+        close_strategy = CLOSE_ORIGIN;
+    else if (!strcmp(name, "reset"))
+        close_strategy = CLOSE_RESET;
+    else {
+        fprintf(stderr, "upstream: unknown close strategy %s (default, origin, reset)\n", name);
+        return -1;
+    }
+    return 0;
+}
+/* $end upstream_set_close_strategy */
+
+/* Pick the next configured source address for this family; 0 if there is none */
+static int pick_source(int family, struct sockaddr_storage *src) {
+    int i;
+    unsigned int start = __atomic_fetch_add(&source_rr, 1, __ATOMIC_RELAXED);
+
+    for (i = 0; i < nsources; i++) {
+        struct sockaddr_storage *ss = &sources[(start + i) % nsources];
+        if (ss->ss_family == family) {
+            *src = *ss;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * pool_lookup - Find (or create) the pool for src -> dst. Pools passed on
+ *     the way with no port in use or in TIME_WAIT are freed: nothing refers
+ *     to them, and a later connection there starts a fresh one. Caller holds
+ *     pool_lock.
+ */
+static PortPool *pool_lookup(struct sockaddr_storage *src, struct sockaddr_storage *dst) {
+    PortPool *pool, **link = &pools, *found = NULL;
+    uint32_t now = now_secs();
+
+    while ((pool = *link)) {
+        if (!found && pool->src.ss_family == src->ss_family && (src->ss_family == AF_UNSPEC || addr_equal(&pool->src, src, 0)) &&
+            addr_equal(&pool->dst, dst, 1)) {
+            found = pool;
+        } else if (pool->in_use == 0 && pool->quiet_at <= now) {
+            *link = pool->next_pool;
+            free(pool->until);
+            free(pool);
+            STAT_INC(pools_reclaimed);
+            continue;
+        }
+        link = &pool->next_pool;
+    }
+    if (found)
+        return found;
+
+    if (!(pool = calloc(1, sizeof(PortPool))))
+        return NULL;
+    if (!(pool->until = calloc(port_hi - port_lo + 1, sizeof(uint32_t)))) {
+        free(pool);
+        return NULL;
+    }
+    pool->src = *src;
+    pool->dst = *dst;
+    pool->next_pool = pools;
+    pools = pool;
+    STAT_INC(pools_created);
+    return pool;
+}
+
+/* Take the next free port in the pool, or -1 if all are in use or in TIME_WAIT. Caller holds pool_lock. */
+static int pool_take(PortPool *pool) {
+    int i, nports = port_hi - port_lo + 1;
+    uint32_t now = now_secs();
+
+    for (i = 0; i < nports; i++) {
+        int idx = (pool->next + i) % nports;
+        if (pool->until[idx] != PORT_IN_USE && pool->until[idx] <= now) {
+            pool->until[idx] = PORT_IN_USE;
+            pool->in_use++;
+            pool->next = (idx + 1) % nports;
+            return port_lo + idx;
+        }
+    }
+    return -1;
+}
+
+/* Give a port back, parked for TIME_WAIT if time_wait is set. Caller holds pool_lock. */
+static void pool_release(PortPool *pool, int port, int time_wait) {
+    int idx = port - port_lo;
+
+    if (pool->until[idx] != PORT_IN_USE)
+        return;
+    pool->until[idx] = time_wait ? now_secs() + TIME_WAIT_SECS : 0;
+    if (pool->until[idx] > pool->quiet_at)
+        pool->quiet_at = pool->until[idx];
+    pool->in_use--;
+}
+
+/* Find the pool a connected socket's local port was allocated from. Caller holds pool_lock. */
+static PortPool *pool_owner(struct sockaddr_storage *local, struct sockaddr_storage *dst) {
+    PortPool *pool;
+    int port = addr_port(local);
+
+    if (port < port_lo || port > port_hi)
+        return NULL;
+    for (pool = pools; pool; pool = pool->next_pool) {
+        if (!addr_equal(&pool->dst, dst, 1) || pool->until[port - port_lo] != PORT_IN_USE)
+            continue;
+        if (pool->src.ss_family == AF_UNSPEC || addr_equal(&pool->src, local, 0))
+            return pool;
+    }
+    return NULL;
+}
+
+/*
+ * bind_source - Bind an unconnected socket to its source address before connect().
+ *     Without a port range the port is left for connect() to pick
+ *     (IP_BIND_ADDRESS_NO_PORT), so ephemeral ports are shared across
+ *     destinations. With a port range, a port is allocated from the
+ *     destination's pool. On success *pool_out is the pool used (or NULL).
+ */
+static int bind_source(int fd, struct sockaddr *dstaddr, PortPool **pool_out) {
+    struct sockaddr_storage src, dst;
+    int port, optval = 1;
+
+    *pool_out = NULL;
+    memset(&src, 0, sizeof(src));
+    memcpy(&dst, dstaddr, dstaddr->sa_family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6));
+    int have_src = pick_source(dst.ss_family, &src);
+    if (!have_src && !port_lo)
+        return 0; /* Nothing configured: plain connect() */
+
+    if (!port_lo) {
+        setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &optval, sizeof(optval));
+        return bind(fd, (SA *)&src, addr_len(&src));
+    }
+
+    /* SO_REUSEADDR lets one local port be bound towards several destinations at once */
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+
+    pthread_mutex_lock(&pool_lock);
+    if (!have_src)
+        src.ss_family = AF_UNSPEC; /* pool key: wildcard source */
+    PortPool *pool = pool_lookup(&src, &dst);
+    if (!have_src)
+        src.ss_family = dst.ss_family; /* bind to the wildcard address */
+    while (pool && (port = pool_take(pool)) > 0) {
+        addr_set_port(&src, port);
+        if (bind(fd, (SA *)&src, addr_len(&src)) == 0) {
+            pthread_mutex_unlock(&pool_lock);
+            *pool_out = pool;
+            return 0;
+        }
+        if (errno != EADDRINUSE) {
+            pool_release(pool, port, 0);
+            pthread_mutex_unlock(&pool_lock);
+            return -1;
+        }
+        /* Held by something we don't track (e.g. a previous run's TIME_WAIT): park it */
+        pool_release(pool, port, 1);
+        STAT_INC(bind_conflicts);
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    STAT_INC(port_exhaustions);
+    fprintf(stderr, "upstream: no free local port in %d-%d for this destination\n", port_lo, port_hi);
+    errno = EADDRNOTAVAIL;
+    return -1;
+}
+
+/* Release the port of a socket that never got connected */
+static void release_unconnected(int fd, PortPool *pool) {
+    struct sockaddr_storage local;
+    socklen_t len = sizeof(local);
+    int connect_errno = errno;
+
+    if (!pool || getsockname(fd, (SA *)&local, &len) < 0)
+        return;
+    pthread_mutex_lock(&pool_lock);
+    /* A 4-tuple still in TIME_WAIT fails connect() with EADDRNOTAVAIL: keep it parked */
+    pool_release(pool, addr_port(&local), connect_errno == EADDRNOTAVAIL);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/*
+ * upstream_connect - Open a connection to the origin at <hostname, port>.
+ *     Same contract as open_clientfd(): returns a connected descriptor,
+ *     -2 for getaddrinfo errors, or -1 with errno set for other errors.
+ *     upstream_connect_other() skips the address excludefd is connected
+ *     to, to reach a different replica behind the same name. Origins
+ *     mapped to a Unix-domain socket skip DNS, source binding and port
+ *     pools altogether. upstream_connect_timed() gives up on each address
+ *     after timeout_ms (Linux bounds a blocking connect() by SO_SNDTIMEO),
+ *     so an unreachable host costs that much instead of the SYN timeout.
+ */
+/* $begin upstream_connect */
+static int connect_to(char *hostname, char *port, int excludefd, int timeout_ms);
+
+int upstream_connect(char *hostname, char *port) { return connect_to(hostname, port, -1, 0); }
+
+int upstream_connect_other(char *hostname, char *port, int excludefd) { return connect_to(hostname, port, excludefd, 0); }
+
+int upstream_connect_timed(char *hostname, char *port, int timeout_ms) { return connect_to(hostname, port, -1, timeout_ms); }
+
+static int connect_to(char *hostname, char *port, int excludefd, int timeout_ms) {
+    struct timeval tv = {.tv_sec = timeout_ms / 1000, .tv_usec = timeout_ms % 1000 * 1000}, untimed = {0, 0};
+    int clientfd = -1, rc;
+    struct addrinfo hints, *listp, *p;
+    struct sockaddr_storage exclude, candidate;
+    socklen_t exclude_len = sizeof(exclude);
+    PortPool *pool;
+    char *path;
+
+    if ((path = unix_path(hostname, port))) {
+        if ((clientfd = open_unix_clientfd(path)) < 0) {
+            STAT_INC(unix_connect_failures);
+            STAT_INC(connect_failures);
+            return -1;
+        }
+        STAT_INC(unix_connects);
+        STAT_INC(connects);
+        return clientfd;
+    }
+
+    if (excludefd < 0 || getpeername(excludefd, (SA *)&exclude, &exclude_len) < 0)
+        exclude.ss_family = AF_UNSPEC;
+
+    /* Get a list of potential server addresses */
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    if ((rc = getaddrinfo(hostname, port, &hints, &listp)) != 0) {
+        fprintf(stderr, "getaddrinfo failed (%s:%s): %s\n", hostname, port, gai_strerror(rc));
+        STAT_INC(connect_failures);
+        return -2;
+    }
+
+    /* Walk the list for one that we can successfully connect to */
+    for (p = listp; p; p = p->ai_next) {
+        memcpy(&candidate, p->ai_addr, p->ai_addrlen);
+        if (exclude.ss_family != AF_UNSPEC && addr_equal(&candidate, &exclude, 1))
+            continue;
+        if ((clientfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+            continue;
+        if (timeout_ms > 0)
+            setsockopt(clientfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        if (bind_source(clientfd, p->ai_addr, &pool) == 0 && connect(clientfd, p->ai_addr, p->ai_addrlen) == 0) {
+            if (timeout_ms > 0)
+                setsockopt(clientfd, SOL_SOCKET, SO_SNDTIMEO, &untimed, sizeof(untimed));
+            break; /* Success */
+        }
+        release_unconnected(clientfd, pool);
+        close(clientfd);
+    }
+
+    freeaddrinfo(listp);
+    if (!p) {
+        STAT_INC(connect_failures);
+        return -1;
+    }
+    STAT_INC(connects);
+    return clientfd;
+}
+/* $end upstream_connect */
+
+/*
+ * upstream_wait_response - Wait up to timeout_ms (-1 = forever) for the
+ *     origin to start answering. Returns 1 once response bytes are
+ *     readable, 0 if the origin closed or reset without sending any, and
+ *     -1 on timeout. Nothing is consumed from the socket.
+ */
+/* $begin upstream_wait_response */
+int upstream_wait_response(int fd, int timeout_ms) {
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    char c;
+    int rc;
+
+    while ((rc = poll(&pfd, 1, timeout_ms)) < 0 && errno == EINTR)
+        ;
+    if (rc == 0)
+        return -1;
+    return rc > 0 && recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) > 0;
+}
+/* $end upstream_wait_response */
+
+/* Has the origin already sent its FIN (or a RST)? */
+static int origin_closed(int fd) {
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+}
+
+/* Drain the socket until the origin closes or timeout_ms passes. Returns 1 if the origin closed. */
+static int wait_for_origin_close(int fd, int timeout_ms) {
+    char buf[MAXLINE];
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    struct timespec start, now;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (1) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int left = timeout_ms - ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000);
+        if (left <= 0 || poll(&pfd, 1, left) <= 0)
+            return 0;
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n == 0 || (n < 0 && errno != EINTR))
+            return 1;
+    }
+}
+
+/*
+ * upstream_close - Close an upstream connection according to the close strategy.
+ *     Whoever sends the first FIN holds TIME_WAIT. The proxy always asks the
+ *     origin to close (Connection: close), so after a full relay the origin
+ *     has normally closed first and our close is passive. Only when we
+ *     really closed first is the local port parked for TIME_WAIT_SECS.
+ */
+/* $begin upstream_close */
+static void close_upstream(int fd, int abort) {
+    struct sockaddr_storage local, peer;
+    socklen_t llen = sizeof(local), plen = sizeof(peer);
+    int have_addrs = port_lo && getsockname(fd, (SA *)&local, &llen) == 0 && getpeername(fd, (SA *)&peer, &plen) == 0;
+    int passive = origin_closed(fd), reset = 0;
+
+    if (!passive && !abort && close_strategy == CLOSE_ORIGIN)
+        passive = wait_for_origin_close(fd, ORIGIN_CLOSE_WAIT_MS);
+    if (!passive && (abort || close_strategy != CLOSE_DEFAULT)) {
+        /* Origin still hasn't closed: abort rather than take TIME_WAIT ourselves */
+        struct linger lg = {.l_onoff = 1, .l_linger = 0};
+        setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+        reset = 1;
+    }
+
+    if (reset)
+        STAT_INC(closes_reset);
+    else if (passive)
+        STAT_INC(closes_passive);
+    else
+        STAT_INC(closes_active);
+
+    if (have_addrs) {
+        pthread_mutex_lock(&pool_lock);
+        PortPool *pool = pool_owner(&local, &peer);
+        if (pool)
+            pool_release(pool, addr_port(&local), !passive && !reset);
+        pthread_mutex_unlock(&pool_lock);
+    }
+    Close(fd);
+}
+
+void upstream_close(int fd) { close_upstream(fd, 0); }
+
+/* Reset a connection nothing was sent on (or that is being cancelled) without waiting */
+void upstream_abort(int fd) { close_upstream(fd, 1); }
+/* $end upstream_close */
+
+/* Find the value of header name in a response head, or NULL */
+static char *find_header(char *head, char *name) {
+    size_t n = strlen(name);
+    char *line;
+
+    for (line = strstr(head, "\r\n"); line && line[2] != '\r'; line = strstr(line + 2, "\r\n"))
+        if (!strncasecmp(line + 2, name, n) && line[2 + n] == ':')
+            return line + 3 + n + strspn(line + 3 + n, " \t");
+    return NULL;
+}
+
+/* A Content-Length value as a length: plain decimal digits only, else -1 (no sign, garbage or overflow) */
+static long long content_length(char *value) {
+    long long n = 0;
+
+    if (*value < '0' || *value > '9')
+        return -1;
+    for (; *value >= '0' && *value <= '9'; value++) {
+        if (n > (LLONG_MAX - 9) / 10)
+            return -1;
+        n = n * 10 + *value - '0';
+    }
+    value += strspn(value, " \t");
+    return *value == '\r' || *value == '\0' ? n : -1;
+}
+
+int upstream_idempotent(char *method) { return !strcasecmp(method, "GET") || !strcasecmp(method, "HEAD") || !strcasecmp(method, "OPTIONS"); }
+
+/*
+ * upstream_response_length - Given a response head (NUL-terminated, up to
+ *     and including the blank line) to a request that asked for HTTP/1.0
+ *     keep-alive, return the total response length if the server keeps the
+ *     connection open afterwards, or -1 if the response ends at close.
+ */
+/* $begin upstream_response_length */
+ssize_t upstream_response_length(char *head, char *method) {
+    char *end, *value;
+    long long body;
+    int code;
+
+    if (!(end = strstr(head, "\r\n\r\n")))
+        return -1;
+    if (sscanf(head, "HTTP/%*d.%*d %d", &code) != 1 || !(value = find_header(head, "Connection")) || strncasecmp(value, "keep-alive", 10))
+        return -1;
+    if (!strcasecmp(method, "HEAD") || code == 204 || code == 304 || code / 100 == 1)
+        return end + 4 - head;
+    if (!(value = find_header(head, "Content-Length")) || (body = content_length(value)) < 0)
+        return -1;
+    return end + 4 - head + body;
+}
+/* $end upstream_response_length */
+
+/*
+ * upstream_cacheable - Given a response head (NUL-terminated, as above),
+ *     return 0 if the response cannot or must not be cached: its body is
+ *     declared longer than max_size (or its declared length is not a
+ *     number), or Cache-Control says no-store or private. Anything else may be.
+ */
+/* $begin upstream_cacheable */
+int upstream_cacheable(char *head, size_t max_size) {
+    char *value, *end;
+
+    if ((value = find_header(head, "Content-Length")) && (content_length(value) < 0 || content_length(value) > (long long)max_size))
+        return 0;
+    if ((value = find_header(head, "Cache-Control")))
+        for (end = value + strcspn(value, "\r\n"); value < end; value++)
+            if (!strncasecmp(value, "no-store", 8) || !strncasecmp(value, "private", 7))
+                return 0;
+    return 1;
+}
+/* $end upstream_cacheable */
+
+/*
+ * upstream_strip_hop_by_hop - A response from a connection the proxy keeps
+ *     (a parent's or a TLS origin's) says so in Connection and Keep-Alive,
+ *     but those are for the proxy's hop only: the client's connection closes
+ *     after the response. Remove them, Proxy-Connection and any header that
+ *     Connection names from the head at the front of buf (len bytes, which
+ *     may run on into the body) and return the new length. A buf without a
+ *     whole head is left alone.
+ */
+/* $begin upstream_strip_hop_by_hop */
+size_t upstream_strip_hop_by_hop(char *buf, size_t len) {
+    char names[MAXLINE] = ",connection,keep-alive,proxy-connection,", key[MAXLINE], *end = NULL, *line, *next, *colon, *p;
+    size_t i, n, used = strlen(names);
+    int pass;
+
+    for (i = 3; !end && i < len; i++)
+        if (!memcmp(buf + i - 3, "\r\n\r\n", 4))
+            end = buf + i + 1;
+    if (!end)
+        return len;
+    /* First collect what Connection lists, then drop every listed header */
+    for (pass = 0; pass < 2; pass++) {
+        for (line = (char *)memchr(buf, '\n', end - buf) + 1; line < end - 2; line = next) {
+            next = (char *)memchr(line, '\n', end - line) + 1;
+            if (!(colon = memchr(line, ':', next - line)) || (n = colon - line) + 3 > sizeof(key))
+                continue;
+            if (pass == 0 && n == 10 && !strncasecmp(line, "Connection", 10)) {
+                for (p = colon + 1; p < next; p += n) {
+                    p += strspn(p, " \t,");
+                    n = strcspn(p, " \t,\r\n");
+                    if (n > 0 && used + n + 1 < sizeof(names)) {
+                        for (i = 0; i < n; i++)
+                            names[used++] = tolower((unsigned char)p[i]);
+                        names[used++] = ',';
+                        names[used] = '\0';
+                    }
+                    if (n == 0)
+                        break;
+                }
+            } else if (pass == 1) {
+                key[0] = ',';
+                for (i = 0; i < n; i++)
+                    key[i + 1] = tolower((unsigned char)line[i]);
+                key[n + 1] = ',';
+                key[n + 2] = '\0';
+                if (strstr(names, key)) {
+                    memmove(line, next, buf + len - next);
+                    len -= next - line;
+                    end -= next - line;
+                    next = line;
+                }
+            }
+        }
+    }
+    return len;
+}
+/* $end upstream_strip_hop_by_hop */
+
+/* $begin upstream_stats */
+int upstream_stats(char *buf, size_t size) {
+    static const char *strategies[] = {"default", "origin", "reset"};
+    char src[INET6_ADDRSTRLEN], dst[INET6_ADDRSTRLEN];
+    int len = 0;
+    PortPool *pool;
+
+    len += snprintf(buf + len, size - len, "upstream.connects %lu\nupstream.connect_failures %lu\n", STAT_GET(connects),
+                    STAT_GET(connect_failures));
+    len += snprintf(buf + len, size - len, "upstream.close_strategy %s\n", strategies[close_strategy]);
+    len += snprintf(buf + len, size - len, "upstream.closes_active %lu\nupstream.closes_passive %lu\nupstream.closes_reset %lu\n",
+                    STAT_GET(closes_active), STAT_GET(closes_passive), STAT_GET(closes_reset));
+    len += snprintf(buf + len, size - len, "upstream.unix_origins %d\nupstream.unix_connects %lu\nupstream.unix_connect_failures %lu\n",
+                    nunix_origins, STAT_GET(unix_connects), STAT_GET(unix_connect_failures));
+    len += snprintf(buf + len, size - len, "upstream.source_addresses %d\n", nsources);
+    if (!port_lo) {
+        len += snprintf(buf + len, size - len, "upstream.port_range kernel\n");
+        return len;
+    }
+
+    int nports = port_hi - port_lo + 1;
+    len += snprintf(buf + len, size - len, "upstream.port_range %d-%d\nupstream.port_exhaustions %lu\nupstream.bind_conflicts %lu\n",
+                    port_lo, port_hi, STAT_GET(port_exhaustions), STAT_GET(bind_conflicts));
+    len += snprintf(buf + len, size - len, "upstream.pools_created %lu\nupstream.pools_reclaimed %lu\n", STAT_GET(pools_created),
+                    STAT_GET(pools_reclaimed));
+
+    pthread_mutex_lock(&pool_lock);
+    uint32_t now = now_secs();
+    for (pool = pools; pool && len < size; pool = pool->next_pool) {
+        int i, time_wait = 0;
+        for (i = 0; i < nports; i++)
+            if (pool->until[i] != PORT_IN_USE && pool->until[i] > now)
+                time_wait++;
+        addr_format(&pool->src, src, sizeof(src));
+        addr_format(&pool->dst, dst, sizeof(dst));
+        len += snprintf(buf + len, size - len, "upstream.pool %s->%s:%d in_use %d time_wait %d free %d utilization %.1f%%\n", src, dst,
+                        addr_port(&pool->dst), pool->in_use, time_wait, nports - pool->in_use - time_wait,
+                        100.0 * (pool->in_use + time_wait) / nports);
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return len < size ? len : size - 1;
+}
+/* $end upstream_stats */
@@ -0,0 +1,66 @@
+/*
+ * upstream.h - Upstream (origin server) connection management for the proxy
+ *
+ * Every cache miss opens a fresh socket to the origin. At a high miss rate
+ * to one origin this burns through ephemeral ports and piles up TIME_WAIT
+ * sockets, so upstream connections are opened and closed through here:
+ *   - optional source IPs, chosen round-robin per destination family
+ *   - IP_BIND_ADDRESS_NO_PORT so the kernel picks the port at connect()
+ *     time using the full 4-tuple instead of reserving it at bind()
+ *   - optional explicit local port range, allocated per destination
+ *   - close strategies that leave TIME_WAIT with the origin where possible
+ *   - an origin map that reaches chosen host:port origins (a sidecar on the
+ *     same host) over a Unix-domain socket instead of loopback TCP
+ */
+/* $begin upstream.h */
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+#include "csapp.h"
+
+/* Linux holds a closed 4-tuple in TIME_WAIT for 2*MSL = 60 seconds */
+#define TIME_WAIT_SECS 60
+
+/* How long CLOSE_ORIGIN waits for the origin to close first */
+#define ORIGIN_CLOSE_WAIT_MS 1000
+
+/* How the proxy gives up an upstream socket once a transaction is over */
+typedef enum {
+    CLOSE_DEFAULT, /* plain close(); TIME_WAIT lands on whoever sends FIN first */
+    CLOSE_ORIGIN,  /* wait for the origin's FIN so the origin holds TIME_WAIT */
+    CLOSE_RESET,   /* abortive close (SO_LINGER 0); nobody holds TIME_WAIT */
+} close_strategy_t;
+
+/* Configuration, called from main() before any connection is made */
+int upstream_set_sources(char *list);
+int upstream_set_port_range(char *range);
+int upstream_set_close_strategy(char *name);
+int upstream_map_unix(char *spec);
+
+/* Open/close a connection to an origin */
+int upstream_connect(char *hostname, char *port);
+int upstream_connect_other(char *hostname, char *port, int excludefd);
+int upstream_connect_timed(char *hostname, char *port, int timeout_ms);
+void upstream_close(int fd);
+void upstream_abort(int fd);
+
+/* Wait for the origin's response to start: 1 started, 0 closed/reset first, -1 timeout */
+int upstream_wait_response(int fd, int timeout_ms);
+
+/* Whether a request may be sent again after a failure; the proxy forwards no request bodies */
+int upstream_idempotent(char *method);
+
+/* Total length of a keep-alive response from its head, or -1 if it ends at close */
+ssize_t upstream_response_length(char *head, char *method);
+
+/* Whether a response may be cached judging by its head: 0 if over max_size or no-store/private */
+int upstream_cacheable(char *head, size_t max_size);
+
+/* Drop hop-by-hop headers (Connection, Keep-Alive and those Connection names) from the head at the front of buf; returns the new length */
+size_t upstream_strip_hop_by_hop(char *buf, size_t len);
+
+/* Write a plain-text report of port-pool utilization into buf */
+int upstream_stats(char *buf, size_t size);
+
+#endif /* __UPSTREAM_H__ */
+/* $end upstream.h */
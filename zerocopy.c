@@ -0,0 +1,265 @@
+/*
+ * zerocopy.c - MSG_ZEROCOPY sends for large cache hits
+ */
+#include "zerocopy.h"
+#include "netio.h"
+#include "stats.h"
+#include <linux/errqueue.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60 /* Linux 4.14+, missing from older headers */
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+
+typedef struct Parked {
+    int fd;              // Duplicate of the client socket, kept open to read its completions.
+    int pending;         // Zerocopy send calls not acknowledged yet.
+    IoChain *hold;       // The reference keeping the sent buffers alive.
+    struct Parked *next; // Pointer to the next parked send.
+} Parked;
+
+static size_t threshold = 0; // 0 = off
+
+/* Sends whose completions are still outstanding, reaped by the reaper thread */
+static Parked *parked = NULL;
+static size_t parked_bytes = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t nonempty = PTHREAD_COND_INITIALIZER;
+static pthread_once_t reaper_once = PTHREAD_ONCE_INIT;
+
+static unsigned long sends, bytes, calls, completions, copied, fallbacks, parks, over_cap;
+
+/* $begin zerocopy_configure */
+int zerocopy_configure(char *spec) {
+    char *end;
+    double value = strtod(spec, &end);
+
+    if (*end == 'k' || *end == 'K')
+        value *= 1024, end++;
+    if (*end != '\0' || value < ZEROCOPY_MIN) {
+        fprintf(stderr, "zerocopy: bad threshold %s (expected bytes >= %d, k suffix allowed)\n", spec, ZEROCOPY_MIN);
+        return -1;
+    }
+    threshold = (size_t)value;
+    return 0;
+}
+/* $end zerocopy_configure */
+
+/* $begin zerocopy_wanted */
+int zerocopy_wanted(size_t size) {
+    size_t held;
+
+    if (threshold == 0 || size < threshold)
+        return 0;
+    pthread_mutex_lock(&lock);
+    held = parked_bytes;
+    pthread_mutex_unlock(&lock);
+    if (held + size > ZEROCOPY_PARKED_MAX) {
+        STAT_INC(over_cap); // Too much already waits on slow clients: copy this one.
+        return 0;
+    }
+    return 1;
+}
+/* $end zerocopy_wanted */
+
+/*
+ * reap - Read completion notifications off fd's error queue; returns how
+ *     many send calls they acknowledge (each covers the range lo..hi), 0 if
+ *     none is queued, or -1 on an error.
+ */
+static int reap(int fd) {
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    struct sock_extended_err *ee;
+    int acked = 0;
+
+    while (1) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return acked;
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) || (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+                continue;
+            ee = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY || ee->ee_errno != 0)
+                continue;
+            acked += ee->ee_data - ee->ee_info + 1;
+            STAT_INC(completions);
+            if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                STAT_INC(copied);
+        }
+    }
+}
+
+/*
+ * reaper - Waits on the parked sockets' error queues (a queued notification
+ *     makes a socket poll ready) and releases each parked send's buffers
+ *     once all its completions are in. Entries are only ever removed here,
+ *     so they can be polled and reaped without the lock.
+ */
+static void *reaper(void *arg) {
+    static struct pollfd fds[ZEROCOPY_PARKED_MAX / ZEROCOPY_MIN];
+    static Parked *entries[ZEROCOPY_PARKED_MAX / ZEROCOPY_MIN];
+    Parked **pp, *p;
+    int i, n, acked, hung;
+
+    while (1) {
+        pthread_mutex_lock(&lock);
+        while (!parked)
+            pthread_cond_wait(&nonempty, &lock);
+        for (n = 0, p = parked; p && n < ZEROCOPY_PARKED_MAX / ZEROCOPY_MIN; p = p->next, n++) {
+            entries[n] = p;
+            fds[n] = (struct pollfd){.fd = p->fd, .events = 0};
+        }
+        pthread_mutex_unlock(&lock);
+
+        poll(fds, n, 100);
+        for (i = hung = 0; i < n; i++) {
+            if ((acked = reap(entries[i]->fd)) > 0)
+                entries[i]->pending -= acked;
+            else if (fds[i].revents & (POLLHUP | POLLNVAL))
+                hung = 1;
+        }
+
+        pthread_mutex_lock(&lock);
+        for (pp = &parked; (p = *pp);) {
+            if (p->pending > 0) {
+                pp = &p->next;
+                continue;
+            }
+            *pp = p->next;
+            parked_bytes -= p->hold->len;
+            Close(p->fd);
+            iochain_release(p->hold);
+            free(p);
+        }
+        pthread_mutex_unlock(&lock);
+        if (hung)
+            usleep(1000); // A hung-up socket polls ready at once; its last completions are on their way.
+    }
+    return NULL;
+}
+
+static void start_reaper(void) {
+    pthread_t tid;
+
+    Pthread_create(&tid, NULL, reaper, NULL);
+    pthread_detach(tid);
+}
+
+/*
+ * park - Hand a send whose completions are outstanding to the reaper. The
+ *     caller is done writing, so the write side is shut (the client still
+ *     gets its FIN when the worker closes fd) and a duplicate of the socket
+ *     stays open for the completions. A client that stops reading is
+ *     dropped after ZEROCOPY_WAIT_SECS, which frees the pages too.
+ */
+static void park(int fd, int pending, IoChain *hold) {
+    unsigned timeout_ms = ZEROCOPY_WAIT_SECS * 1000;
+    Parked *p = malloc(sizeof(Parked));
+
+    pthread_once(&reaper_once, start_reaper);
+    if (!p || (p->fd = dup(fd)) < 0) {
+        free(p);
+        fprintf(stderr, "zerocopy: cannot park a send; its buffers stay pinned\n");
+        return; // Never free pages the kernel may still read.
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &timeout_ms, sizeof(timeout_ms));
+    shutdown(fd, SHUT_WR);
+    p->pending = pending;
+    p->hold = hold;
+    pthread_mutex_lock(&lock);
+    p->next = parked;
+    parked = p;
+    parked_bytes += hold->len;
+    pthread_cond_signal(&nonempty);
+    pthread_mutex_unlock(&lock);
+    STAT_INC(parks);
+}
+
+/* $begin zerocopy_send */
+void zerocopy_send(int fd, struct iovec *iov, int iovcnt, IoChain *hold) {
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = iovcnt};
+    ssize_t w;
+    int one = 1, pending = 0, acked, flags = MSG_ZEROCOPY | MSG_NOSIGNAL;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) {
+        STAT_INC(fallbacks); // Not a TCP socket, or a kernel without it.
+        netio_writev(fd, iov, iovcnt);
+        iochain_release(hold);
+        return;
+    }
+
+    STAT_INC(sends);
+    while (msg.msg_iovlen > 0) {
+        if ((w = sendmsg(fd, &msg, flags)) < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == ENOBUFS && flags & MSG_ZEROCOPY) { // Over the pinned-memory limit (optmem_max): copy the rest.
+                STAT_INC(fallbacks);
+                flags = MSG_NOSIGNAL;
+                continue;
+            }
+            netio_error(1);
+            break;
+        }
+        if (flags & MSG_ZEROCOPY) {
+            pending++;
+            STAT_INC(calls);
+            STAT_ADD(bytes, w);
+        }
+        while (msg.msg_iovlen > 0 && (size_t)w >= msg.msg_iov->iov_len) { // Skip what went out; resume mid-buffer.
+            w -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + w;
+            msg.msg_iov->iov_len -= w;
+        }
+    }
+
+    /* Completions usually follow at once (always, where the kernel copied); otherwise park the buffers */
+    if (pending > 0 && (acked = reap(fd)) > 0)
+        pending -= acked;
+    if (pending > 0)
+        park(fd, pending, hold);
+    else
+        iochain_release(hold);
+}
+/* $end zerocopy_send */
+
+/* $begin zerocopy_stats */
+int zerocopy_stats(char *buf, size_t size) {
+    int len = 0;
+
+    len += snprintf(buf + len, size - len, "zerocopy.threshold %zu\nzerocopy.sends %lu\nzerocopy.bytes %lu\nzerocopy.calls %lu\n", threshold,
+                    STAT_GET(sends), STAT_GET(bytes), STAT_GET(calls));
+    len += snprintf(buf + len, size - len, "zerocopy.completions %lu\nzerocopy.copied %lu\nzerocopy.fallbacks %lu\n", STAT_GET(completions),
+                    STAT_GET(copied), STAT_GET(fallbacks));
+    pthread_mutex_lock(&lock);
+    size_t held = parked_bytes;
+    pthread_mutex_unlock(&lock);
+    len += snprintf(buf + len, size - len, "zerocopy.parks %lu\nzerocopy.parked_bytes %zu\nzerocopy.over_cap %lu\n", STAT_GET(parks), held,
+                    STAT_GET(over_cap));
+    return len < size ? len : size - 1;
+}
+/* $end zerocopy_stats */
@@ -0,0 +1,54 @@
+/*
+ * zerocopy.h - MSG_ZEROCOPY sends for large cache hits
+ *
+ * A cache hit is written with send(), which copies the whole object (up to
+ * MAX_OBJECT_SIZE) into socket buffers. At high fan-out on large objects
+ * those copies dominate the proxy's CPU time. With -Z, hits of at least the
+ * threshold size are sent with MSG_ZEROCOPY instead: the kernel pins the
+ * object's pages and transmits straight from them.
+ *
+ * The pages are only borrowed, so the object must not be freed or reused
+ * until the kernel says it is done with them. Each zerocopy sendmsg()
+ * produces one completion notification on the socket's error queue
+ * (acknowledged ranges of send calls). Objects stay pinned through the
+ * reference the cache hit holds on their buffer chain (eviction and purge
+ * only drop the cache's). The worker does not wait for the client to take
+ * the data: a send whose completions are outstanding is parked with that
+ * reference and a reaper thread drops it once they are in. Parked bytes are
+ * capped at ZEROCOPY_PARKED_MAX (hits past it are copied) and a client
+ * that stops reading is dropped after ZEROCOPY_WAIT_SECS.
+ *
+ * Where the kernel cannot send from the pages (loopback, some NICs) it
+ * copies after all and flags the completion; sockets that do not support
+ * SO_ZEROCOPY (Unix-domain, h2 streams) get an ordinary send.
+ */
+/* $begin zerocopy.h */
+#ifndef __ZEROCOPY_H__
+#define __ZEROCOPY_H__
+
+#include "csapp.h"
+#include "iobuf.h"
+
+#define ZEROCOPY_MIN 4096              /* Smallest threshold: below a page, pinning costs more than copying */
+#define ZEROCOPY_WAIT_SECS 10          /* A parked client that takes no data for this long is dropped */
+#define ZEROCOPY_PARKED_MAX (8 << 20) /* Bytes parked at once waiting for completions */
+
+/* Send cache hits of at least threshold bytes ("16k", ...) with MSG_ZEROCOPY */
+int zerocopy_configure(char *threshold);
+
+/* Whether an object of size bytes should be sent with zerocopy_send (not while the parked bytes are at the cap) */
+int zerocopy_wanted(size_t size);
+
+/*
+ * Send the iovcnt buffers in iov (consumed as they go out), which hold
+ * references to, as the last write on fd. Takes over the caller's reference
+ * to hold and releases it once the kernel is done with the buffers, at once
+ * or later from the reaper. Send errors are counted as for netio_writev.
+ */
+void zerocopy_send(int fd, struct iovec *iov, int iovcnt, IoChain *hold);
+
+/* Write a plain-text report of zerocopy sends and completions into buf */
+int zerocopy_stats(char *buf, size_t size);
+
+#endif /* __ZEROCOPY_H__ */
+/* $end zerocopy.h */